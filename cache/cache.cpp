@@ -0,0 +1,185 @@
+#include "cache.h"
+#include "../image/image.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+
+namespace {
+    uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+    uint64_t finalize(uint64_t h) {
+        h ^= h >> 30;
+        h *= 0xbf58476d1ce4e5b9ull;
+        h ^= h >> 27;
+        h *= 0x94d049bb133111ebull;
+        return h ^ (h >> 31);
+    }
+
+    // one 64-bit lane of the key; two differently seeded lanes make 128 bits
+    uint64_t hash(std::string_view bytes, uint64_t seed) {
+        uint64_t h = seed ^ (bytes.size() * 0x9e3779b97f4a7c15ull);
+        size_t i = 0;
+        for (; i + 8 <= bytes.size(); i += 8) {
+            uint64_t w;
+            std::memcpy(&w, bytes.data() + i, 8);
+            h = rotl(h ^ (w * 0x87c37b91114253d5ull), 31) * 0x4cf5ad432745937full;
+        }
+        uint64_t tail = 0;
+        if (i < bytes.size()) {
+            std::memcpy(&tail, bytes.data() + i, bytes.size() - i);
+        }
+        h = rotl(h ^ (tail * 0x87c37b91114253d5ull), 31) * 0x4cf5ad432745937full;
+        return finalize(h);
+    }
+
+    // this build's identity: a hash of the running executable, so any
+    // rebuild changes every key, however little changed and however
+    // quickly it followed the last. Empty where the executable cannot be
+    // read, which disables the cache rather than risk a stale hit
+    string buildId() {
+        try {
+            const MappedFile self("/proc/self/exe");
+            const std::string_view bytes = self.view();
+            if (bytes.empty()) {
+                return {};
+            }
+            char id[33];
+            snprintf(id, sizeof(id), "%016llx%016llx",
+                     static_cast<unsigned long long>(hash(bytes, 0)),
+                     static_cast<unsigned long long>(hash(bytes, ~uint64_t(0))));
+            return id;
+        } catch (const std::exception &) {
+            return {};
+        }
+    }
+
+    std::filesystem::path cacheRoot() {
+        if (const char *xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg) {
+            return std::filesystem::path(xdg) / "pscompiler";
+        }
+        if (const char *home = std::getenv("HOME"); home && *home) {
+            return std::filesystem::path(home) / ".cache" / "pscompiler";
+        }
+        return {};
+    }
+}
+
+CompileCache::CompileCache(std::string_view flags) : flags(flags) {
+    // an entry written by any other binary misses
+    static const string build = buildId();
+    this->flags += "|" + std::to_string(image::version) + "|" + build;
+    std::error_code error;
+    dir = build.empty() ? std::filesystem::path() : cacheRoot();
+    if (dir.empty() || (std::filesystem::create_directories(dir, error), error)) {
+        dir.clear();
+        return;
+    }
+    readStats();
+}
+
+string CompileCache::entry(std::string_view source) const {
+    if (!enabled()) {
+        return {};
+    }
+    const uint64_t salt = hash(flags, 0);
+    char name[40];
+    snprintf(name, sizeof(name), "%016llx%016llx.psc",
+             static_cast<unsigned long long>(hash(source, salt)),
+             static_cast<unsigned long long>(hash(source, ~salt)));
+    return (dir / name).string();
+}
+
+std::shared_ptr<MappedFile> CompileCache::lookup(std::string_view source) {
+    const string path = entry(source);
+    if (path.empty() || !std::filesystem::exists(path)) {
+        return nullptr;
+    }
+    try {
+        auto file = std::make_shared<MappedFile>(path);
+        if (!image::isValid(file->view())) {
+            return nullptr;
+        }
+        // recently used, so prune() keeps it
+        std::error_code error;
+        std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(),
+                                         error);
+        return file;
+    } catch (const std::exception &) {
+        return nullptr;
+    }
+}
+
+// the totals, then one line per hit since a miss last wrote them
+void CompileCache::readStats() {
+    hits = misses = 0;
+    std::ifstream file(dir / "stats");
+    string label;
+    uint64_t count;
+    while (file >> label >> count) {
+        (label == "hits" ? hits : misses) += count;
+    }
+}
+
+// A hit only appends a line to the stats, so a run that compiles nothing
+// writes nothing else. A miss, which writes an entry anyway, folds them
+// into the totals and prunes the entries. Concurrent runs mostly add up;
+// a lost update only skews the counters, never an entry
+void CompileCache::record(bool hit) {
+    if (!enabled()) {
+        return;
+    }
+    if (hit) {
+        std::ofstream(dir / "stats", std::ios::app) << "hits 1\n";
+        readStats();
+        return;
+    }
+    readStats();
+    ++misses;
+    prune();
+    const auto temp = dir / ("stats.tmp" + std::to_string(std::random_device{}()));
+    {
+        std::ofstream file(temp);
+        file << "hits " << hits << "\nmisses " << misses << "\n";
+    }
+    std::error_code error;
+    std::filesystem::rename(temp, dir / "stats", error);
+    if (error) {
+        std::filesystem::remove(temp, error);
+    }
+}
+
+// deletes the least recently used entries, counting any left by an
+// interrupted write, until the rest take up at most maxBytes
+void CompileCache::prune() {
+    std::error_code error;
+    vector<std::pair<std::filesystem::file_time_type, std::filesystem::path>> entries;
+    uintmax_t total = 0;
+    for (const auto &file : std::filesystem::directory_iterator(dir, error)) {
+        const auto &path = file.path();
+        if (path.filename().string().find(".psc") == string::npos) {
+            continue;
+        }
+        const uintmax_t size = file.file_size(error);
+        const auto written = file.last_write_time(error);
+        if (error) {
+            continue;
+        }
+        total += size;
+        entries.emplace_back(written, path);
+    }
+    if (total <= maxBytes) {
+        return;
+    }
+    std::sort(entries.begin(), entries.end());
+    for (const auto &[written, path] : entries) {
+        if (total <= maxBytes) {
+            break;
+        }
+        const uintmax_t size = std::filesystem::file_size(path, error);
+        if (!error && std::filesystem::remove(path, error)) {
+            total -= size;
+        }
+    }
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include "../common.h"
+#include "../source/source.h"
+#include <filesystem>
+#include <memory>
+#include <string_view>
+
+// Transparent on-disk cache of compiled images for runFile. Entries live in
+// $XDG_CACHE_HOME/pscompiler (or ~/.cache/pscompiler) under a 128-bit hash
+// of the source text, the image format version, a hash of the compiler's
+// own executable and the code generation flags, so a stale entry is simply
+// never looked up again. Entries are written atomically by image::write,
+// and on each miss the least recently used ones are deleted until the
+// rest fit in maxBytes, which is how entries of other builds go. Hit and
+// miss counts are kept in a `stats` file next to them.
+class CompileCache {
+    public:
+        explicit CompileCache(std::string_view flags);
+        bool enabled() const { return !dir.empty(); }
+        // where the image for `source` lives (or will), empty when disabled
+        string entry(std::string_view source) const;
+        // the mapped image for `source`, or nullptr on a miss
+        std::shared_ptr<MappedFile> lookup(std::string_view source);
+        void record(bool hit);
+        uint64_t hits {0};
+        uint64_t misses {0};
+        static constexpr uintmax_t maxBytes = uintmax_t {64} << 20;
+    private:
+        std::filesystem::path dir;
+        string flags;
+        void readStats();
+        void prune();
+};
@@ -1,13 +1,328 @@
 #include "chunk.h"
 #include "../tokens/tokens.h"
 #include "../common.h"
+#include <algorithm>
 #include <cstdio>
+#include <limits>
 
-void Chunk::writeChunk(OpCode opCode) {
-    writeByte(static_cast<std::byte>(opCode));
+size_t ValueHash::operator()(const Value &value) const {
+    return std::visit([](const auto &v) -> size_t {
+        using T = std::decay_t<decltype(v)>;
+        if constexpr (std::is_same_v<T, std::monostate>) {
+            return 0;
+        } else if constexpr (std::is_same_v<T, Symbol>) {
+            return std::hash<uint32_t>{}(v.id);
+        } else if constexpr (std::is_same_v<T, Reference>) {
+            return std::hash<uint32_t>{}(v.index);
+        } else {
+            return std::hash<T>{}(v);
+        }
+    }, value);
+}
+
+uint32_t SwitchTable::target(const Value &selector) const {
+    if (!targets.empty()) {
+        if (selector.index() != type) {
+            return otherwise;
+        }
+        const i64 key = holds_alternative<char>(selector) ? get<char>(selector) : get<i64>(selector);
+        return key >= low && static_cast<uint64_t>(key - low) < targets.size() ? targets[key - low]
+                                                                                : otherwise;
+    }
+    const auto it = labels.find(selector);
+    if (it != labels.end()) {
+        return it->second;
+    }
+    for (const Range &range : ranges) {
+        if (!(selector < range.low) && !(range.high < selector)) {
+            return range.target;
+        }
+    }
+    return otherwise;
+}
+
+void SwitchTable::relocate(const std::function<uint32_t(uint32_t)> &moved) {
+    for (auto &target : targets) {
+        target = moved(target);
+    }
+    for (auto &label : labels) {
+        label.second = moved(label.second);
+    }
+    for (auto &range : ranges) {
+        range.target = moved(range.target);
+    }
+    otherwise = moved(otherwise);
+    end = moved(end);
+}
+
+void Chunk::truncate(size_t codeSize, size_t constantCount, size_t switchCount) {
+    bytecode.resize(codeSize);
+    poscode.resize(codeSize);
+    constantPool.resize(constantCount);
+    switches.resize(switchCount);
+    for (auto it = symbolConstants.begin(); it != symbolConstants.end();) {
+        it = it->second >= constantCount ? symbolConstants.erase(it) : std::next(it);
+    }
+    sync();
+}
+
+size_t Chunk::width(OpCode opCode) {
+    switch (opCode) {
+        case OpCode::Constant:
+        case OpCode::Call:
+        case OpCode::TailCall:
+        case OpCode::Switch:
+        case OpCode::Leave:
+        case OpCode::SetLocal:
+        case OpCode::BindLocal:
+        case OpCode::DefineLocalArray:
+        case OpCode::GetHoisted:
+        case OpCode::AdvanceLocal:
+            return 3;
+        case OpCode::Jump:
+        case OpCode::JumpNE:
+        case OpCode::Loop:
+        case OpCode::DefineLocal:
+        case OpCode::GetLocal:
+        case OpCode::GetLocalArray:
+        case OpCode::SetLocalArray:
+        case OpCode::IncrementLocal:
+        case OpCode::RefLocal:
+        case OpCode::KeepLocal:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+bool Chunk::takesSlot(OpCode opCode) {
+    switch (opCode) {
+        case OpCode::DefineLocal:
+        case OpCode::DefineLocalArray:
+        case OpCode::GetLocal:
+        case OpCode::GetLocalArray:
+        case OpCode::SetLocal:
+        case OpCode::SetLocalArray:
+        case OpCode::IncrementLocal:
+        case OpCode::RefLocal:
+        case OpCode::BindLocal:
+        case OpCode::GetHoisted:
+        case OpCode::KeepLocal:
+        case OpCode::AdvanceLocal:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool Chunk::splice(size_t at, size_t length, const Chunk &from, size_t size, size_t slotOffset) {
+    // where an instruction of the old code starts once the splice is made
+    const auto moved = [&](size_t offset) {
+        return offset < at + length ? offset : offset - length + size;
+    };
+    vector<std::pair<size_t, std::byte>> distances;
+    for (size_t offset = 0; offset < codeSize; offset += width(static_cast<OpCode>(code[offset]))) {
+        // the instruction at `at` goes, unless the code is only inserted
+        // before it
+        if (offset == at && length) {
+            continue;
+        }
+        const auto opCode = static_cast<OpCode>(code[offset]);
+        const auto distance = static_cast<size_t>(code[offset + 1]);
+        size_t stretched;
+        if (opCode == OpCode::Jump || opCode == OpCode::JumpNE) {
+            stretched = moved(offset + 2 + distance) - moved(offset + 2);
+        } else if (opCode == OpCode::Loop) {
+            stretched = moved(offset + 2) - moved(offset + 2 - distance);
+        } else if (opCode == OpCode::GetHoisted) {
+            const auto skipped = static_cast<size_t>(code[offset + 2]);
+            stretched = moved(offset + 3 + skipped) - moved(offset + 3);
+            if (stretched > std::numeric_limits<unsigned char>::max()) {
+                return false;
+            }
+            distances.emplace_back(offset + 2, static_cast<std::byte>(stretched));
+            continue;
+        } else {
+            continue;
+        }
+        if (stretched > std::numeric_limits<unsigned char>::max()) {
+            return false;
+        }
+        distances.emplace_back(offset + 1, static_cast<std::byte>(stretched));
+    }
+
+    const size_t constantCount = constantPool.size();
+    const size_t switchCount = switches.size();
+    if (switchCount + from.switches.size() > std::numeric_limits<uint16_t>::max()) {
+        return false;
+    }
+    vector<std::byte> body(from.code, from.code + size);
+    for (size_t offset = 0; offset < size; offset += width(static_cast<OpCode>(body[offset]))) {
+        const auto opCode = static_cast<OpCode>(body[offset]);
+        if (takesSlot(opCode)) {
+            const size_t slot = static_cast<size_t>(body[offset + 1]) + slotOffset;
+            if (slot > std::numeric_limits<unsigned char>::max()) {
+                truncate(codeSize, constantCount, switchCount);
+                return false;
+            }
+            body[offset + 1] = static_cast<std::byte>(slot);
+            continue;
+        }
+        if (opCode == OpCode::Switch || opCode == OpCode::Leave) {
+            const size_t idx = (static_cast<size_t>(body[offset + 1]) << 8 |
+                                static_cast<size_t>(body[offset + 2])) + switchCount;
+            body[offset + 1] = static_cast<std::byte>((idx >> 8) & 0xff);
+            body[offset + 2] = static_cast<std::byte>(idx & 0xff);
+            continue;
+        }
+        if (opCode != OpCode::Constant) {
+            continue;
+        }
+        const size_t idx = static_cast<size_t>(body[offset + 1]) << 8 | static_cast<size_t>(body[offset + 2]);
+        const size_t copy = addConstant(from.getConstant(idx));
+        if (copy > std::numeric_limits<uint16_t>::max()) {
+            truncate(codeSize, constantCount, switchCount);
+            return false;
+        }
+        body[offset + 1] = static_cast<std::byte>((copy >> 8) & 0xff);
+        body[offset + 2] = static_cast<std::byte>(copy & 0xff);
+    }
+
+    for (const auto &[offset, distance] : distances) {
+        bytecode[offset] = distance;
+    }
+    for (auto &table : switches) {
+        table.relocate([&](uint32_t target) { return static_cast<uint32_t>(moved(target)); });
+    }
+    for (const auto &table : from.switches) {
+        switches.push_back(table);
+        switches.back().relocate([&](uint32_t target) { return static_cast<uint32_t>(target + at); });
+    }
+    bytecode.erase(bytecode.begin() + at, bytecode.begin() + at + length);
+    bytecode.insert(bytecode.begin() + at, body.begin(), body.end());
+    // the spliced code keeps its own positions, so errors in it point into
+    // the procedure it came from
+    vector<std::pair<int, int>> positions(size);
+    for (size_t offset = 0; offset < size; offset++) {
+        positions[offset] = from.position(offset);
+    }
+    poscode.erase(poscode.begin() + at, poscode.begin() + at + length);
+    poscode.insert(poscode.begin() + at, positions.begin(), positions.end());
+    sync();
+    return true;
+}
+
+size_t Chunk::maxStackDepth() const {
+    size_t depth = 0, deepest = 0;
+    for (size_t at = 0; at < size();) {
+        const auto opCode = static_cast<OpCode>(read(at++));
+        int effect = 0;
+        switch (opCode) {
+            case OpCode::Constant:
+                effect = 1;
+                at += 2;
+                break;
+            case OpCode::Call:
+            case OpCode::TailCall:
+                // a FUNCTION's result; its arguments are counted as if
+                // they stayed
+                effect = 1;
+                at += 2;
+                break;
+            case OpCode::Switch:
+                effect = -1;
+                at += 2;
+                break;
+            case OpCode::Leave:
+                at += 2;
+                break;
+            case OpCode::GetLocal:
+            case OpCode::RefLocal:
+                effect = 1;
+                ++at;
+                break;
+            case OpCode::GetHoisted:
+                // counted as computing the value, which leaves the same depth
+                at += 2;
+                break;
+            case OpCode::KeepLocal:
+                ++at;
+                break;
+            case OpCode::AdvanceLocal:
+                at += 2;
+                break;
+            case OpCode::SetLocal:
+            case OpCode::BindLocal:
+                effect = -1;
+                at += 2;
+                break;
+            case OpCode::DefineLocalArray:
+                effect = -3;
+                at += 2;
+                break;
+            case OpCode::SetLocalArray:
+                effect = -1;
+                ++at;
+                break;
+            case OpCode::GetLocalArray:
+                ++at;
+                break;
+            case OpCode::Jump:
+            case OpCode::JumpNE:
+            case OpCode::Loop:
+            case OpCode::DefineLocal:
+            case OpCode::IncrementLocal:
+                ++at;
+                break;
+            case OpCode::Input:
+                effect = 1;
+                break;
+            case OpCode::DefineGlobalArray:
+                effect = -3;
+                break;
+            case OpCode::SetGlobalArray:
+                effect = -2;
+                break;
+            case OpCode::GetGlobal:
+            case OpCode::RefGlobal:
+            case OpCode::Negate:
+            case OpCode::Not:
+            case OpCode::Builtin:
+            case OpCode::EndFunction:
+            case OpCode::Return:
+                break;
+            default:
+                // definitions, stores, pops, binary operators, Output
+                effect = -1;
+                break;
+        }
+        depth = effect < 0 && depth < size_t(-effect) ? 0 : depth + effect;
+        deepest = std::max(deepest, depth);
+    }
+    return deepest;
+}
+
+void Chunk::map(std::shared_ptr<const MappedFile> file, const std::byte *mappedCode,
+                const char *mappedLines, size_t size) {
+    static_assert(sizeof(std::pair<int, int>) == 2 * sizeof(int32_t),
+                  "line table entries are two int32s in memory and in images");
+    image = std::move(file);
+    code = mappedCode;
+    lines = mappedLines;
+    codeSize = size;
+}
+
+void Chunk::writeChunk(OpCode opCode, std::pair<int, int> position) {
+    writeByte(static_cast<std::byte>(opCode), position);
 }
 
 size_t Chunk::addConstant(Value &&Value) {
+    if (const auto symbol = std::get_if<Symbol>(&Value)) {
+        const auto [it, inserted] = symbolConstants.emplace(symbol->id, constantPool.size());
+        if (!inserted) {
+            return it->second;
+        }
+    }
     constantPool.emplace_back(std::move(Value));
     return constantPool.size() - 1;
 }
@@ -15,7 +330,7 @@ size_t Chunk::addConstant(Value &&Value) {
 void Chunk::disassembleChunk(const std::string msg) {
     std::cout << "\n      " << Modifier(AnsiCode::FG_BMAGENTA) << msg << Modifier(AnsiCode::FG_DEFAULT)<<std::endl;
     offset = 0;
-    while (offset < bytecode.size()) {
+    while (offset < size()) {
         disassembleInstruction();
     }
     std::cout << "      " << Modifier(AnsiCode::FG_BMAGENTA)<< "END" << Modifier(AnsiCode::FG_DEFAULT) << "\n" << std::endl;
@@ -56,17 +371,52 @@ void Chunk::disassembleInstruction() {
                 std::cout << Modifier(AnsiCode::FG_BMAGENTA);
                 printf("Constant[%04zx] -> ", newidx);
                 std::cout << Modifier(AnsiCode::FG_BBLUE) << (*bl ? "TRUE" : "FALSE") << std::endl << Modifier(AnsiCode::FG_BBLUE);
+            } else if (std::holds_alternative<Symbol>(value)) {
+                std::cout << Modifier(AnsiCode::FG_BMAGENTA);
+                printf("Constant[%04zx] -> ", newidx);
+                std::cout << Modifier(AnsiCode::FG_BBLUE) << value << std::endl << Modifier(AnsiCode::FG_BBLUE);
             }
             break;
                 }
-        case (OpCode::Call): {
+        case (OpCode::Switch):
+        case (OpCode::Leave): {
             const auto idx = static_cast<uint16_t>(read(offset++));
             const auto idx1 = static_cast<uint16_t>(read(offset++));
-            const auto newidx = static_cast<size_t>((idx << 8) & 0xff00) | (idx1 & 0xff);
-            const auto value = getConstant(newidx);
-            cout << "Call jmpdst " << value << " to "<< (offset - get<i64>(value)) << " from " << offset << endl;
+            const auto table = static_cast<size_t>((idx << 8) & 0xff00) | (idx1 & 0xff);
+            std::cout << Modifier(AnsiCode::FG_BBLUE);
+            printf("%s table %04zx -> end %04x\n", it->second.c_str(), table, switches[table].end);
+            std::cout << Modifier(AnsiCode::FG_DEFAULT);
+            break;
+        }
+        case (OpCode::Call):
+        case (OpCode::TailCall): {
+            const auto idx = static_cast<uint16_t>(read(offset++));
+            const auto idx1 = static_cast<uint16_t>(read(offset++));
+            const auto function = static_cast<size_t>((idx << 8) & 0xff00) | (idx1 & 0xff);
+            std::cout << Modifier(AnsiCode::FG_BBLUE);
+            printf("%s function %04zx\n", it->second.c_str(), function);
+            std::cout << Modifier(AnsiCode::FG_DEFAULT);
             break;
                 }
+        case (OpCode::DefineLocal):
+        case (OpCode::DefineLocalArray):
+        case (OpCode::GetLocal):
+        case (OpCode::GetLocalArray):
+        case (OpCode::SetLocal):
+        case (OpCode::SetLocalArray):
+        case (OpCode::IncrementLocal):
+        case (OpCode::RefLocal):
+        case (OpCode::KeepLocal):
+        case (OpCode::BindLocal): {
+            const auto slot = static_cast<size_t>(read(offset++));
+            if (width(it->first) == 3) {
+                ++offset;
+            }
+            std::cout << Modifier(AnsiCode::FG_BBLUE);
+            printf("%s slot %02zx\n", it->second.c_str(), slot);
+            std::cout << Modifier(AnsiCode::FG_DEFAULT);
+            break;
+        }
         case (OpCode::Jump):
         case (OpCode::JumpNE): {
             const auto distance = static_cast<size_t>(read(offset++));
@@ -75,6 +425,22 @@ void Chunk::disassembleInstruction() {
             std::cout << Modifier(AnsiCode::FG_DEFAULT);
             break;
         }
+        case (OpCode::GetHoisted): {
+            const auto slot = static_cast<size_t>(read(offset++));
+            const auto distance = static_cast<size_t>(read(offset++));
+            std::cout << Modifier(AnsiCode::FG_BBLUE);
+            printf("%s slot %02zx or -> to %02zx\n", it->second.c_str(), slot, offset + distance);
+            std::cout << Modifier(AnsiCode::FG_DEFAULT);
+            break;
+        }
+        case (OpCode::AdvanceLocal): {
+            const auto slot = static_cast<size_t>(read(offset++));
+            const auto step = static_cast<signed char>(read(offset++));
+            std::cout << Modifier(AnsiCode::FG_BBLUE);
+            printf("%s slot %02zx by %d\n", it->second.c_str(), slot, step);
+            std::cout << Modifier(AnsiCode::FG_DEFAULT);
+            break;
+        }
         case (OpCode::Loop): {
             const auto distance = static_cast<size_t>(read(offset++));
             std::cout << Modifier(AnsiCode::FG_BBLUE);
@@ -2,9 +2,12 @@
 #include "../common.h"
 #include "../tokens/tokens.h"
 #include "../error/error.h"
+#include <cstring>
+#include <functional>
+#include <memory>
 
  enum class OpCode : unsigned char {
-    Constant, Pop, PopLocal,
+    Constant, Pop,
 
     DefineGlobal, DefineGlobalArray,
 
@@ -12,20 +15,40 @@
 
     GetGlobal, GetGlobalArray,
 
+    // locals live in frame slots, named by a one-byte operand; the second
+    // operand of SetLocal, BindLocal and DefineLocalArray is a declared type
     DefineLocal, DefineLocalArray,
 
     SetLocal, SetLocalArray,
 
     GetLocal, GetLocalArray,
 
+    // BYREF arguments: push a Reference to a variable, which the callee's
+    // prologue binds to its parameter's slot
+    RefGlobal, RefLocal, BindLocal,
+
     Equal, NotEqual, Greater, GreaterEqual, Lesser, LesserEqual, Add,
     Subtract, Divide, Multiply, Negate, Mod, Div, Concatenate,
 
     And, Or, Not, Output, Input, Jump, JumpNE, Loop,
     Builtin,
 
-    Call, EndFunction,
-    IncrementGlobal, Return
+    Call, TailCall, EndFunction,
+    IncrementGlobal, IncrementLocal, Return,
+
+    // CASE: Switch pops the selector and jumps straight to its arm, Leave
+    // jumps from the end of an arm past the construct; both name one of
+    // the chunk's switch tables by a two-byte operand
+    Switch, Leave,
+
+    // loop invariants: GetHoisted pushes the value its slot holds and skips
+    // the code that computes it, once that code has run in this pass through
+    // the loop; KeepLocal stores the top of the stack in a slot and leaves it
+    GetHoisted, KeepLocal,
+
+    // induction variables: AdvanceLocal adds its signed one-byte step to the
+    // integer a slot holds, and leaves a slot nothing was kept in yet empty
+    AdvanceLocal
 };
 
 
@@ -33,6 +56,7 @@ static const std::unordered_map<OpCode, std::string> OpCodeMap = {
     {OpCode::Builtin, "builtin"},
     {OpCode::Constant, "Constant"},
     {OpCode::IncrementGlobal, "IncrementGlobal"},
+    {OpCode::IncrementLocal, "IncrementLocal"},
     {OpCode::Pop, "Pop"},
     {OpCode::DefineGlobal, "DefineGlobal"},
     {OpCode::DefineGlobalArray, "DefineGlobalArray"},
@@ -46,6 +70,9 @@ static const std::unordered_map<OpCode, std::string> OpCodeMap = {
     {OpCode::SetLocalArray, "SetLocalArray"},
     {OpCode::GetLocal, "GetLocal"},
     {OpCode::GetLocalArray, "GetLocalArray"},
+    {OpCode::RefGlobal, "RefGlobal"},
+    {OpCode::RefLocal, "RefLocal"},
+    {OpCode::BindLocal, "BindLocal"},
     {OpCode::Equal, "Equal"},
     {OpCode::NotEqual, "NotEqual"},
     {OpCode::Greater, "Greater"},
@@ -67,29 +94,107 @@ static const std::unordered_map<OpCode, std::string> OpCodeMap = {
     {OpCode::Output, "Output"},
     {OpCode::Input, "Input"},
     {OpCode::Jump, "Jump"},
-    {OpCode::PopLocal, "PopLocal"},
     {OpCode::JumpNE, "JumpNE"},
+    {OpCode::Loop, "Loop"},
     {OpCode::Call, "Call"},
+    {OpCode::TailCall, "TailCall"},
     {OpCode::EndFunction, "EndFunction"},
     {OpCode::Return, "Return"},
+    {OpCode::Switch, "Switch"},
+    {OpCode::Leave, "Leave"},
+    {OpCode::GetHoisted, "GetHoisted"},
+    {OpCode::KeepLocal, "KeepLocal"},
+    {OpCode::AdvanceLocal, "AdvanceLocal"},
+};
+
+struct ValueHash {
+    size_t operator()(const Value &value) const;
+};
+
+// Where a CASE statement's arms start, as offsets into its chunk. Integer
+// and char labels that cover most of a short span index `targets` by
+// `selector - low`; anything else is looked up in `labels`, and failing
+// that tried against `ranges` in source order.
+struct SwitchTable {
+    struct Range {
+        Value low, high;
+        uint32_t target;
+    };
+    // variant index of the selectors `targets` is for
+    uint32_t type {0};
+    i64 low {0};
+    vector<uint32_t> targets;
+    unordered_map<Value, uint32_t, ValueHash> labels;
+    vector<Range> ranges;
+    // OTHERWISE, or `end` without one
+    uint32_t otherwise {0};
+    uint32_t end {0};
+    uint32_t target(const Value &selector) const;
+    void relocate(const std::function<uint32_t(uint32_t)> &moved);
 };
 
 
+class MappedFile;
+
 class Chunk {
     private:
         size_t offset {0};
         ErrorReporter Error {};
         void disassembleInstruction();
+        // what the VM executes: either the vectors below, or the code and
+        // line table of a loaded image, read in place from its mapping
+        const std::byte *code {nullptr};
+        const char *lines {nullptr};
+        size_t codeSize {0};
+        std::shared_ptr<const MappedFile> image;
+        void sync() {
+            code = bytecode.data();
+            lines = reinterpret_cast<const char *>(poscode.data());
+            codeSize = bytecode.size();
+        }
     public:
+        // source position of every byte in `bytecode`, for diagnostics
         vector<std::pair<int, int>> poscode;
         void disassembleChunk(const std::string msg);
         std::vector<Value> constantPool {};
+        // identifier names are shared: one pool entry per symbol per chunk
+        unordered_map<uint32_t, size_t> symbolConstants {};
+        std::vector<SwitchTable> switches {};
         std::vector<std::byte> bytecode {};
-        std::byte read(size_t offset) const { return bytecode[offset]; }
-        void writeByte(std::byte byte) { bytecode.push_back(byte); }
-        void writeChunk(OpCode opCode);
+        std::byte read(size_t offset) const { return code[offset]; }
+        size_t size() const { return codeSize; }
+        std::pair<int, int> position(size_t offset) const {
+            int32_t p[2];
+            std::memcpy(p, lines + offset * sizeof(p), sizeof(p));
+            return {p[0], p[1]};
+        }
+        void writeByte(std::byte byte, std::pair<int, int> position) {
+            bytecode.push_back(byte);
+            poscode.push_back(position);
+            sync();
+        }
+        void writeChunk(OpCode opCode, std::pair<int, int> position);
         void patch(size_t offset, std::byte byte) { bytecode[offset] = byte; }
-        Value getConstant(size_t idx) { return constantPool[idx]; } //modified
+        Value getConstant(size_t idx) const { return constantPool[idx]; } //modified
         size_t addConstant(Value &&value); // modified
+        void truncate(size_t codeSize, size_t constantCount, size_t switchCount);
+        // bytes taken by an instruction, operands included
+        static size_t width(OpCode opCode);
+        // whether the first operand of an instruction is a frame slot
+        static bool takesSlot(OpCode opCode);
+        // replaces the `length` bytes of code at `at` with the first `size`
+        // bytes of `from`, copying the constants and switch tables they use
+        // into this chunk, moving its frame slots up by `slotOffset` and
+        // stretching the jumps that cross the splice; false, with the chunk
+        // left as it was, when a jump or slot would outgrow its operand
+        bool splice(size_t at, size_t length, const Chunk &from, size_t size,
+                    size_t slotOffset = 0);
+        // operand stack needed to run the code once through, in source
+        // order; an upper bound, since builtins are assumed to keep their
+        // arguments
+        size_t maxStackDepth() const;
+        // executes `size` bytes of code (and as many line table entries, as
+        // int32 line/column pairs) straight out of a mapped image
+        void map(std::shared_ptr<const MappedFile> file, const std::byte *mappedCode,
+                 const char *mappedLines, size_t size);
 };
-
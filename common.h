@@ -1,3 +1,4 @@
+#pragma once
 #include <iostream>
 #include <vector>
 #include <unordered_map>
@@ -19,6 +20,36 @@ using std::stringstream;
 using std::variant;
 
 using i64 = long long;
+
+// Interned identifier, see symbols/symbols.h
+struct Symbol {
+    uint32_t id;
+    bool operator==(const Symbol &other) const { return id == other.id; }
+    bool operator!=(const Symbol &other) const { return id != other.id; }
+    bool operator<(const Symbol &other) const { return id < other.id; }
+    bool operator>(const Symbol &other) const { return id > other.id; }
+    bool operator<=(const Symbol &other) const { return id <= other.id; }
+    bool operator>=(const Symbol &other) const { return id >= other.id; }
+};
+
+// An array is a value like any other, shared between its holders: a BYVAL
+// array parameter costs a reference count, and whoever writes to an array
+// that is still shared copies it first. See vm/vm.h
+struct ValueArray;
+
+// Where a BYREF parameter's variable lives: a global (by symbol id) or a
+// frame slot (by its index across all frames). Only ever held by a frame slot.
+struct Reference {
+    uint32_t index;
+    bool global;
+    bool operator==(const Reference &other) const { return index == other.index && global == other.global; }
+    bool operator!=(const Reference &other) const { return !(*this == other); }
+    bool operator<(const Reference &other) const { return index < other.index; }
+    bool operator>(const Reference &other) const { return index > other.index; }
+    bool operator<=(const Reference &other) const { return index <= other.index; }
+    bool operator>=(const Reference &other) const { return index >= other.index; }
+};
+
 using Value = variant<std::monostate, bool, double, i64,
-      string, char>;
+      string, char, Symbol, std::shared_ptr<ValueArray>, Reference>;
 
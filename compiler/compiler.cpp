@@ -2,8 +2,18 @@
 #include "../chunk/chunk.h"
 #include "../common.h"
 #include "../tokens/tokens.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <limits>
+#include <map>
+#include "../symbols/symbols.h"
 #include <sstream>
+#include <unordered_set>
+
+static string nameOf(const Value &identifier) {
+    return string(SymbolTable::global().name(get<Symbol>(identifier)));
+}
 
 bool Compiler::lookupUnary(TokenType type) {
     bool isNewline = false;
@@ -197,144 +207,1990 @@ void Compiler::lookupBinary(TokenType type) {
 Precedence Compiler::lookupPrecedence(TokenType type) {
     const auto it = precedenceMap.find(type);
     if (it == precedenceMap.end()) {
-        Error.report(currentToken, "Compile", "Precedence not found");
+        Error.report(currentToken(), "Compile", "Precedence not found");
     }
     return it->second;
 }
 
 void Compiler::emit(OpCode opCode, std::optional<std::byte> argument) {
-    chunkPosition.push_back(
-        std::make_pair(currentToken.line, currentToken.column));
-    chunk->writeChunk(opCode);
+    chunk->writeChunk(opCode, position());
     if (argument) {
-        chunkPosition.push_back(
-            std::make_pair(currentToken.line, currentToken.column));
-        chunk->writeByte(*argument);
+        chunk->writeByte(*argument, position());
     }
 }
 
 void Compiler::emitConstant(Value &&value) {
-    auto idx = static_cast<uint16_t>(chunk->addConstant(std::move(value)));
+    const size_t idx = chunk->addConstant(std::move(value));
     if (idx > std::numeric_limits<uint16_t>::max()) {
-        Error.report(currentToken, "Stack overflow",
+        Error.report(currentToken(), "Stack overflow",
                      "too many constants in one chunk");
     }
     emit(OpCode::Constant, static_cast<std::byte>((idx >> 8) & 0xff));
-    chunkPosition.push_back(
-        std::make_pair(currentToken.line, currentToken.column));
-    chunk->writeByte(static_cast<std::byte>(idx & 0xff));
+    chunk->writeByte(static_cast<std::byte>(idx & 0xff), position());
 }
 
-void Compiler::emitCall(i64 &&idx) {
-    const auto index =
-        static_cast<uint16_t>(chunk->addConstant(std::move(idx)));
-    if (index > std::numeric_limits<uint16_t>::max()) {
-        Error.report(currentToken, "Stack overflow",
-                     "too many constants in one chunk");
+void Compiler::emitCall(size_t function) {
+    if (function > std::numeric_limits<uint16_t>::max()) {
+        Error.report(currentToken(), "Stack overflow", "too many procedures");
     }
-    emit(OpCode::Call, static_cast<std::byte>((index >> 8) & 0xff));
-    chunkPosition.push_back(
-        std::make_pair(currentToken.line, currentToken.column));
-    chunk->writeByte(static_cast<std::byte>(index & 0xff));
+    emit(OpCode::Call, static_cast<std::byte>((function >> 8) & 0xff));
+    chunk->writeByte(static_cast<std::byte>(function & 0xff), position());
 }
 
 void Compiler::emitPop() { emit(OpCode::Pop); }
 
 void Compiler::expression() { parsePrecedence(Precedence::None); }
 
-void Compiler::initCompiler(string &input) {
-    idx = 0;
+void Compiler::initCompiler(std::string_view input, int firstLine) {
+    current = peek = 0;
     scopeDepth = 0;
-    lexer.initLexer(&input);
-    TokenList = lexer.makeTokens(false);
-    if (TokenList.size() == 0) {
-        Error.report(currentToken, "Compile", "Insufficient number of tokens");
-    }
-    if (TokenList.size() == 1) {
-        currentToken = *TokenList[0];
+    localCount = 0;
+    source = input;
+    sourceLine = cursorLine = firstLine;
+    cursorOffset = 0;
+    lexer.initLexer(input, firstLine);
+    lexer.startStream();
+    if (lexer.pull(0).type(0) == TokenType::Eof) {
         return;
     }
-    currentToken = *TokenList[0];
-    peekToken = *TokenList[1];
-    chunk = std::make_unique<Chunk>();
-    idx += 1;
+    lexer.pull(1);
+    peek = 1;
 }
 
 bool Compiler::match(TokenType type) {
-    if (currentToken.type != type) {
+    if (currentType() != type) {
         return false;
     }
     advance();
     return true;
 }
 
+// The body is compiled into a chunk of its own. The name is bound before
+// the body is compiled so a procedure can call itself. The body is only
+// skipped here and its text kept for the first CALL, or for the end of the
+// compile when eager; definitions nested in it are still bound, as they
+// would be if it had been compiled, and are skipped again once it is.
 void Compiler::parseProcedureStatement() {
-    consume(TokenType::Identifier, "Expected Identifier after PROCEDURE");
-    const string name = get<string>(currentToken.literal);
-    // consume(TokenType::Lparen, "Expected (");
-    // consume(TokenType::Rparen, "Expected )");
+    const bool isFunction = currentType() == TokenType::Function;
+    const bool memoize = memoizePragma(tokens().line(current));
+    const TokenType end = isFunction ? TokenType::Endfunction : TokenType::Endprocedure;
+    consume(TokenType::Identifier, isFunction ? "Expected Identifier after FUNCTION"
+                                              : "Expected Identifier after PROCEDURE");
+    const Symbol name = get<Symbol>(currentLiteral());
+    std::vector<Parameter> parameters = parseParameters();
+    TokenType returns = TokenType::Eof;
+    if (isFunction) {
+        consume(TokenType::Returns, "Expected RETURNS after parameters");
+        advance();
+        returns = parseType();
+    }
+    if (memoize && (!isFunction || std::any_of(parameters.begin(), parameters.end(),
+                                               [](const Parameter &parameter) {
+                                                   return parameter.byRef || parameter.isArray;
+                                               }))) {
+        Error.report(currentToken(), "Compiler",
+                     "Only a FUNCTION taking values can be memoized");
+    }
     consume(TokenType::Newline, "Expected newline after Identifier");
+    const int firstLine = tokens().line(current) + 1;
     advance();
+    const auto define = [&] {
+        functions.push_back(std::make_unique<Function>(name));
+        Function &function = *functions.back();
+        function.arity = parameters.size();
+        function.parameters = std::move(parameters);
+        function.returns = returns;
+        function.memoize = memoize;
+        functionIdxMap.emplace(name.id, functions.size() - 1);
+        function.visible = {identifiers.size(), constants.size(), functions.size()};
+    };
+    const bool bound = functionIdxMap.count(name.id) != 0;
+    const size_t start = bound ? 0 : lineOffset(firstLine);
+    if (!bound) {
+        define();
+    } else {
+        // a definition nested in the body being compiled is only visible
+        // from here on
+        visible.procedures = std::max(visible.procedures, functionIdxMap[name.id] + 1);
+    }
+    const size_t slot = functions.size() - 1;
+    while (currentType() != end) {
+        if (currentType() == TokenType::Procedure || currentType() == TokenType::Function) {
+            parseProcedureStatement();
+            continue;
+        }
+        if (peekType() == TokenType::Eof) {
+            Error.report(currentToken(), "Compiler", "Unexpected end of scope");
+        }
+        advance();
+    }
+    if (!bound) {
+        Function &function = *functions[slot];
+        function.firstLine = firstLine;
+        const size_t end = lineOffset(tokens().line(current) + 1);
+        function.source = string(source.substr(start, end - start));
+    }
+    advance();
+}
+
+// whether the line above `line` is a `// MEMOIZE` comment, which marks the
+// FUNCTION that follows as safe to memoize even if it does not look pure
+bool Compiler::memoizePragma(int line) {
+    if (line <= sourceLine) {
+        return false;
+    }
+    // found back from `line`, so the cursor of lineOffset never rewinds
+    const size_t end = lineOffset(line);
+    const size_t newline = end >= 2 ? source.rfind('\n', end - 2) : string::npos;
+    const size_t start = newline == string::npos ? 0 : newline + 1;
+    string text(source.substr(start, end - start));
+    text.erase(std::remove_if(text.begin(), text.end(), ::isspace), text.end());
+    for (auto &c : text) {
+        c = std::toupper(static_cast<unsigned char>(c));
+    }
+    return text == "//MEMOIZE";
+}
+
+// `([BYVAL] name : TYPE, ...)` after a procedure's name, if it is there
+std::vector<Parameter> Compiler::parseParameters() {
+    std::vector<Parameter> parameters;
+    if (peekType() != TokenType::Lparen) {
+        return parameters;
+    }
+    advance();
+    while (peekType() != TokenType::Rparen) {
+        if (!parameters.empty()) {
+            consume(TokenType::Comma, "Expected , between parameters");
+        }
+        advance();
+        Parameter parameter {};
+        if (currentType() == TokenType::Byref || currentType() == TokenType::Byval) {
+            parameter.byRef = currentType() == TokenType::Byref;
+            advance();
+        }
+        if (currentType() != TokenType::Identifier) {
+            Error.report(currentToken(), "Compiler", "Expected parameter name");
+        }
+        parameter.name = get<Symbol>(currentLiteral());
+        consume(TokenType::Colon, "Expected : after parameter name");
+        advance();
+        if (currentType() == TokenType::Array) {
+            consume(TokenType::Of, "Expected OF after ARRAY");
+            advance();
+            parameter.isArray = true;
+        }
+        parameter.type = parseType();
+        parameters.push_back(parameter);
+    }
+    consume(TokenType::Rparen, "Expected ) after parameters");
+    return parameters;
+}
+
+// the current token names a type; returns the type of its literals
+TokenType Compiler::parseType() {
+    switch (currentType()) {
+    case TokenType::Integer_t: return TokenType::Integer;
+    case TokenType::String_t: return TokenType::String;
+    case TokenType::Boolean_t: return TokenType::Boolean;
+    case TokenType::Real_t: return TokenType::Real;
+    case TokenType::Char_t: return TokenType::Char;
+    default:
+        Error.report(currentToken(), "Compile", "Unexpected Type");
+    }
+    return TokenType::Eof;
+}
+
+// Compiles from the first token of a procedure's body through its
+// ENDPROCEDURE into the procedure's own chunk. The arguments are on the
+// value stack, last on top, so the body starts by popping them into its
+// parameters' slots; a BYREF parameter's slot is bound to the Reference
+// passed for it. A FUNCTION that runs off its end returns nothing.
+void Compiler::compileBody(Function &function) {
+    Function *const enclosing = compiling;
+    const size_t enclosingFrame = frameStart;
+    vector<std::pair<size_t, size_t>> enclosingLoops;
+    enclosingLoops.swap(loops);
+    vector<CountedLoop> enclosingCounted;
+    enclosingCounted.swap(countedLoops);
+    chunk = &function.chunk;
+    compiling = &function;
+    frameStart = identifiers.size();
+    localCount = 0;
     beginScope();
-    const size_t normalJump = emitJump(OpCode::Jump);
-    const size_t callJmp = chunk->bytecode.size();
-    functionIdxMap.emplace(name, callJmp);
-    block(TokenType::Endprocedure);
+    for (const Parameter &parameter : function.parameters) {
+        identifiers.emplace_back(parameter.name, scopeDepth, localCount++, parameter.type,
+                                 parameter.isArray);
+    }
+    for (size_t i = function.parameters.size(); i > 0; i--) {
+        emitLocal(function.parameters[i - 1].byRef ? OpCode::BindLocal : OpCode::SetLocal,
+                  identifiers[frameStart + i - 1]);
+    }
+    block(function.returns == TokenType::Eof ? TokenType::Endprocedure : TokenType::Endfunction);
     endScope();
+    if (function.returns != TokenType::Eof) {
+        emitConstant(std::monostate{});
+    }
     emit(OpCode::EndFunction);
-    patchJump(normalJump);
-    advance();
+    deriveIndices(function.chunk);
+    unrollLoops(function.chunk);
+    hoistInvariants(function.chunk);
+    reuseSubexpressions(function.chunk, 0);
+    loops.swap(enclosingLoops);
+    countedLoops.swap(enclosingCounted);
+    function.localCount = localCount;
+    function.maxStack = function.chunk.maxStackDepth();
+    function.compiled = true;
+    string().swap(function.source);
+    compiling = enclosing;
+    frameStart = enclosingFrame;
+}
+
+void Compiler::compileFunction(Function &function) {
+    const size_t declared = identifiers.size();
+    const Visibility enclosingVisible = visible;
+    visible = function.visible;
+    try {
+        initCompiler(function.source, function.firstLine);
+        compileBody(function);
+    } catch (...) {
+        visible = enclosingVisible;
+        function.chunk.truncate(0, 0, 0);
+        loops.clear();
+        countedLoops.clear();
+        identifiers.erase(identifiers.begin() + declared, identifiers.end());
+        chunk = nullptr;
+        compiling = nullptr;
+        frameStart = 0;
+        lexer.release();
+        throw;
+    }
+    visible = enclosingVisible;
+    chunk = nullptr;
+    lexer.release();
+    optimize(functionIdxMap.at(function.name.id));
+}
+
+void Compiler::optimize(size_t slot) {
+    Function &function = *functions[slot];
+    inlining.push_back(slot);
+    inlineCalls(function.chunk, 0, function.localCount);
+    markTailCalls(function.chunk);
+    if (options.memoize) {
+        function.pure = pure(slot);
+        function.memoize = function.memoize || (function.pure && recursive(function.chunk, slot));
+    }
+    inlining.pop_back();
+    function.maxStack = function.chunk.maxStackDepth();
+}
+
+static size_t slotAt(const Chunk &code, size_t at) {
+    return static_cast<size_t>(code.read(at + 1)) << 8 | static_cast<size_t>(code.read(at + 2));
+}
+
+// A CALL is in tail position when nothing but jumps lies between it and
+// the EndFunction of its procedure. It then becomes a TailCall, which
+// runs the callee in place of the caller instead of on top of it; a
+// procedure that ends by calling itself loops in constant stack space.
+// A callee with BYREF parameters may be handed the caller's own slots,
+// so it is always called.
+void Compiler::markTailCalls(Chunk &code) {
+    for (size_t at = 0; at < code.size(); at += Chunk::width(static_cast<OpCode>(code.read(at)))) {
+        if (static_cast<OpCode>(code.read(at)) != OpCode::Call) {
+            continue;
+        }
+        size_t next = at + Chunk::width(OpCode::Call);
+        while (next < code.size()) {
+            const auto opCode = static_cast<OpCode>(code.read(next));
+            if (opCode == OpCode::Jump) {
+                next += 2 + static_cast<size_t>(code.read(next + 1));
+            } else if (opCode == OpCode::Leave) {
+                next = code.switches[slotAt(code, next)].end;
+            } else {
+                break;
+            }
+        }
+        const auto &parameters = functions[slotAt(code, at)]->parameters;
+        const bool byRef = std::any_of(parameters.begin(), parameters.end(),
+                                       [](const Parameter &parameter) { return parameter.byRef; });
+        if (!byRef && next < code.size() &&
+            static_cast<OpCode>(code.read(next)) == OpCode::EndFunction) {
+            code.patch(at, static_cast<std::byte>(OpCode::TailCall));
+        }
+    }
+}
+
+// arguments a builtin takes, or none for one whose result is not a
+// function of them
+static std::optional<size_t> pureBuiltinArity(char builtin) {
+    switch (builtin) {
+    case builtintype::Mid:
+        return 3;
+    case builtintype::RandomInt:
+    case builtintype::RandomReal:
+    case builtintype::System:
+        return std::nullopt;
+    default:
+        return 1;
+    }
+}
+
+// appends the instructions of `code` from `from` to `to` to `into`, with
+// the constants they load; the code may not use switch tables
+static void copyCode(const Chunk &code, size_t from, size_t to, Chunk &into) {
+    for (size_t at = from; at < to; at += Chunk::width(static_cast<OpCode>(code.read(at)))) {
+        const auto opCode = static_cast<OpCode>(code.read(at));
+        if (opCode == OpCode::Constant) {
+            const size_t idx = into.addConstant(code.getConstant(slotAt(code, at)));
+            into.writeChunk(opCode, code.position(at));
+            into.writeByte(static_cast<std::byte>((idx >> 8) & 0xff), code.position(at));
+            into.writeByte(static_cast<std::byte>(idx & 0xff), code.position(at));
+            continue;
+        }
+        for (size_t byte = at; byte < at + Chunk::width(opCode); byte++) {
+            into.writeByte(code.read(byte), code.position(at));
+        }
+    }
+}
+
+// every offset in [from, to] of `code` a jump from [from, to) or a switch
+// table can land on, with the number of them that do. Code is structured,
+// so nothing outside a loop or a compile's own code jumps into it
+static std::unordered_map<size_t, size_t> jumpTargets(const Chunk &code, size_t from, size_t to) {
+    std::unordered_map<size_t, size_t> targets;
+    const auto land = [&](size_t target) {
+        if (from <= target && target <= to) {
+            targets[target]++;
+        }
+    };
+    for (size_t at = from; at < to; at += Chunk::width(static_cast<OpCode>(code.read(at)))) {
+        const auto distance = static_cast<size_t>(code.read(at + 1));
+        switch (static_cast<OpCode>(code.read(at))) {
+        case OpCode::Jump:
+        case OpCode::JumpNE:
+            land(at + 2 + distance);
+            break;
+        case OpCode::Loop:
+            land(at + 2 - distance);
+            break;
+        case OpCode::GetHoisted:
+            land(at + 3 + static_cast<size_t>(code.read(at + 2)));
+            break;
+        default:
+            break;
+        }
+    }
+    for (const SwitchTable &table : code.switches) {
+        for (const uint32_t target : table.targets) {
+            land(target);
+        }
+        for (const auto &label : table.labels) {
+            land(label.second);
+        }
+        for (const auto &range : table.ranges) {
+            land(range.target);
+        }
+        land(table.otherwise);
+        land(table.end);
+    }
+    return targets;
+}
+
+// Strength reduction, for the FOR loops compiled into `code` since
+// `countedLoops` was last cleared. In a body that leaves the iterator to
+// the increment, an expression that is the iterator times an integer
+// literal, plus or minus code reading nothing the loop writes, changes by
+// the same step on every pass; the index in `zbuffer[g * 34 + h]` in a
+// loop over `h` is one. The first time such an expression runs in a pass
+// through the loop its value is kept in a frame slot, as a hoisted one's
+// is, and from then on GetHoisted loads it while an AdvanceLocal after the
+// increment moves it along with the iterator: one add per pass instead of
+// the whole expression. Copies of the same code share a slot, and the
+// slots are emptied before the loop's first test.
+void Compiler::deriveIndices(Chunk &code) {
+    // inner loops first, so an outer loop skips the values they keep
+    std::sort(countedLoops.begin(), countedLoops.end(),
+              [](const CountedLoop &a, const CountedLoop &b) { return a.init > b.init; });
+    // a BYREF parameter may alias a global or another BYREF parameter
+    std::unordered_set<size_t> references;
+    if (compiling) {
+        for (size_t i = 0; i < compiling->parameters.size(); i++) {
+            if (compiling->parameters[i].byRef) {
+                references.insert(i);
+            }
+        }
+    }
+    const auto opAt = [&](size_t at) { return static_cast<OpCode>(code.read(at)); };
+    constexpr i64 maxStep = std::numeric_limits<signed char>::max();
+    // the code after a splice moves, and code inserted before an offset
+    // moves that offset too
+    const auto moveLoops = [&](size_t at, size_t length, size_t size) {
+        const auto moved = [&](size_t offset) {
+            return offset < at + length ? offset : offset - length + size;
+        };
+        for (auto &[start, end] : loops) {
+            start = moved(start);
+            end = moved(end);
+        }
+        for (CountedLoop &other : countedLoops) {
+            other.init = moved(other.init);
+            other.test = moved(other.test);
+            other.body = moved(other.body);
+            other.increment = moved(other.increment);
+            other.end = moved(other.end);
+        }
+    };
+    // whether the code in [a, a + length) and [b, b + length) is the same
+    const auto sameCode = [&](size_t a, size_t b, size_t length) {
+        for (size_t at = 0; at < length; at += Chunk::width(opAt(a + at))) {
+            const auto opCode = opAt(a + at);
+            if (opCode != opAt(b + at)) {
+                return false;
+            }
+            if (opCode == OpCode::Constant) {
+                if (!(code.getConstant(slotAt(code, a + at)) == code.getConstant(slotAt(code, b + at)))) {
+                    return false;
+                }
+                continue;
+            }
+            for (size_t byte = 1; byte < Chunk::width(opCode); byte++) {
+                if (code.read(a + at + byte) != code.read(b + at + byte)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    };
+    for (size_t loop = 0; loop < countedLoops.size(); loop++) {
+        const CountedLoop counted = countedLoops[loop];
+        const auto targets = jumpTargets(code, counted.init, counted.end);
+        std::unordered_set<uint32_t> globals;
+        std::unordered_set<size_t> locals = references;
+        bool calls = false;
+        bool referenced = false;
+        for (size_t at = counted.body; at < counted.increment; at += Chunk::width(opAt(at))) {
+            const auto opCode = opAt(at);
+            switch (opCode) {
+            case OpCode::Constant: {
+                // a global's name is only read when GetGlobal follows it
+                const Value constant = code.getConstant(slotAt(code, at));
+                const auto next = opAt(at + Chunk::width(opCode));
+                if (holds_alternative<Symbol>(constant) && next != OpCode::GetGlobal &&
+                    next != OpCode::GetGlobalArray) {
+                    globals.insert(get<Symbol>(constant).id);
+                }
+                break;
+            }
+            case OpCode::Call:
+            case OpCode::TailCall:
+                calls = true;
+                break;
+            case OpCode::DefineLocal:
+            case OpCode::DefineLocalArray:
+            case OpCode::SetLocal:
+            case OpCode::SetLocalArray:
+            case OpCode::IncrementLocal:
+            case OpCode::RefLocal:
+            case OpCode::BindLocal:
+            case OpCode::KeepLocal:
+            case OpCode::AdvanceLocal: {
+                const auto slot = static_cast<size_t>(code.read(at + 1));
+                locals.insert(slot);
+                referenced = referenced || references.count(slot);
+                break;
+            }
+            default:
+                break;
+            }
+        }
+        // a store through a BYREF parameter may land on any global
+        calls = calls || referenced;
+        if (counted.local ? locals.count(counted.iterator) != 0
+                          : calls || globals.count(static_cast<uint32_t>(counted.iterator)) != 0) {
+            continue;
+        }
+
+        // values of the run of code being scanned, in stack order, with the
+        // iterator's factor in each: 0 when the loop leaves the value alone,
+        // none when it is not the iterator times a literal plus such a value
+        struct Operand {
+            size_t start, end, instructions;
+            std::optional<i64> factor;
+            std::optional<i64> literal;
+        };
+        struct Derived {
+            size_t start, end;
+            i64 step;
+        };
+        vector<Operand> operands;
+        vector<Derived> derived;
+        const auto keep = [&](const Operand &operand) {
+            // GetHoisted skips the code and KeepLocal by a one-byte distance,
+            // and AdvanceLocal steps by a signed byte
+            if (operand.factor && *operand.factor != 0 && operand.instructions >= 3 &&
+                operand.end - operand.start + Chunk::width(OpCode::KeepLocal) <=
+                    std::numeric_limits<unsigned char>::max()) {
+                derived.push_back({operand.start, operand.end, *operand.factor});
+            }
+        };
+        const auto flush = [&] {
+            for (const Operand &operand : operands) {
+                keep(operand);
+            }
+            operands.clear();
+        };
+        const auto combine = [&](size_t count, size_t at, size_t width, OpCode opCode) {
+            if (operands.size() < count) {
+                flush();
+                return;
+            }
+            const Operand &a = operands[operands.size() - count];
+            const Operand &b = operands.back();
+            bool invariant = true;
+            for (size_t i = operands.size() - count; i < operands.size(); i++) {
+                invariant = invariant && operands[i].factor == 0;
+            }
+            std::optional<i64> factor = invariant ? std::optional<i64>(0) : std::nullopt;
+            std::optional<i64> literal;
+            if (opCode == OpCode::Negate && a.factor) {
+                factor = -*a.factor;
+                if (a.literal && *a.literal != std::numeric_limits<i64>::min()) {
+                    literal = -*a.literal;
+                }
+            } else if ((opCode == OpCode::Add || opCode == OpCode::Subtract) && a.factor && b.factor) {
+                factor = opCode == OpCode::Add ? *a.factor + *b.factor : *a.factor - *b.factor;
+            } else if (opCode == OpCode::Multiply && !invariant) {
+                const auto scaled = [](const Operand &x, const Operand &y) -> std::optional<i64> {
+                    if (!x.factor || !y.literal || *y.literal < -maxStep || *y.literal > maxStep) {
+                        return std::nullopt;
+                    }
+                    return *x.factor * *y.literal;
+                };
+                factor = a.literal ? scaled(b, a) : scaled(a, b);
+            }
+            if (factor && (*factor < -maxStep || *factor > maxStep)) {
+                factor.reset();
+            }
+            Operand result {a.start, at + width, 1, factor, literal};
+            for (size_t i = operands.size() - count; i < operands.size(); i++) {
+                result.instructions += operands[i].instructions;
+                if (!factor) {
+                    keep(operands[i]);
+                }
+            }
+            operands.resize(operands.size() - count);
+            operands.push_back(result);
+        };
+        for (size_t at = counted.body; at < counted.increment;) {
+            if (targets.count(at)) {
+                flush();
+            }
+            const auto opCode = opAt(at);
+            const size_t width = Chunk::width(opCode);
+            switch (opCode) {
+            case OpCode::Constant: {
+                const Value constant = code.getConstant(slotAt(code, at));
+                if (!holds_alternative<Symbol>(constant)) {
+                    operands.push_back({at, at + width, 1, 0,
+                                        holds_alternative<i64>(constant)
+                                            ? std::optional<i64>(get<i64>(constant))
+                                            : std::nullopt});
+                    break;
+                }
+                const uint32_t name = get<Symbol>(constant).id;
+                if (at + width >= counted.increment || opAt(at + width) != OpCode::GetGlobal ||
+                    targets.count(at + width)) {
+                    flush();
+                    break;
+                }
+                std::optional<i64> factor;
+                if (!counted.local && name == counted.iterator) {
+                    factor = 1;
+                } else if (!calls && !globals.count(name)) {
+                    factor = 0;
+                }
+                operands.push_back({at, at + width + 1, 2, factor, std::nullopt});
+                at += width + 1;
+                continue;
+            }
+            case OpCode::GetLocal: {
+                const auto slot = static_cast<size_t>(code.read(at + 1));
+                std::optional<i64> factor;
+                if (counted.local && slot == counted.iterator) {
+                    factor = 1;
+                } else if (!locals.count(slot)) {
+                    factor = 0;
+                }
+                operands.push_back({at, at + width, 1, factor, std::nullopt});
+                break;
+            }
+            case OpCode::Negate:
+            case OpCode::Not:
+                combine(1, at, width, opCode);
+                break;
+            case OpCode::Equal:
+            case OpCode::NotEqual:
+            case OpCode::Greater:
+            case OpCode::GreaterEqual:
+            case OpCode::Lesser:
+            case OpCode::LesserEqual:
+            case OpCode::Add:
+            case OpCode::Subtract:
+            case OpCode::Divide:
+            case OpCode::Multiply:
+            case OpCode::Mod:
+            case OpCode::Div:
+            case OpCode::Concatenate:
+            case OpCode::And:
+            case OpCode::Or:
+                combine(2, at, width, opCode);
+                break;
+            case OpCode::GetHoisted:
+                // an inner loop's kept value, computed once per pass through it
+                flush();
+                at += width + static_cast<size_t>(code.read(at + 2));
+                continue;
+            case OpCode::Builtin: {
+                // named by the constant just before it
+                std::optional<size_t> arity;
+                if (!operands.empty() && operands.back().instructions == 1 &&
+                    opAt(operands.back().start) == OpCode::Constant) {
+                    const Value name = code.getConstant(slotAt(code, operands.back().start));
+                    if (holds_alternative<char>(name)) {
+                        arity = pureBuiltinArity(get<char>(name));
+                    }
+                }
+                if (arity) {
+                    combine(*arity + 1, at, width, opCode);
+                } else {
+                    flush();
+                }
+                break;
+            }
+            default:
+                flush();
+                break;
+            }
+            at += width;
+        }
+        flush();
+        // combine() keeps operands as they finish, which is not the order
+        // they start in, and the splices below go from the last to the first
+        std::sort(derived.begin(), derived.end(),
+                  [](const Derived &a, const Derived &b) { return a.start < b.start; });
+        if (derived.empty() || localCount >= std::numeric_limits<unsigned char>::max()) {
+            continue;
+        }
+
+        // copies of the same code share a slot, numbered from `first`
+        const uint32_t first = localCount;
+        const size_t available = std::numeric_limits<unsigned char>::max() + 1 - localCount;
+        vector<size_t> slots;
+        vector<i64> steps;
+        vector<size_t> leaders;
+        for (const Derived &candidate : derived) {
+            size_t slot = 0;
+            const size_t length = candidate.end - candidate.start;
+            while (slot < leaders.size() &&
+                   !(derived[leaders[slot]].end - derived[leaders[slot]].start == length &&
+                     sameCode(derived[leaders[slot]].start, candidate.start, length))) {
+                slot++;
+            }
+            if (slot == leaders.size() && leaders.size() < available) {
+                leaders.push_back(&candidate - derived.data());
+                steps.push_back(candidate.step);
+            }
+            slots.push_back(slot);
+        }
+
+        // the steps go after the increment, just before the Loop; the
+        // slots are emptied on the way in, so a value that outlived an
+        // earlier pass through the loop is not taken as computed. An
+        // AdvanceLocal left behind on its own only steps an empty slot
+        const size_t step = counted.end - Chunk::width(OpCode::Loop) - Chunk::width(OpCode::Pop);
+        Chunk advances;
+        Chunk resets;
+        for (size_t i = 0; i < leaders.size(); i++) {
+            advances.writeChunk(OpCode::AdvanceLocal, code.position(step));
+            advances.writeByte(static_cast<std::byte>(first + i), code.position(step));
+            advances.writeByte(static_cast<std::byte>(static_cast<unsigned char>(steps[i])),
+                               code.position(step));
+            resets.writeChunk(OpCode::DefineLocal, code.position(counted.test));
+            resets.writeByte(static_cast<std::byte>(first + i), code.position(counted.test));
+        }
+        if (!code.splice(step, 0, advances, advances.size())) {
+            continue;
+        }
+        moveLoops(step, 0, advances.size());
+        if (!code.splice(counted.test, 0, resets, resets.size())) {
+            continue;
+        }
+        moveLoops(counted.test, 0, resets.size());
+        localCount += leaders.size();
+        for (size_t i = derived.size(); i > 0; i--) {
+            if (slots[i - 1] == leaders.size()) {
+                continue;
+            }
+            const size_t from = derived[i - 1].start + resets.size();
+            const size_t to = derived[i - 1].end + resets.size();
+            const auto slot = static_cast<std::byte>(first + slots[i - 1]);
+            Chunk kept;
+            kept.writeChunk(OpCode::GetHoisted, code.position(from));
+            kept.writeByte(slot, code.position(from));
+            kept.writeByte(static_cast<std::byte>(to - from + Chunk::width(OpCode::KeepLocal)),
+                           code.position(from));
+            copyCode(code, from, to, kept);
+            kept.writeChunk(OpCode::KeepLocal, code.position(to - 1));
+            kept.writeByte(slot, code.position(to - 1));
+            if (!code.splice(from, to - from, kept, kept.size())) {
+                continue;
+            }
+            moveLoops(from, to - from, kept.size());
+        }
+    }
+}
+
+// Unrolls the FOR loops compiled into `code` since `countedLoops` was last
+// cleared whose bounds are integer literals or constants, and whose small
+// body neither assigns the iterator nor jumps out of itself. A loop of few
+// passes becomes that many copies of its body, each followed by the
+// iterator's increment; a longer one tests the iterator only once every
+// `options.unroll` copies, and the passes left over are copied after it.
+// Either way the iterator ends up one past the bound, as it would have.
+void Compiler::unrollLoops(Chunk &code) {
+    // inner loops first, so an outer loop sees their copies as its body
+    std::sort(countedLoops.begin(), countedLoops.end(),
+              [](const CountedLoop &a, const CountedLoop &b) { return a.init > b.init; });
+    const size_t factor = options.unroll;
+    // a BYREF parameter may alias a global or another BYREF parameter
+    std::unordered_set<size_t> references;
+    if (compiling) {
+        for (size_t i = 0; i < compiling->parameters.size(); i++) {
+            if (compiling->parameters[i].byRef) {
+                references.insert(i);
+            }
+        }
+    }
+    const auto opAt = [&](size_t at) { return static_cast<OpCode>(code.read(at)); };
+    // the integer the code at `at` loads, and where that code ends
+    const auto integer = [&](size_t at) -> std::optional<std::pair<i64, size_t>> {
+        if (opAt(at) != OpCode::Constant || !holds_alternative<i64>(code.getConstant(slotAt(code, at)))) {
+            return std::nullopt;
+        }
+        const i64 value = get<i64>(code.getConstant(slotAt(code, at)));
+        at += Chunk::width(OpCode::Constant);
+        if (opAt(at) == OpCode::Negate) {
+            return std::make_pair(-value, at + Chunk::width(OpCode::Negate));
+        }
+        return std::make_pair(value, at);
+    };
+    for (size_t loop = 0; loop < countedLoops.size() && factor > 1; loop++) {
+        const CountedLoop counted = countedLoops[loop];
+        // a global iterator's name is loaded first, a local's slot is set last
+        const auto first = integer(counted.init + (counted.local ? 0 : Chunk::width(OpCode::Constant)));
+        const auto last = integer(counted.test);
+        const size_t set = counted.local ? Chunk::width(OpCode::SetLocal)
+                                         : Chunk::width(OpCode::SetGlobal) + Chunk::width(OpCode::Pop);
+        // the slots of indices derived from the iterator are emptied in between
+        size_t entered = first ? first->second + set : counted.test;
+        while (entered < counted.test && opAt(entered) == OpCode::DefineLocal) {
+            entered += Chunk::width(OpCode::DefineLocal);
+        }
+        if (!first || !last || entered != counted.test || first->first > last->first) {
+            continue;
+        }
+        const uint64_t passes = static_cast<uint64_t>(last->first) - static_cast<uint64_t>(first->first) + 1;
+        // the body and the increment, up to the Loop and the Pop after it
+        const size_t step = counted.end - Chunk::width(OpCode::Loop) - Chunk::width(OpCode::Pop);
+        const size_t bodySize = step - counted.body;
+        if (passes == 0 || bodySize > maxUnrollBody) {
+            continue;
+        }
+
+        // the body may only jump within itself, and must leave the iterator
+        // to the increment
+        const bool aliased = !references.empty() && (!counted.local || references.count(counted.iterator));
+        bool unrollable = true;
+        for (size_t at = counted.body; at < counted.increment && unrollable; at += Chunk::width(opAt(at))) {
+            const auto opCode = opAt(at);
+            switch (opCode) {
+            case OpCode::Jump:
+            case OpCode::JumpNE:
+                unrollable = at + 2 + static_cast<size_t>(code.read(at + 1)) <= counted.increment;
+                break;
+            case OpCode::GetHoisted:
+                unrollable = at + 3 + static_cast<size_t>(code.read(at + 2)) <= counted.increment;
+                break;
+            case OpCode::Loop:
+            case OpCode::Switch:
+            case OpCode::Leave:
+                unrollable = false;
+                break;
+            case OpCode::Call:
+            case OpCode::TailCall:
+                unrollable = counted.local && !aliased;
+                break;
+            case OpCode::Constant: {
+                // a global's name is only read when GetGlobal follows it
+                const Value constant = code.getConstant(slotAt(code, at));
+                const auto next = opAt(at + Chunk::width(opCode));
+                if (holds_alternative<Symbol>(constant) && next != OpCode::GetGlobal &&
+                    next != OpCode::GetGlobalArray) {
+                    unrollable = !aliased && (counted.local || get<Symbol>(constant).id != counted.iterator);
+                }
+                break;
+            }
+            case OpCode::DefineLocal:
+            case OpCode::DefineLocalArray:
+            case OpCode::SetLocal:
+            case OpCode::SetLocalArray:
+            case OpCode::IncrementLocal:
+            case OpCode::RefLocal:
+            case OpCode::BindLocal:
+            case OpCode::KeepLocal:
+            case OpCode::AdvanceLocal: {
+                const auto slot = static_cast<size_t>(code.read(at + 1));
+                unrollable = !(aliased && references.count(slot)) && !(counted.local && slot == counted.iterator);
+                break;
+            }
+            default:
+                break;
+            }
+        }
+        if (!unrollable) {
+            continue;
+        }
+
+        Chunk unrolled;
+        const auto copies = [&](uint64_t count) {
+            for (uint64_t i = 0; i < count; i++) {
+                copyCode(code, counted.body, step, unrolled);
+            }
+        };
+        const bool whole = passes <= factor || passes * bodySize <= maxUnrollBytes;
+        // where the loop that is left ends
+        size_t rounds = 0;
+        if (whole) {
+            copies(passes);
+        } else {
+            // the test, against the last value of the iterator a whole
+            // round of copies starts from
+            const i64 bound = static_cast<i64>(static_cast<uint64_t>(first->first) +
+                                               (passes / factor - 1) * factor);
+            const size_t idx = unrolled.addConstant(Value(bound));
+            unrolled.writeChunk(OpCode::Constant, code.position(counted.test));
+            unrolled.writeByte(static_cast<std::byte>((idx >> 8) & 0xff), code.position(counted.test));
+            unrolled.writeByte(static_cast<std::byte>(idx & 0xff), code.position(counted.test));
+            copyCode(code, last->second, counted.body, unrolled);
+            // the JumpNE's distance, before the Pop on the way in
+            const size_t exit = unrolled.size() - Chunk::width(OpCode::Pop) - 1;
+            copies(factor);
+            const size_t distance = unrolled.size() + Chunk::width(OpCode::Loop) - (exit + 1);
+            const size_t back = unrolled.size() + Chunk::width(OpCode::Loop);
+            if (back > std::numeric_limits<unsigned char>::max()) {
+                continue;
+            }
+            unrolled.patch(exit, static_cast<std::byte>(distance));
+            unrolled.writeChunk(OpCode::Loop, code.position(step));
+            unrolled.writeByte(static_cast<std::byte>(back), code.position(step));
+            unrolled.writeChunk(OpCode::Pop, code.position(counted.end - 1));
+            rounds = unrolled.size();
+            copies(passes % factor);
+        }
+        const size_t length = counted.end - counted.test;
+        if (!code.splice(counted.test, length, unrolled, unrolled.size())) {
+            continue;
+        }
+        // whatever follows the loop moves; the loop itself is gone, or
+        // only as long as its rounds
+        const auto moved = [&](size_t offset) {
+            return offset >= counted.end ? offset - length + unrolled.size() : offset;
+        };
+        for (auto it = loops.begin(); it != loops.end();) {
+            if (it->first == counted.test && it->second == counted.end) {
+                if (whole) {
+                    it = loops.erase(it);
+                    continue;
+                }
+                it->second = counted.test + rounds;
+            } else {
+                *it = {moved(it->first), moved(it->second)};
+            }
+            ++it;
+        }
+        for (CountedLoop &other : countedLoops) {
+            other.init = moved(other.init);
+            other.test = moved(other.test);
+            other.body = moved(other.body);
+            other.increment = moved(other.increment);
+            other.end = moved(other.end);
+        }
+    }
+    countedLoops.clear();
+}
+
+// Loop-invariant code motion, for the loops compiled into `code` since
+// `loops` was last cleared. Within a loop, an expression of at least
+// three instructions that only reads variables the loop never writes, and
+// only applies operators and pure builtins to them, is computed once per
+// pass through the loop: the first time it runs its value is kept in a
+// frame slot, and from then on GetHoisted loads it and skips the code.
+// Computing it where it always was keeps its errors (and their absence,
+// on paths that never reach it) where they were. The slots are emptied
+// when the loop exits, so the next pass computes them afresh.
+void Compiler::hoistInvariants(Chunk &code) {
+    // innermost loops first, so an outer loop sees their hoisted code as
+    // opaque
+    std::sort(loops.begin(), loops.end(), [](const auto &a, const auto &b) {
+        return a.first != b.first ? a.first > b.first : a.second < b.second;
+    });
+    // a BYREF parameter may alias any variable the loop writes
+    std::unordered_set<size_t> references;
+    if (compiling) {
+        for (size_t i = 0; i < compiling->parameters.size(); i++) {
+            if (compiling->parameters[i].byRef) {
+                references.insert(i);
+            }
+        }
+    }
+    // the slots of indices derived from an iterator, whose code runs once
+    // per pass through their loop already
+    std::unordered_set<size_t> derived;
+    const size_t outermost = loops.empty() ? code.size() : loops.back().first;
+    for (size_t at = outermost; at < code.size(); at += Chunk::width(static_cast<OpCode>(code.read(at)))) {
+        if (static_cast<OpCode>(code.read(at)) == OpCode::AdvanceLocal) {
+            derived.insert(static_cast<size_t>(code.read(at + 1)));
+        }
+    }
+    for (size_t loop = 0; loop < loops.size(); loop++) {
+        const auto [start, end] = loops[loop];
+        std::unordered_set<uint32_t> globals;
+        std::unordered_set<size_t> locals = references;
+        bool calls = false;
+        for (size_t at = start; at < end; at += Chunk::width(static_cast<OpCode>(code.read(at)))) {
+            const auto opCode = static_cast<OpCode>(code.read(at));
+            switch (opCode) {
+            case OpCode::Constant: {
+                // a global's name is only read when GetGlobal follows it
+                const Value constant = code.getConstant(slotAt(code, at));
+                const auto next = static_cast<OpCode>(code.read(at + 3));
+                if (holds_alternative<Symbol>(constant) && next != OpCode::GetGlobal &&
+                    next != OpCode::GetGlobalArray) {
+                    globals.insert(get<Symbol>(constant).id);
+                }
+                break;
+            }
+            case OpCode::Call:
+            case OpCode::TailCall:
+                calls = true;
+                break;
+            case OpCode::DefineLocal:
+            case OpCode::DefineLocalArray:
+            case OpCode::SetLocal:
+            case OpCode::SetLocalArray:
+            case OpCode::IncrementLocal:
+            case OpCode::RefLocal:
+            case OpCode::BindLocal:
+            case OpCode::KeepLocal:
+            case OpCode::AdvanceLocal:
+                locals.insert(static_cast<size_t>(code.read(at + 1)));
+                break;
+            default:
+                break;
+            }
+        }
+
+        // values of the run of invariant code being scanned, in stack order
+        struct Operand {
+            size_t start, end, instructions;
+            bool computed;
+        };
+        vector<Operand> operands;
+        vector<std::pair<size_t, size_t>> invariants;
+        const auto flush = [&] {
+            for (const Operand &operand : operands) {
+                // GetHoisted skips the code and KeepLocal by a one-byte distance
+                if (operand.computed && operand.instructions >= 3 &&
+                    operand.end - operand.start + Chunk::width(OpCode::KeepLocal) <=
+                        std::numeric_limits<unsigned char>::max()) {
+                    invariants.emplace_back(operand.start, operand.end);
+                }
+            }
+            operands.clear();
+        };
+        const auto combine = [&](size_t count, size_t at, size_t width) {
+            if (operands.size() < count) {
+                flush();
+                return;
+            }
+            Operand &first = operands[operands.size() - count];
+            for (size_t i = operands.size() - count + 1; i < operands.size(); i++) {
+                first.instructions += operands[i].instructions;
+            }
+            operands.resize(operands.size() - count + 1);
+            first.end = at + width;
+            first.instructions++;
+            first.computed = true;
+        };
+        const auto targets = jumpTargets(code, start, end);
+        for (size_t at = start; at < end;) {
+            if (targets.count(at)) {
+                flush();
+            }
+            const auto opCode = static_cast<OpCode>(code.read(at));
+            const size_t width = Chunk::width(opCode);
+            switch (opCode) {
+            case OpCode::Constant: {
+                const Value constant = code.getConstant(slotAt(code, at));
+                if (!holds_alternative<Symbol>(constant)) {
+                    operands.push_back({at, at + width, 1, false});
+                    break;
+                }
+                const uint32_t name = get<Symbol>(constant).id;
+                if (calls || globals.count(name) || at + width >= end ||
+                    static_cast<OpCode>(code.read(at + width)) != OpCode::GetGlobal ||
+                    targets.count(at + width)) {
+                    flush();
+                    break;
+                }
+                operands.push_back({at, at + width + 1, 2, false});
+                at += width + 1;
+                continue;
+            }
+            case OpCode::GetLocal:
+                if (locals.count(static_cast<size_t>(code.read(at + 1)))) {
+                    flush();
+                } else {
+                    operands.push_back({at, at + width, 1, false});
+                }
+                break;
+            case OpCode::Negate:
+            case OpCode::Not:
+                combine(1, at, width);
+                break;
+            case OpCode::Equal:
+            case OpCode::NotEqual:
+            case OpCode::Greater:
+            case OpCode::GreaterEqual:
+            case OpCode::Lesser:
+            case OpCode::LesserEqual:
+            case OpCode::Add:
+            case OpCode::Subtract:
+            case OpCode::Divide:
+            case OpCode::Multiply:
+            case OpCode::Mod:
+            case OpCode::Div:
+            case OpCode::Concatenate:
+            case OpCode::And:
+            case OpCode::Or:
+                combine(2, at, width);
+                break;
+            case OpCode::Builtin: {
+                // named by the constant just before it
+                std::optional<size_t> arity;
+                if (!operands.empty() && operands.back().instructions == 1 &&
+                    static_cast<OpCode>(code.read(operands.back().start)) == OpCode::Constant) {
+                    const Value name = code.getConstant(slotAt(code, operands.back().start));
+                    if (holds_alternative<char>(name)) {
+                        arity = pureBuiltinArity(get<char>(name));
+                    }
+                }
+                if (arity) {
+                    combine(*arity + 1, at, width);
+                } else {
+                    flush();
+                }
+                break;
+            }
+            case OpCode::GetHoisted:
+                flush();
+                if (derived.count(static_cast<size_t>(code.read(at + 1)))) {
+                    at += width + static_cast<size_t>(code.read(at + 2));
+                    continue;
+                }
+                break;
+            default:
+                flush();
+                break;
+            }
+            at += width;
+        }
+        flush();
+        const size_t available = std::numeric_limits<unsigned char>::max() + 1 - localCount;
+        if (invariants.empty() || localCount >= std::numeric_limits<unsigned char>::max()) {
+            continue;
+        }
+        if (invariants.size() > available) {
+            invariants.resize(available);
+        }
+
+        // the slots are emptied on the way out first: a value that outlived
+        // its loop would be taken as already computed the next time in
+        const uint32_t first = localCount;
+        Chunk resets;
+        for (size_t i = 0; i < invariants.size(); i++) {
+            resets.writeChunk(OpCode::DefineLocal, code.position(end - 1));
+            resets.writeByte(static_cast<std::byte>(first + i), code.position(end - 1));
+        }
+        if (!code.splice(end, 0, resets, resets.size())) {
+            continue;
+        }
+        localCount += invariants.size();
+        // code spliced in at `at` moves whatever followed it, and code
+        // inserted there also what started there
+        const auto shift = [&](size_t at, size_t growth, bool inserted) {
+            for (auto &[loopStart, loopEnd] : loops) {
+                loopStart += loopStart > at || (inserted && loopStart == at) ? growth : 0;
+                loopEnd += loopEnd > at || (inserted && loopEnd == at) ? growth : 0;
+            }
+        };
+        shift(end, resets.size(), true);
+        for (size_t i = invariants.size(); i > 0; i--) {
+            const auto [from, to] = invariants[i - 1];
+            const auto slot = static_cast<std::byte>(first + i - 1);
+            Chunk hoisted;
+            hoisted.writeChunk(OpCode::GetHoisted, code.position(from));
+            hoisted.writeByte(slot, code.position(from));
+            hoisted.writeByte(static_cast<std::byte>(to - from + Chunk::width(OpCode::KeepLocal)),
+                              code.position(from));
+            copyCode(code, from, to, hoisted);
+            hoisted.writeChunk(OpCode::KeepLocal, code.position(to - 1));
+            hoisted.writeByte(slot, code.position(to - 1));
+            if (!code.splice(from, to - from, hoisted, hoisted.size())) {
+                continue;
+            }
+            shift(from, hoisted.size() - (to - from), false);
+        }
+    }
+    loops.clear();
+}
+
+// Common subexpressions, from `start` on in `code`. Straight-line code,
+// up to the next jump target or instruction that jumps away (a JumpNE
+// falls through into the same run), is value numbered: two expressions
+// of operators and pure builtins over the same constants and variables
+// are the same value when none of those variables was stored to in
+// between. The first one then keeps its value in a frame slot on its way
+// through and the later ones load it from there instead. A hoisted
+// expression already has a slot of its own, which the later copies read.
+void Compiler::reuseSubexpressions(Chunk &code, size_t start) {
+    // a BYREF parameter may alias any global or other BYREF parameter
+    std::unordered_set<size_t> references;
+    if (compiling) {
+        for (size_t i = 0; i < compiling->parameters.size(); i++) {
+            if (compiling->parameters[i].byRef) {
+                references.insert(i);
+            }
+        }
+    }
+    const auto targets = jumpTargets(code, start, code.size());
+
+    // value numbers, reset at every run of straight-line code
+    std::map<vector<size_t>, size_t> numbers;
+    std::unordered_map<Value, size_t, ValueHash> literals;
+    std::unordered_map<uint32_t, size_t> globalStores;
+    std::unordered_map<size_t, size_t> localStores;
+    size_t aliasedStores = 0;
+    const auto number = [&](vector<size_t> &&key) {
+        return numbers.emplace(std::move(key), numbers.size()).first->second;
+    };
+    const auto literal = [&](const Value &constant) {
+        // 0.0 and -0.0 compare equal but divide differently
+        if (holds_alternative<double>(constant) && get<double>(constant) == 0 &&
+            std::signbit(get<double>(constant))) {
+            return number({static_cast<size_t>(OpCode::Constant), 0, 1});
+        }
+        const size_t id = literals.emplace(constant, literals.size()).first->second;
+        return number({static_cast<size_t>(OpCode::Constant), id});
+    };
+    const auto global = [&](uint32_t name) {
+        return number({static_cast<size_t>(OpCode::GetGlobal), name, globalStores[name],
+                       references.empty() ? 0 : aliasedStores});
+    };
+    const auto local = [&](size_t slot) {
+        return number({static_cast<size_t>(OpCode::GetLocal), slot, localStores[slot],
+                       references.count(slot) ? aliasedStores : 0});
+    };
+
+    // a value on the operand stack and the code that computed it; a
+    // global's name is not a value until GetGlobal reads it
+    struct Operand {
+        size_t start, end;
+        std::optional<size_t> number;
+        std::optional<uint32_t> name;
+    };
+    // where each computed value is computed, and the slot a hoisted one
+    // is kept in
+    struct Occurrence {
+        size_t start, end;
+        std::optional<size_t> slot;
+    };
+    // code to replace by GetLocal `slot`, or with `length` 0, a KeepLocal
+    // `slot` to insert; the edits for one value share a `group`
+    struct Edit {
+        size_t at, length, slot, group;
+    };
+    vector<Operand> operands;
+    std::map<size_t, vector<Occurrence>> occurrences;
+    std::unordered_set<size_t> holders;
+    vector<Edit> edits;
+    size_t temporaries = 0;
+
+    const auto flush = [&] {
+        vector<std::pair<size_t, const vector<Occurrence> *>> repeated;
+        for (const auto &[value, found] : occurrences) {
+            if (found.size() > 1) {
+                repeated.emplace_back(value, &found);
+            }
+        }
+        // the largest expressions first, so the copies of what they
+        // contain go with them
+        std::sort(repeated.begin(), repeated.end(), [](const auto &a, const auto &b) {
+            const auto &x = a.second->front(), &y = b.second->front();
+            return x.end - x.start != y.end - y.start ? x.end - x.start > y.end - y.start
+                                                      : a.first < b.first;
+        });
+        vector<std::pair<size_t, size_t>> replaced;
+        size_t used = 0;
+        for (const auto &[value, found] : repeated) {
+            vector<Occurrence> live;
+            for (const Occurrence &occurrence : *found) {
+                if (std::none_of(replaced.begin(), replaced.end(), [&](const auto &range) {
+                        return range.first <= occurrence.start && occurrence.end <= range.second;
+                    })) {
+                    live.push_back(occurrence);
+                }
+            }
+            if (live.size() < 2) {
+                continue;
+            }
+            const size_t group = edits.size();
+            size_t slot;
+            if (live.front().slot) {
+                slot = *live.front().slot;
+            } else if (localCount + used <= std::numeric_limits<unsigned char>::max()) {
+                slot = localCount + used++;
+                edits.push_back({live.front().end, 0, slot, group});
+            } else {
+                continue;
+            }
+            for (size_t i = 1; i < live.size(); i++) {
+                edits.push_back({live[i].start, live[i].end - live[i].start, slot, group});
+                replaced.emplace_back(live[i].start, live[i].end);
+            }
+        }
+        temporaries = std::max(temporaries, used);
+        operands.clear();
+        occurrences.clear();
+        holders.clear();
+        numbers.clear();
+        literals.clear();
+        globalStores.clear();
+        localStores.clear();
+    };
+    const auto storeGlobal = [&](const Operand &name) {
+        if (!name.name) {
+            flush();
+            return;
+        }
+        globalStores[*name.name]++;
+        aliasedStores++;
+    };
+    const auto storeLocal = [&](size_t slot) {
+        if (holders.count(slot)) {
+            flush();
+            return;
+        }
+        localStores[slot]++;
+        aliasedStores += references.count(slot);
+    };
+    const auto pop = [&] {
+        Operand operand {0, 0, std::nullopt, std::nullopt};
+        if (!operands.empty()) {
+            operand = operands.back();
+            operands.pop_back();
+        }
+        return operand;
+    };
+    // applies an operator to the `count` operands on top, which must be
+    // the code just before it
+    const auto combine = [&](size_t count, size_t at, size_t width, OpCode opCode) {
+        if (operands.size() < count) {
+            flush();
+            return;
+        }
+        vector<size_t> key {static_cast<size_t>(opCode)};
+        bool known = operands.back().end == at;
+        for (size_t i = operands.size() - count; i < operands.size(); i++) {
+            known = known && operands[i].number &&
+                    (i + 1 == operands.size() || operands[i].end == operands[i + 1].start);
+            key.push_back(operands[i].number.value_or(0));
+        }
+        Operand result {operands[operands.size() - count].start, at + width, std::nullopt,
+                        std::nullopt};
+        operands.resize(operands.size() - count);
+        if (known) {
+            result.number = number(std::move(key));
+            occurrences[*result.number].push_back({result.start, result.end, std::nullopt});
+        }
+        operands.push_back(result);
+    };
+    // the value a hoisted expression at `at` computes, when it is made of
+    // operators and pure builtins alone
+    const auto hoisted = [&](size_t from, size_t to) -> std::optional<size_t> {
+        vector<size_t> values;
+        std::optional<uint32_t> name;
+        std::optional<Value> previous;
+        for (size_t at = from; at < to; at += Chunk::width(static_cast<OpCode>(code.read(at)))) {
+            if (at != from && targets.count(at)) {
+                return std::nullopt;
+            }
+            const auto opCode = static_cast<OpCode>(code.read(at));
+            if (name && opCode != OpCode::GetGlobal) {
+                return std::nullopt;
+            }
+            // the builtin is named by the constant pushed just before it
+            const std::optional<Value> builtin = std::move(previous);
+            previous.reset();
+            size_t count = 0;
+            switch (opCode) {
+            case OpCode::Constant: {
+                const Value constant = code.getConstant(slotAt(code, at));
+                previous = constant;
+                if (holds_alternative<Symbol>(constant)) {
+                    name = get<Symbol>(constant).id;
+                } else {
+                    values.push_back(literal(constant));
+                }
+                continue;
+            }
+            case OpCode::GetGlobal:
+                if (!name) {
+                    return std::nullopt;
+                }
+                values.push_back(global(*name));
+                name.reset();
+                continue;
+            case OpCode::GetLocal:
+                values.push_back(local(static_cast<size_t>(code.read(at + 1))));
+                continue;
+            case OpCode::Negate:
+            case OpCode::Not:
+                count = 1;
+                break;
+            case OpCode::Builtin: {
+                const auto arity = builtin && holds_alternative<char>(*builtin)
+                                       ? pureBuiltinArity(get<char>(*builtin))
+                                       : std::nullopt;
+                if (!arity) {
+                    return std::nullopt;
+                }
+                count = *arity + 1;
+                break;
+            }
+            case OpCode::Equal:
+            case OpCode::NotEqual:
+            case OpCode::Greater:
+            case OpCode::GreaterEqual:
+            case OpCode::Lesser:
+            case OpCode::LesserEqual:
+            case OpCode::Add:
+            case OpCode::Subtract:
+            case OpCode::Divide:
+            case OpCode::Multiply:
+            case OpCode::Mod:
+            case OpCode::Div:
+            case OpCode::Concatenate:
+            case OpCode::And:
+            case OpCode::Or:
+                count = 2;
+                break;
+            default:
+                return std::nullopt;
+            }
+            if (values.size() < count) {
+                return std::nullopt;
+            }
+            vector<size_t> key {static_cast<size_t>(opCode)};
+            key.insert(key.end(), values.end() - count, values.end());
+            values.resize(values.size() - count);
+            values.push_back(number(std::move(key)));
+        }
+        return values.size() == 1 && !name ? std::optional<size_t>(values.front()) : std::nullopt;
+    };
+
+    // the end of the last hoisted expression, where only its own GetHoisted
+    // lands
+    size_t rejoined = start;
+    for (size_t at = start; at < code.size();) {
+        if (targets.count(at) && at != rejoined) {
+            flush();
+        }
+        const auto opCode = static_cast<OpCode>(code.read(at));
+        const size_t width = Chunk::width(opCode);
+        switch (opCode) {
+        case OpCode::Constant: {
+            const Value constant = code.getConstant(slotAt(code, at));
+            if (holds_alternative<Symbol>(constant)) {
+                operands.push_back({at, at + width, std::nullopt, get<Symbol>(constant).id});
+            } else {
+                operands.push_back({at, at + width, literal(constant), std::nullopt});
+            }
+            break;
+        }
+        case OpCode::GetGlobal:
+            if (operands.empty() || !operands.back().name || operands.back().end != at) {
+                flush();
+                break;
+            }
+            operands.back() = {operands.back().start, at + width, global(*operands.back().name),
+                               std::nullopt};
+            break;
+        case OpCode::GetLocal:
+            operands.push_back({at, at + width, local(static_cast<size_t>(code.read(at + 1))),
+                                std::nullopt});
+            break;
+        case OpCode::GetGlobalArray:
+            pop();
+            pop();
+            operands.push_back({at, at + width, std::nullopt, std::nullopt});
+            break;
+        case OpCode::GetLocalArray:
+            pop();
+            operands.push_back({at, at + width, std::nullopt, std::nullopt});
+            break;
+        case OpCode::Negate:
+        case OpCode::Not:
+            combine(1, at, width, opCode);
+            break;
+        case OpCode::Equal:
+        case OpCode::NotEqual:
+        case OpCode::Greater:
+        case OpCode::GreaterEqual:
+        case OpCode::Lesser:
+        case OpCode::LesserEqual:
+        case OpCode::Add:
+        case OpCode::Subtract:
+        case OpCode::Divide:
+        case OpCode::Multiply:
+        case OpCode::Mod:
+        case OpCode::Div:
+        case OpCode::Concatenate:
+        case OpCode::And:
+        case OpCode::Or:
+            combine(2, at, width, opCode);
+            break;
+        case OpCode::Builtin: {
+            // named by the constant just before it
+            std::optional<size_t> arity;
+            if (!operands.empty() && operands.back().end == at &&
+                operands.back().end - operands.back().start == Chunk::width(OpCode::Constant)) {
+                const Value name = code.getConstant(slotAt(code, operands.back().start));
+                if (holds_alternative<char>(name)) {
+                    arity = pureBuiltinArity(get<char>(name));
+                }
+            }
+            if (arity) {
+                combine(*arity + 1, at, width, opCode);
+            } else {
+                flush();
+            }
+            break;
+        }
+        case OpCode::GetHoisted: {
+            const auto slot = static_cast<size_t>(code.read(at + 1));
+            const size_t end = at + width + static_cast<size_t>(code.read(at + 2));
+            const size_t keep = end - Chunk::width(OpCode::KeepLocal);
+            std::optional<size_t> value;
+            if (end <= code.size() && targets.at(end) == 1 &&
+                static_cast<OpCode>(code.read(keep)) == OpCode::KeepLocal &&
+                static_cast<size_t>(code.read(keep + 1)) == slot) {
+                value = hoisted(at + width, keep);
+            }
+            if (!value) {
+                flush();
+                break;
+            }
+            operands.push_back({at, end, value, std::nullopt});
+            occurrences[*value].push_back({at, end, slot});
+            holders.insert(slot);
+            at = rejoined = end;
+            continue;
+        }
+        case OpCode::SetGlobal:
+            pop();
+            if (!operands.empty()) {
+                storeGlobal(operands.back());
+            } else {
+                flush();
+            }
+            break;
+        case OpCode::SetGlobalArray: {
+            const Operand value = pop();
+            storeGlobal(pop());
+            pop();
+            operands.push_back({at, at + width, value.number, std::nullopt});
+            break;
+        }
+        case OpCode::DefineGlobal:
+        case OpCode::IncrementGlobal:
+            storeGlobal(pop());
+            break;
+        case OpCode::DefineGlobalArray:
+            storeGlobal(pop());
+            pop();
+            pop();
+            break;
+        case OpCode::SetLocal:
+            pop();
+            storeLocal(static_cast<size_t>(code.read(at + 1)));
+            break;
+        case OpCode::SetLocalArray: {
+            const Operand value = pop();
+            pop();
+            storeLocal(static_cast<size_t>(code.read(at + 1)));
+            operands.push_back({at, at + width, value.number, std::nullopt});
+            break;
+        }
+        case OpCode::DefineLocalArray:
+            pop();
+            pop();
+            pop();
+            storeLocal(static_cast<size_t>(code.read(at + 1)));
+            break;
+        case OpCode::DefineLocal:
+        case OpCode::IncrementLocal:
+        case OpCode::KeepLocal:
+        case OpCode::AdvanceLocal:
+            storeLocal(static_cast<size_t>(code.read(at + 1)));
+            break;
+        case OpCode::Pop:
+        case OpCode::Output:
+            pop();
+            break;
+        case OpCode::Input:
+            operands.push_back({at, at + width, std::nullopt, std::nullopt});
+            break;
+        case OpCode::JumpNE:
+            break;
+        default:
+            // jumps, calls, and references handed to them
+            flush();
+            break;
+        }
+        at += width;
+    }
+    flush();
+    if (edits.empty()) {
+        return;
+    }
+
+    // in code order, each moved by the edits before it; a KeepLocal that
+    // does not fit takes the loads of its value with it
+    std::sort(edits.begin(), edits.end(), [](const Edit &a, const Edit &b) {
+        return a.at != b.at ? a.at < b.at : a.length < b.length;
+    });
+    std::unordered_set<size_t> failed;
+    ptrdiff_t moved = 0;
+    for (const Edit &edit : edits) {
+        if (failed.count(edit.group)) {
+            continue;
+        }
+        const size_t at = edit.at + moved;
+        Chunk replacement;
+        replacement.writeChunk(edit.length ? OpCode::GetLocal : OpCode::KeepLocal,
+                               code.position(edit.length ? at : at - 1));
+        replacement.writeByte(static_cast<std::byte>(edit.slot), code.position(edit.length ? at : at - 1));
+        if (!code.splice(at, edit.length, replacement, replacement.size())) {
+            if (!edit.length) {
+                failed.insert(edit.group);
+            }
+            continue;
+        }
+        moved += static_cast<ptrdiff_t>(replacement.size()) - static_cast<ptrdiff_t>(edit.length);
+    }
+    localCount += temporaries;
+}
+
+// The bytes of a procedure's body an inlined copy takes: all but the
+// trailing EndFunction of a PROCEDURE. A FUNCTION's body ends with the
+// EndFunction of its last RETURN and then returns nothing in case it runs
+// off its end; the copy stops before that RETURN's EndFunction, leaving
+// the value on the stack as the call would. None for a FUNCTION that does
+// not end with a RETURN.
+static std::optional<size_t> inlinedSize(const Function &function) {
+    const Chunk &body = function.chunk;
+    if (function.returns == TokenType::Eof) {
+        return body.size() - 1;
+    }
+    const size_t fallback = Chunk::width(OpCode::Constant) + Chunk::width(OpCode::EndFunction);
+    if (body.size() < fallback + Chunk::width(OpCode::EndFunction)) {
+        return std::nullopt;
+    }
+    const size_t end = body.size() - fallback - Chunk::width(OpCode::EndFunction);
+    if (static_cast<OpCode>(body.read(end)) != OpCode::EndFunction ||
+        static_cast<OpCode>(body.read(end + 1)) != OpCode::Constant ||
+        !holds_alternative<std::monostate>(body.getConstant(slotAt(body, end + 1)))) {
+        return std::nullopt;
+    }
+    return end;
+}
+
+// Replaces each CALL from `start` on whose procedure is inlinable with a
+// copy of its body. The body's frame slots are moved past the caller's,
+// and its prologue pops the arguments into them just as it would in a call.
+void Compiler::inlineCalls(Chunk &code, size_t start, uint32_t &localCount) {
+    if (!options.inlining) {
+        return;
+    }
+    for (size_t at = start; at < code.size();) {
+        const auto opCode = static_cast<OpCode>(code.read(at));
+        if (opCode == OpCode::Call) {
+            const size_t slot = slotAt(code, at);
+            const Chunk &body = functions[slot]->chunk;
+            if (inlinable(slot) && code.splice(at, Chunk::width(opCode), body,
+                                               *inlinedSize(*functions[slot]), localCount)) {
+                localCount += functions[slot]->localCount;
+                // a tail call of the body is no longer one in the caller
+                const size_t end = at + *inlinedSize(*functions[slot]);
+                for (; at < end; at += Chunk::width(static_cast<OpCode>(code.read(at)))) {
+                    if (static_cast<OpCode>(code.read(at)) == OpCode::TailCall) {
+                        code.patch(at, static_cast<std::byte>(OpCode::Call));
+                    }
+                }
+                continue;
+            }
+        }
+        at += Chunk::width(opCode);
+    }
+}
+
+// Small procedures that do not call themselves, return only at their end
+// and are not memoized. One that was never called is compiled here,
+// unless its source is already too long to be worth it or it does not
+// compile, in which case its CALL is left to report the error.
+bool Compiler::inlinable(size_t slot) {
+    Function &function = *functions[slot];
+    if (std::find(inlining.begin(), inlining.end(), slot) != inlining.end()) {
+        return false;
+    }
+    // an inlined body's slots outlive it, so an array passed to it would
+    // stay shared and the caller's next write to it would copy it
+    for (const Parameter &parameter : function.parameters) {
+        if (parameter.isArray) {
+            return false;
+        }
+    }
+    if (!function.compiled) {
+        if (function.source.size() > maxInlineSource) {
+            return false;
+        }
+        try {
+            compileFunction(function);
+        } catch (const std::exception &) {
+            return false;
+        }
+    }
+    const Chunk &body = function.chunk;
+    if (body.size() == 0 || function.memoize) {
+        return false;
+    }
+    const std::optional<size_t> size = inlinedSize(function);
+    if (!size || *size > maxInlineBytes) {
+        return false;
+    }
+    // nothing may reach the return of nothing after a FUNCTION's last RETURN
+    for (const auto &target : jumpTargets(body, 0, body.size())) {
+        if (target.first > *size) {
+            return false;
+        }
+    }
+    for (size_t at = 0; at < body.size(); at += Chunk::width(static_cast<OpCode>(body.read(at)))) {
+        const auto opCode = static_cast<OpCode>(body.read(at));
+        if (opCode == OpCode::EndFunction && at != *size && at != body.size() - 1) {
+            return false;
+        }
+        if ((opCode == OpCode::Call || opCode == OpCode::TailCall) && slotAt(body, at) == slot) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// A FUNCTION is pure when its result depends on nothing but its arguments
+// and it has no effect besides returning it: it takes no BYREF or array
+// parameters, never touches a global, does no I/O, calls no SYSTEM or
+// RANDOM_* builtin and calls nothing but itself and other pure or memoized
+// functions. Its calls can then be answered from a cache of earlier
+// results. A procedure being optimized further up is not known to be pure.
+bool Compiler::pure(size_t slot) {
+    const Function &function = *functions[slot];
+    if (function.returns == TokenType::Eof) {
+        return false;
+    }
+    for (const Parameter &parameter : function.parameters) {
+        if (parameter.byRef || parameter.isArray) {
+            return false;
+        }
+    }
+    const Chunk &body = function.chunk;
+    // the builtin is named by the constant pushed just before it
+    builtintype builtin = builtintype::System;
+    for (size_t at = 0; at < body.size(); at += Chunk::width(static_cast<OpCode>(body.read(at)))) {
+        switch (static_cast<OpCode>(body.read(at))) {
+        case OpCode::Constant: {
+            const Value constant = body.getConstant(slotAt(body, at));
+            builtin = std::holds_alternative<char>(constant)
+                          ? static_cast<builtintype>(get<char>(constant))
+                          : builtintype::System;
+            continue;
+        }
+        case OpCode::DefineGlobal:
+        case OpCode::DefineGlobalArray:
+        case OpCode::SetGlobal:
+        case OpCode::SetGlobalArray:
+        case OpCode::GetGlobal:
+        case OpCode::GetGlobalArray:
+        case OpCode::IncrementGlobal:
+        case OpCode::RefGlobal:
+        case OpCode::Input:
+        case OpCode::Output:
+            return false;
+        case OpCode::Builtin:
+            if (builtin == builtintype::System || builtin == builtintype::RandomInt ||
+                builtin == builtintype::RandomReal) {
+                return false;
+            }
+            break;
+        case OpCode::Call:
+        case OpCode::TailCall: {
+            const size_t callee = slotAt(body, at);
+            if (callee == slot) {
+                break;
+            }
+            Function &called = *functions[callee];
+            if (!called.compiled &&
+                std::find(inlining.begin(), inlining.end(), callee) == inlining.end()) {
+                try {
+                    compileFunction(called);
+                } catch (const std::exception &) {
+                    return false;
+                }
+            }
+            if (!called.pure && !called.memoize) {
+                return false;
+            }
+            break;
+        }
+        default:
+            break;
+        }
+        builtin = builtintype::System;
+    }
+    return true;
+}
+
+// whether `body` calls procedure `slot` itself other than in tail
+// position. Only such a FUNCTION is worth memoizing by default: looking
+// up a call costs more than running a body that makes no further calls,
+// and a tail-recursive one would need a frame per step to file its results
+// from, where otherwise it runs in one, and caches results never asked again.
+bool Compiler::recursive(const Chunk &body, size_t slot) {
+    for (size_t at = 0; at < body.size(); at += Chunk::width(static_cast<OpCode>(body.read(at)))) {
+        if (static_cast<OpCode>(body.read(at)) == OpCode::Call && slotAt(body, at) == slot) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// byte offset of the start of `line` (or the end of the input)
+size_t Compiler::lineOffset(int line) {
+    if (line < cursorLine) {
+        cursorLine = sourceLine;
+        cursorOffset = 0;
+    }
+    while (cursorLine < line && cursorOffset < source.size()) {
+        const void *newline = std::memchr(source.data() + cursorOffset, '\n',
+                                          source.size() - cursorOffset);
+        cursorOffset = newline ? static_cast<const char *>(newline) - source.data() + 1
+                               : source.size();
+        ++cursorLine;
+    }
+    return cursorOffset;
 }
 
 void Compiler::parseCallStatement() {
     consume(TokenType::Identifier, "Expected Identifier after CALL");
-    const string name = get<string>(currentToken.literal);
-    // consume(TokenType::Lparen, "Expected ( after Identifier");
-    // consume(TokenType::Rparen, "Expected ) after args");
-    const auto it = functionIdxMap.find(name);
-    if (it == functionIdxMap.end()) {
-        Error.report(currentToken, "Compiler",
+    const Symbol name = get<Symbol>(currentLiteral());
+    const auto slot = resolveFunction(name);
+    if (!slot) {
+        Error.report(currentToken(), "Compiler",
                      "Function / Procedure is undefined");
     }
-    auto idx = static_cast<i64>(it->second);
-    emitCall(std::move(idx));
+    const Function &function = *functions[*slot];
+    parseArguments(function);
+    emitCall(*slot);
+    if (function.returns != TokenType::Eof) {
+        emitPop();
+    }
     consume(TokenType::Newline, "Expected newline after )");
 }
 
-std::unique_ptr<Chunk> Compiler::compile(string &input) {
-    initCompiler(input);
-    while (peekToken.type != TokenType::Eof) {
-        program();
+// pushes the arguments of a call, in order, from the current token (the
+// procedure's name); the parentheses may be left out when there are none
+void Compiler::parseArguments(const Function &function) {
+    size_t count = 0;
+    if (peekType() == TokenType::Lparen) {
+        advance();
+        while (peekType() != TokenType::Rparen) {
+            if (count > 0) {
+                consume(TokenType::Comma, "Expected , between arguments");
+            }
+            advance();
+            if (count < function.parameters.size() &&
+                (function.parameters[count].byRef || function.parameters[count].isArray)) {
+                parseVariableArgument(function.parameters[count]);
+            } else {
+                expression();
+            }
+            ++count;
+        }
+        consume(TokenType::Rparen, "Expected ) after arguments");
+    }
+    if (count != function.parameters.size()) {
+        Error.report(currentToken(), "Compiler",
+                     nameOf(Value(function.name)) + " takes " +
+                         std::to_string(function.parameters.size()) + " argument(s), not " +
+                         std::to_string(count));
     }
-    emit(OpCode::Return);
-    return std::move(chunk);
 }
 
-void Compiler::advance() {
-    if (TokenList[idx]->type != TokenType::Eof && idx < TokenList.size()) {
-        currentToken = peekToken;
-        peekToken = *TokenList[++idx];
+// A BYREF or array argument names a variable instead of computing a
+// value: BYREF passes a Reference to it, and a BYVAL array is passed as
+// the array itself, shared until one side writes to it.
+void Compiler::parseVariableArgument(const Parameter &parameter) {
+    if (currentType() != TokenType::Identifier ||
+        (peekType() != TokenType::Comma && peekType() != TokenType::Rparen)) {
+        Error.report(currentToken(), "Compiler",
+                     "Expected a variable for parameter " + nameOf(Value(parameter.name)));
     }
-    return;
+    const Symbol name = get<Symbol>(currentLiteral());
+    if (parameter.byRef) {
+        rejectConstant(name);
+    }
+    const Identifier *local = resolveLocal(name);
+    const Identifier *global = local ? nullptr : resolveGlobal(name);
+    TokenType type = TokenType::Eof;
+    if (local) {
+        type = local->isArray == parameter.isArray ? local->type : TokenType::Eof;
+    } else if (global) {
+        type = global->isArray == parameter.isArray ? globalsType[name.id] : TokenType::Eof;
+    } else {
+        Error.report(currentToken(), "Compile",
+                     "Variable " + nameOf(currentLiteral()) + " not declared in this scope");
+    }
+    if (type != parameter.type) {
+        Error.report(currentToken(), "Compiler",
+                     nameOf(currentLiteral()) + " does not match the type of parameter " +
+                         nameOf(Value(parameter.name)));
+    }
+    const OpCode opGet = parameter.byRef ? OpCode::RefLocal : OpCode::GetLocal;
+    if (local) {
+        emitLocal(opGet, *local);
+        return;
+    }
+    value();
+    emit(parameter.byRef ? OpCode::RefGlobal : OpCode::GetGlobal);
 }
 
-void Compiler::retreat() {
-    if (idx > 2) {
-        peekToken = currentToken;
-        currentToken = *TokenList[--idx];
+void Compiler::parseReturnStatement() {
+    if (!compiling) {
+        Error.report(currentToken(), "Compiler", "RETURN outside of a procedure");
     }
-    return;
+    if (compiling->returns != TokenType::Eof) {
+        advance();
+        expression();
+    }
+    consume(TokenType::Newline, "Expected newline after RETURN");
+    emit(OpCode::EndFunction);
 }
 
-TokenType Compiler::getArrayDeclarationType() {
-    while (currentToken.type != TokenType::Rsqrbracket ||
-           peekToken.type != TokenType::Of)
-        advance();
-    advance();
-    TokenType arrayType = peekToken.type;
-    while (currentToken.type != TokenType::Lsqrbracket)
-        retreat();
-    return arrayType;
+// Compiles `input` onto the end of `module` and returns the offset its code
+// starts at; the trailing Return of the previous compile is replaced.
+// Procedures live in chunks of their own, so once the new code has run
+// the caller may cut the module back to where it was. On a compile error
+// the module is rolled back to how it was.
+size_t Compiler::compile(std::string_view input, Chunk &module) {
+    chunk = &module;
+    if (!module.bytecode.empty()) {
+        module.truncate(module.bytecode.size() - 1, module.constantPool.size(), module.switches.size());
+    }
+    const size_t start = module.bytecode.size();
+    const size_t constantCount = module.constantPool.size();
+    const size_t switchCount = module.switches.size();
+    const size_t declared = identifiers.size();
+    const size_t defined = functions.size();
+    const size_t namedConstants = constants.size();
+    try {
+        initCompiler(input);
+        while (peekType() != TokenType::Eof) {
+            program();
+        }
+        // --eager compiles each body from its text just as its first CALL
+        // would, so both stop at its end and report the same errors
+        if (options.eager) {
+            const uint32_t locals = localCount;
+            for (size_t slot = defined; slot < functions.size(); slot++) {
+                if (!functions[slot]->compiled) {
+                    compileFunction(*functions[slot]);
+                }
+            }
+            chunk = &module;
+            localCount = locals;
+        }
+    } catch (...) {
+        // the error may have struck inside a procedure body
+        chunk = &module;
+        module.truncate(start, constantCount, switchCount);
+        constants.resize(namedConstants);
+        for (auto it = constantIdxMap.begin(); it != constantIdxMap.end();) {
+            it = it->second >= namedConstants ? constantIdxMap.erase(it) : std::next(it);
+        }
+        loops.clear();
+        countedLoops.clear();
+        functions.erase(functions.begin() + defined, functions.end());
+        for (auto it = functionIdxMap.begin(); it != functionIdxMap.end();) {
+            it = it->second >= defined ? functionIdxMap.erase(it) : std::next(it);
+        }
+        identifiers.erase(identifiers.begin() + declared, identifiers.end());
+        emit(OpCode::Return);
+        chunk = nullptr;
+        compiling = nullptr;
+        frameStart = 0;
+        lexer.release();
+        throw;
+    }
+    emit(OpCode::Return);
+    deriveIndices(module);
+    unrollLoops(module);
+    hoistInvariants(module);
+    reuseSubexpressions(module, start);
+    chunk = nullptr;
+    // the module's slots only serve the code just compiled
+    moduleLocals = localCount;
+    // the scratch allocations of this compilation live in the lexer's
+    // arena, so drop them in one shot instead of piecemeal
+    lexer.release();
+    inlineCalls(module, start, moduleLocals);
+    return start;
+}
+
+void Compiler::advance() {
+    if (peekType() != TokenType::Eof) {
+        current = peek;
+        lexer.pull(++peek);
+    }
+    return;
 }
 
 void Compiler::expressionStatement() {
@@ -342,13 +2198,13 @@ void Compiler::expressionStatement() {
         printStatement();
     } else if (match(TokenType::Declare)) {
         parseDeclareStatement();
-    } else if (currentToken.type == TokenType::Identifier &&
-               (peekToken.type == TokenType::Assignment ||
-                peekToken.type == TokenType::Lsqrbracket)) {
+    } else if (currentType() == TokenType::Identifier &&
+               (peekType() == TokenType::Assignment ||
+                peekType() == TokenType::Lsqrbracket)) {
         parseAssignmentStatement();
-    } else if (currentToken.type == TokenType::Newline) {
+    } else if (currentType() == TokenType::Newline) {
         advance();
-    } else if (currentToken.type == TokenType::Input) {
+    } else if (currentType() == TokenType::Input) {
         parseInputStatement();
 
     } else {
@@ -361,58 +2217,72 @@ void Compiler::expressionStatement() {
 void Compiler::parseAssignmentStatement() {
     OpCode opSet;
     bool isArray = false;
-    auto identifier = currentToken;
-    isArray = peekToken.type == TokenType::Lsqrbracket;
-    if (checkGlobalExists()) {
-        opSet = isArray ? OpCode::SetGlobalArray : OpCode::SetGlobal;
-    } else if (checkLocalExists()) {
+    const Value identifier = currentLiteral();
+    isArray = peekType() == TokenType::Lsqrbracket;
+    rejectConstant(get<Symbol>(identifier));
+    const Identifier *local = resolveLocal(get<Symbol>(identifier));
+    if (local) {
         opSet = isArray ? OpCode::SetLocalArray : OpCode::SetLocal;
+    } else if (checkGlobalExists()) {
+        opSet = isArray ? OpCode::SetGlobalArray : OpCode::SetGlobal;
     } else {
-        Error.report(currentToken, "Compile",
-                     "Variable " + get<string>(identifier.literal) +
+        Error.report(currentToken(), "Compile",
+                     "Variable " + nameOf(identifier) +
                          " not declared in this scope");
     }
-    if (!isArray) {
-        value();
-    } else {
+    if (isArray) {
         consume(TokenType::Lsqrbracket, "expected [ after array identifier");
         advance();
-        expression();
+        arrayIndex(get<Symbol>(identifier));
         consume(TokenType::Rsqrbracket, "expected ] after array identifier");
-        emitConstant(std::move(identifier.literal));
+        if (!local) {
+            emitConstant(Value(identifier));
+        }
+    } else if (!local) {
+        value();
     }
     consume(TokenType::Assignment, "Expected <-");
     advance();
     expression();
     consume(TokenType::Newline, "Unexpected end of expression");
-    emit(opSet);
+    if (opSet == OpCode::SetLocal) {
+        emitLocal(opSet, *local);
+        return;
+    }
+    local ? emitLocal(opSet, *local) : emit(opSet);
     emitPop();
 }
 
-void Compiler::parseForAssignmentStatement(Token iterator) {
-    auto opSet = scopeDepth == 0 ? OpCode::SetGlobal : OpCode::SetLocal;
-    emitConstant(std::move(iterator.literal));
+void Compiler::parseForAssignmentStatement(const Value &iterator, const Identifier *local) {
+    if (!local) {
+        emitConstant(Value(iterator));
+    }
     consume(TokenType::Assignment, "Expected <- after iteratore");
     advance();
     expression();
-    emit(opSet);
+    if (local) {
+        emitLocal(OpCode::SetLocal, *local);
+    } else {
+        emit(OpCode::SetGlobal);
+        emitPop();
+    }
 }
 
 void Compiler::beginScope() { ++scopeDepth; }
 
 void Compiler::block(TokenType type) {
-    while (peekToken.type != TokenType::Eof && peekToken.type != type) {
+    while (peekType() != TokenType::Eof && peekType() != type) {
         program();
     }
     consume(type, "Unexpected end of scope");
 }
 
 void Compiler::block(TokenType type, TokenType endBlock2) {
-    while (peekToken.type != TokenType::Eof && peekToken.type != type &&
-           peekToken.type != endBlock2) {
+    while (peekType() != TokenType::Eof && peekType() != type &&
+           peekType() != endBlock2) {
         program();
     }
-    peekToken.type == type
+    peekType() == type
         ? consume(type, "Unexpected end of scope, expected Endif")
         : consume(endBlock2, "Unexpected end of scope Else");
 }
@@ -425,11 +2295,9 @@ size_t Compiler::emitJump(OpCode opCode) {
 void Compiler::patchJump(size_t offset) {
     const auto distance = chunk->bytecode.size() - offset;
     if (distance > std::numeric_limits<unsigned char>::max()) {
-        Error.report(currentToken, "Stack overflow", "Jump block too large");
+        Error.report(currentToken(), "Stack overflow", "Jump block too large");
     }
     chunk->patch(offset - 1, static_cast<std::byte>(distance));
-    chunkPosition.push_back(
-        std::make_pair(currentToken.line, currentToken.column));
 }
 
 void Compiler::parseIfStatement() {
@@ -443,7 +2311,8 @@ void Compiler::parseIfStatement() {
     endScope();
     size_t elseJump = emitJump(OpCode::Jump);
     patchJump(thenJump);
-    if (currentToken.type == TokenType::Else) {
+    emitPop();
+    if (currentType() == TokenType::Else) {
         advance();
         beginScope();
         block(TokenType::Endif);
@@ -453,13 +2322,380 @@ void Compiler::parseIfStatement() {
     advance();
 }
 
+// CONSTANT <name> = <expression>, where the expression only combines
+// literals and earlier constants. It is evaluated here, and every later
+// read of the name loads the value itself, so nothing is emitted for it.
+void Compiler::parseConstantStatement() {
+    consume(TokenType::Identifier, "Expected identifier after CONSTANT");
+    const Symbol name = get<Symbol>(currentLiteral());
+    if (scopeDepth != 0 || compiling) {
+        Error.report(currentToken(), "Compile",
+                     "CONSTANT can only be declared outside procedures and blocks");
+    }
+    if (resolveConstant(name) || checkGlobalExists(name)) {
+        Error.report(currentToken(), "Compile", nameOf(Value(name)) + " is already declared");
+    }
+    peekType() == TokenType::Assignment
+        ? consume(TokenType::Assignment, "Expected = after constant name")
+        : consume(TokenType::Equals, "Expected = after constant name");
+    advance();
+    const size_t start = chunk->bytecode.size();
+    const size_t constantCount = chunk->constantPool.size();
+    const auto value = constantExpression();
+    if (!value) {
+        Error.report(currentToken(), "Compile",
+                     "CONSTANT " + nameOf(Value(name)) +
+                         " must be computed from literals and constants of matching types");
+    }
+    consume(TokenType::Newline, "Unexpected end of constant declaration");
+    chunk->truncate(start, constantCount, chunk->switches.size());
+    constantIdxMap.emplace(name.id, constants.size());
+    constants.push_back(*value);
+}
+
+// writes to a name that is not a local's must not reach a constant
+void Compiler::rejectConstant(Symbol name) {
+    if (!resolveLocal(name) && resolveConstant(name)) {
+        Error.report(currentToken(), "Compile", "Cannot assign to constant " + nameOf(Value(name)));
+    }
+}
+
+// Compiles an expression. When it only combines literals and constants,
+// its code is replaced by a load of its value, which is returned.
+std::optional<Value> Compiler::constantExpression() {
+    const size_t start = chunk->bytecode.size();
+    const size_t constantCount = chunk->constantPool.size();
+    expression();
+    auto value = fold(start);
+    if (value) {
+        chunk->truncate(start, constantCount, chunk->switches.size());
+        emitConstant(Value(*value));
+    }
+    return value;
+}
+
+// The value the code from `start` on leaves on the stack, when it is only
+// constant loads and the operators the VM would apply to them; operands
+// of mixed types are left for the VM to report.
+std::optional<Value> Compiler::fold(size_t start) {
+    vector<Value> stack;
+    for (size_t at = start; at < chunk->bytecode.size(); at += Chunk::width(static_cast<OpCode>(chunk->bytecode[at]))) {
+        const auto opCode = static_cast<OpCode>(chunk->bytecode[at]);
+        if (opCode == OpCode::Constant) {
+            const Value constant = chunk->getConstant(static_cast<size_t>(chunk->bytecode[at + 1]) << 8 |
+                                                      static_cast<size_t>(chunk->bytecode[at + 2]));
+            // a symbol is the name of a variable about to be read
+            if (holds_alternative<Symbol>(constant) || holds_alternative<std::monostate>(constant)) {
+                return std::nullopt;
+            }
+            stack.push_back(constant);
+            continue;
+        }
+        if (opCode == OpCode::Negate || opCode == OpCode::Not) {
+            if (stack.empty()) {
+                return std::nullopt;
+            }
+            Value &operand = stack.back();
+            if (opCode == OpCode::Not && holds_alternative<bool>(operand)) {
+                operand = !get<bool>(operand);
+            } else if (opCode == OpCode::Negate && holds_alternative<i64>(operand)) {
+                operand = -get<i64>(operand);
+            } else if (opCode == OpCode::Negate && holds_alternative<double>(operand)) {
+                operand = -get<double>(operand);
+            } else {
+                return std::nullopt;
+            }
+            continue;
+        }
+        if (stack.size() < 2) {
+            return std::nullopt;
+        }
+        const Value right = stack.back();
+        stack.pop_back();
+        Value &left = stack.back();
+        const bool sameType = left.index() == right.index();
+        const auto arithmetic = [&](auto l, auto r) -> std::optional<Value> {
+            using T = decltype(l);
+            switch (opCode) {
+            case OpCode::Add: return Value(T(l + r));
+            case OpCode::Subtract: return Value(T(l - r));
+            case OpCode::Multiply: return Value(T(l * r));
+            case OpCode::Divide:
+            case OpCode::Div:
+            case OpCode::Mod:
+                if constexpr (std::is_same_v<T, i64>) {
+                    if (r == 0) {
+                        Error.report(chunk->poscode[at], "Compile", "Division by zero");
+                    }
+                    return Value(opCode == OpCode::Mod ? l % r : l / r);
+                } else {
+                    return Value(opCode == OpCode::Mod ? fmod(l, r) : l / r);
+                }
+            case OpCode::Greater: return Value(l > r);
+            case OpCode::GreaterEqual: return Value(l >= r);
+            case OpCode::Lesser: return Value(l < r);
+            case OpCode::LesserEqual: return Value(l <= r);
+            default: return std::nullopt;
+            }
+        };
+        std::optional<Value> result;
+        if (opCode == OpCode::Equal || opCode == OpCode::NotEqual) {
+            if (sameType) {
+                result = Value((left == right) == (opCode == OpCode::Equal));
+            }
+        } else if (opCode == OpCode::And || opCode == OpCode::Or) {
+            if (holds_alternative<bool>(left) && holds_alternative<bool>(right)) {
+                result = Value(opCode == OpCode::And ? get<bool>(left) && get<bool>(right)
+                                                     : get<bool>(left) || get<bool>(right));
+            }
+        } else if (opCode == OpCode::Concatenate) {
+            const auto text = [](const Value &v) -> std::optional<string> {
+                if (holds_alternative<string>(v)) {
+                    return get<string>(v);
+                }
+                if (holds_alternative<char>(v)) {
+                    return string(1, get<char>(v));
+                }
+                return std::nullopt;
+            };
+            if (text(left) && text(right)) {
+                result = Value(*text(left) + *text(right));
+            }
+        } else if (sameType && holds_alternative<i64>(left)) {
+            result = arithmetic(get<i64>(left), get<i64>(right));
+        } else if (sameType && holds_alternative<double>(left)) {
+            result = arithmetic(get<double>(left), get<double>(right));
+        } else if (sameType && holds_alternative<char>(left) && opCode >= OpCode::Greater &&
+                   opCode <= OpCode::LesserEqual) {
+            result = arithmetic(get<char>(left), get<char>(right));
+        }
+        if (!result) {
+            return std::nullopt;
+        }
+        left = std::move(*result);
+    }
+    if (stack.size() != 1) {
+        return std::nullopt;
+    }
+    return stack.back();
+}
+
+// An index into an array whose bounds are known is checked here when it
+// is a constant; any other is left to the VM.
+void Compiler::arrayIndex(Symbol name) {
+    const auto index = constantExpression();
+    const Identifier *array = resolveLocal(name);
+    for (size_t i = identifiers.size(); !array && i > 0; i--) {
+        if (identifiers[i - 1].depth == 0 && identifiers[i - 1].name == name) {
+            array = &identifiers[i - 1];
+        }
+    }
+    if (!array || !array->bounds || !index || !holds_alternative<i64>(*index)) {
+        return;
+    }
+    const auto [lb, ub] = *array->bounds;
+    if (get<i64>(*index) < lb || get<i64>(*index) > ub) {
+        Error.report(currentToken(), "Out of bounds",
+                     "index '" + std::to_string(get<i64>(*index)) + "' is out of bounds for " +
+                         nameOf(Value(name)) + "[" + std::to_string(lb) + ":" +
+                         std::to_string(ub) + "]");
+    }
+}
+
+// a CASE label: a literal, a constant or an expression over them
+Value Compiler::parseCaseLabel() {
+    const size_t start = chunk->bytecode.size();
+    const size_t constantCount = chunk->constantPool.size();
+    expression();
+    const auto label = fold(start);
+    chunk->truncate(start, constantCount, chunk->switches.size());
+    if (!label) {
+        Error.report(currentToken(), "Compile", "CASE labels must be literals or constants");
+    }
+    return *label;
+}
+
+// whether the line after the current one starts a new CASE arm, or ends
+// the CASE; no statement starts with a literal or a constant's name
+bool Compiler::startsCaseArm() const {
+    switch (peekType()) {
+    case TokenType::Integer:
+    case TokenType::Real:
+    case TokenType::Char:
+    case TokenType::String:
+    case TokenType::Boolean:
+    case TokenType::Minus:
+    case TokenType::Lparen:
+    case TokenType::Otherwise:
+    case TokenType::Endcase:
+    case TokenType::Eof:
+        return true;
+    case TokenType::Identifier: {
+        const Symbol name = get<Symbol>(tokens().literal(peek));
+        return !resolveLocal(name) && resolveConstant(name);
+    }
+    default:
+        return false;
+    }
+}
+
+// Integer or char labels spanning at most this many values, at least
+// half of which they cover, get a jump table; any others are hashed.
+static constexpr uint64_t maxSwitchSpan = 4096;
+
+static void buildSwitch(SwitchTable &table, const vector<SwitchTable::Range> &labels) {
+    const bool dense = !labels.empty() && std::all_of(labels.begin(), labels.end(), [&](const auto &label) {
+        const size_t type = labels.front().low.index();
+        return (type == Value(i64{0}).index() || type == Value(char{0}).index()) &&
+               label.low.index() == type && label.high.index() == type;
+    });
+    const auto key = [](const Value &label) -> i64 {
+        return holds_alternative<char>(label) ? get<char>(label) : get<i64>(label);
+    };
+    if (dense) {
+        i64 low = key(labels.front().low);
+        i64 high = key(labels.front().high);
+        for (const auto &label : labels) {
+            low = std::min(low, key(label.low));
+            high = std::max(high, key(label.high));
+        }
+        // offsets from `low`, which cannot overflow once the span is known
+        // to be short
+        const auto offset = [&](const Value &label) {
+            return static_cast<uint64_t>(key(label)) - static_cast<uint64_t>(low);
+        };
+        const uint64_t span = static_cast<uint64_t>(high) - static_cast<uint64_t>(low) + 1;
+        uint64_t covered = 0;
+        if (low <= high && span <= maxSwitchSpan) {
+            for (const auto &label : labels) {
+                if (key(label.low) <= key(label.high)) {
+                    covered += offset(label.high) - offset(label.low) + 1;
+                }
+            }
+        }
+        if (covered * 2 >= span && covered > 0) {
+            table.type = static_cast<uint32_t>(labels.front().low.index());
+            table.low = low;
+            table.targets.assign(span, table.otherwise);
+            // earlier arms win, so they are written last
+            for (auto label = labels.rbegin(); label != labels.rend(); ++label) {
+                for (uint64_t at = offset(label->low); key(label->low) <= key(label->high) &&
+                                                       at <= offset(label->high); ++at) {
+                    table.targets[at] = label->target;
+                }
+            }
+            return;
+        }
+    }
+    for (const auto &label : labels) {
+        if (!(label.low == label.high)) {
+            table.ranges.push_back(label);
+            continue;
+        }
+        // the exact labels are looked up before the ranges, so one that an
+        // earlier range already takes is left to it
+        const bool taken = std::any_of(table.ranges.begin(), table.ranges.end(), [&](const auto &range) {
+            return !(label.low < range.low) && !(range.high < label.low);
+        });
+        if (!taken) {
+            table.labels.emplace(label.low, label.target);
+        }
+    }
+}
+
+// CASE OF <selector>, then arms of the form `<label>[, <label>...] :` or
+// `OTHERWISE :` followed by their statements, each running until the next
+// arm; a label is a literal or `<literal> TO <literal>`. The selector is
+// evaluated once and a single Switch jumps to the first arm that matches.
+void Compiler::parseCaseStatement() {
+    consume(TokenType::Of, "Expected OF after CASE");
+    advance();
+    expression();
+    consume(TokenType::Newline, "Expected newline after CASE selector");
+    const size_t table = chunk->switches.size();
+    if (table > std::numeric_limits<uint16_t>::max()) {
+        Error.report(currentToken(), "Stack overflow", "too many CASE statements");
+    }
+    chunk->switches.emplace_back();
+    const auto emitTable = [&](OpCode opCode) {
+        emit(opCode, static_cast<std::byte>((table >> 8) & 0xff));
+        chunk->writeByte(static_cast<std::byte>(table & 0xff), position());
+    };
+    emitTable(OpCode::Switch);
+    vector<SwitchTable::Range> labels;
+    std::optional<uint32_t> otherwise;
+    bool arms = false;
+    while (true) {
+        while (peekType() == TokenType::Newline) {
+            advance();
+        }
+        if (peekType() == TokenType::Endcase) {
+            break;
+        }
+        if (peekType() == TokenType::Eof) {
+            Error.report(currentToken(), "Compiler", "Unexpected end of scope, expected Endcase");
+        }
+        if (otherwise) {
+            Error.report(currentToken(), "Compile", "OTHERWISE must be the last arm of a CASE");
+        }
+        advance();
+        const auto target = static_cast<uint32_t>(chunk->bytecode.size());
+        if (currentType() == TokenType::Otherwise) {
+            otherwise = target;
+        } else {
+            while (true) {
+                const Value low = parseCaseLabel();
+                Value high = low;
+                if (peekType() == TokenType::To) {
+                    advance();
+                    advance();
+                    high = parseCaseLabel();
+                    if (high.index() != low.index()) {
+                        Error.report(currentToken(), "Compile", "CASE range bounds differ in type");
+                    }
+                }
+                labels.push_back({low, high, target});
+                if (peekType() != TokenType::Comma) {
+                    break;
+                }
+                advance();
+                advance();
+            }
+        }
+        consume(TokenType::Colon, "Expected : after CASE label");
+        advance();
+        beginScope();
+        while (currentType() != TokenType::Newline || !startsCaseArm()) {
+            program();
+        }
+        endScope();
+        emitTable(OpCode::Leave);
+        arms = true;
+    }
+    // the last arm runs into the end by itself
+    if (arms) {
+        chunk->truncate(chunk->bytecode.size() - Chunk::width(OpCode::Leave),
+                        chunk->constantPool.size(), chunk->switches.size());
+    }
+    advance();
+    SwitchTable &switchTable = chunk->switches[table];
+    switchTable.end = static_cast<uint32_t>(chunk->bytecode.size());
+    switchTable.otherwise = otherwise.value_or(switchTable.end);
+    buildSwitch(switchTable, labels);
+    advance();
+}
+
 void Compiler::program() {
-    switch (currentToken.type) {
+    switch (currentType()) {
     case TokenType::System:
         parseSystemStatement();
         break;
     case TokenType::Function:
-        return;
+        parseProcedureStatement();
+        break;
+    case TokenType::Return:
+        parseReturnStatement();
+        break;
     case TokenType::Call:
         parseCallStatement();
         break;
@@ -478,24 +2714,23 @@ void Compiler::program() {
     case TokenType::If:
         parseIfStatement();
         break;
+    case TokenType::Case:
+        parseCaseStatement();
+        break;
+    case TokenType::Constant:
+        parseConstantStatement();
+        break;
     default:
         expressionStatement();
         break;
     }
 }
 
+// locals keep their frame slots until the procedure returns; a block only
+// takes its names out of scope
 void Compiler::endScope() {
     --scopeDepth;
-    int count = 0;
-    for (auto it = identifiers.begin(); it != identifiers.end(); ++it) {
-        if (it->depth > scopeDepth) {
-            ++count;
-            emit(OpCode::PopLocal);
-        } else {
-            break;
-        }
-    }
-    for (int i = 0; i < count; i++) {
+    while (!identifiers.empty() && identifiers.back().depth > scopeDepth) {
         identifiers.pop_back();
     }
 }
@@ -507,54 +2742,97 @@ void Compiler::printStatement(void) {
 }
 
 void Compiler::parseInputStatement(void) {
-    OpCode opSet;
     consume(TokenType::Identifier, "Expected identifier after Input");
-    if (checkGlobalExists()) {
-        opSet = OpCode::SetGlobal;
-    } else if (checkLocalExists()) {
-        opSet = OpCode::SetLocal;
+    rejectConstant(get<Symbol>(currentLiteral()));
+    if (const Identifier *local = resolveLocal(get<Symbol>(currentLiteral()))) {
+        emit(OpCode::Input);
+        emitLocal(OpCode::SetLocal, *local);
+    } else if (checkGlobalExists()) {
+        emitConstant(Value(currentLiteral()));
+        emit(OpCode::Input);
+        emit(OpCode::SetGlobal);
+        emitPop();
     } else {
-        Error.report(currentToken, "Compiler",
+        Error.report(currentToken(), "Compiler",
                      "Identifier after Input is undefined");
     }
-    emitConstant(std::move(currentToken.literal));
-    emit(OpCode::Input);
-    emit(opSet);
     advance();
 }
 
 void Compiler::value() {
-    auto value = currentToken.literal;
+    auto value = currentLiteral();
     emitConstant(std::move(value));
 }
 
-bool Compiler::checkLocalExists() {
-    for (auto identifier : identifiers) {
-        if (identifier.name == get<string>(currentToken.literal) &&
-            identifier.depth <= scopeDepth) {
-            return true;
+// innermost local of the body being compiled with this name, if any
+const Identifier *Compiler::resolveLocal(Symbol name) const {
+    for (size_t i = identifiers.size(); i > frameStart; i--) {
+        const Identifier &identifier = identifiers[i - 1];
+        if (identifier.depth > 0 && identifier.name == name) {
+            return &identifier;
         }
     }
-    return false;
+    return nullptr;
 }
+
 bool Compiler::checkGlobalExists() {
-    for (auto identifier : identifiers) {
-        if (identifier.name == get<string>(currentToken.literal) &&
-            identifier.depth == 0) {
-            return true;
+    return checkGlobalExists(get<Symbol>(currentLiteral()));
+}
+
+bool Compiler::checkGlobalExists(Symbol name) const {
+    return resolveGlobal(name) != nullptr;
+}
+
+const Identifier *Compiler::resolveGlobal(Symbol name) const {
+    const size_t declared = std::min(visible.globals, identifiers.size());
+    for (size_t i = 0; i < declared; i++) {
+        if (identifiers[i].name == name &&
+            identifiers[i].depth == 0) {
+            return &identifiers[i];
         }
     }
-    return false;
+    return nullptr;
+}
+
+const Value *Compiler::resolveConstant(Symbol name) const {
+    const auto it = constantIdxMap.find(name.id);
+    return it != constantIdxMap.end() && it->second < visible.constants ? &constants[it->second]
+                                                                         : nullptr;
+}
+
+// the slot of the procedure `name` names, if it is visible here
+std::optional<size_t> Compiler::resolveFunction(Symbol name) const {
+    const auto it = functionIdxMap.find(name.id);
+    if (it == functionIdxMap.end() || it->second >= visible.procedures) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+// a frame slot instruction; SetLocal and BindLocal also name the type to
+// check against, DefineLocalArray the type of the elements
+void Compiler::emitLocal(OpCode opCode, const Identifier &local) {
+    if (local.slot > std::numeric_limits<unsigned char>::max()) {
+        Error.report(currentToken(), "Stack overflow", "too many locals in one procedure");
+    }
+    emit(opCode, static_cast<std::byte>(local.slot));
+    if (opCode == OpCode::SetLocal || opCode == OpCode::BindLocal) {
+        const TokenType type = local.isArray ? TokenType::Array : local.type;
+        chunk->writeByte(static_cast<std::byte>(type), position());
+    } else if (opCode == OpCode::DefineLocalArray) {
+        chunk->writeByte(static_cast<std::byte>(local.type), position());
+    }
 }
 
 void Compiler::parseArrayIdentifier(bool isArray) {
     if (!isArray)
         return;
+    const Symbol name = get<Symbol>(currentLiteral());
     consume(TokenType::Lsqrbracket, "Expected [ after array identifier");
     advance();
-    expression();
+    arrayIndex(name);
     consume(TokenType::Rsqrbracket, "expected [ after array index");
-    if (currentToken.type == TokenType::Rsqrbracket) {
+    if (currentType() == TokenType::Rsqrbracket) {
         return;
     } else {
         throw std::runtime_error("Can't :()");
@@ -563,34 +2841,65 @@ void Compiler::parseArrayIdentifier(bool isArray) {
 
 void Compiler::resolver() {
     OpCode opGet;
-    bool isArrayt = peekToken.type == TokenType::Lsqrbracket;
-    auto identifier = currentToken;
-    if (checkGlobalExists()) {
-        opGet = isArrayt ? OpCode::GetGlobalArray : OpCode::GetGlobal;
-    } else if (checkLocalExists()) {
+    bool isArrayt = peekType() == TokenType::Lsqrbracket;
+    const Value identifier = currentLiteral();
+    const Symbol name = get<Symbol>(identifier);
+    if (peekType() == TokenType::Lparen) {
+        if (const auto slot = resolveFunction(name)) {
+            const Function &function = *functions[*slot];
+            if (function.returns == TokenType::Eof) {
+                Error.report(currentToken(), "Compile",
+                             "Procedure " + nameOf(identifier) + " does not return a value");
+            }
+            parseArguments(function);
+            emitCall(*slot);
+            return;
+        }
+    }
+    const Identifier *local = resolveLocal(name);
+    const Value *constant = local ? nullptr : resolveConstant(name);
+    if (constant) {
+        if (isArrayt) {
+            Error.report(currentToken(), "Compile",
+                         "Constant " + nameOf(identifier) + " is not an array");
+        }
+        emitConstant(Value(*constant));
+        return;
+    }
+    if (local) {
         opGet = isArrayt ? OpCode::GetLocalArray : OpCode::GetLocal;
+    } else if (checkGlobalExists()) {
+        opGet = isArrayt ? OpCode::GetGlobalArray : OpCode::GetGlobal;
     } else {
-        Error.report(currentToken, "Compile",
-                     "Variable " + get<string>(currentToken.literal) +
+        Error.report(currentToken(), "Compile",
+                     "Variable " + nameOf(currentLiteral()) +
                          " not declared in this scope");
     }
 
     if (!isArrayt) {
+        if (local) {
+            emitLocal(opGet, *local);
+            return;
+        }
         value();
         emit(opGet);
         return;
     }
     parseArrayIdentifier(isArrayt);
-    emitConstant(std::move(identifier.literal));
+    if (local) {
+        emitLocal(opGet, *local);
+        return;
+    }
+    emitConstant(Value(identifier));
     emit(opGet);
     return;
 }
 
 void Compiler::unary() {
-    auto op = currentToken;
+    const TokenType op = currentType();
     advance();
     parsePrecedence(Precedence::Unary);
-    switch (op.type) {
+    switch (op) {
     case TokenType::Minus:
         emit(OpCode::Negate);
         break;
@@ -644,11 +2953,11 @@ void Compiler::unary() {
 }
 
 void Compiler::binary() {
-    auto tok = currentToken;
-    Precedence pr = lookupPrecedence(tok.type);
+    const TokenType tok = currentType();
+    Precedence pr = lookupPrecedence(tok);
     advance();
     parsePrecedence(pr);
-    switch (tok.type) {
+    switch (tok) {
     case TokenType::Not_equals:
         emit(OpCode::NotEqual);
         break;
@@ -700,19 +3009,19 @@ void Compiler::binary() {
 }
 
 void Compiler::consume(TokenType type, string msg) {
-    if (peekToken.type == type) {
+    if (peekType() == type) {
         advance();
         return;
     }
-    Error.report(currentToken, "Compiler", msg);
+    Error.report(currentToken(), "Compiler", msg);
 }
 
 void Compiler::advanceIf(TokenType type, string msg) {
-    if (currentToken.type == type) {
+    if (currentType() == type) {
         advance();
         return;
     }
-    Error.report(currentToken, "Compiler", msg);
+    Error.report(currentToken(), "Compiler", msg);
 }
 
 void Compiler::grouping() {
@@ -722,35 +3031,35 @@ void Compiler::grouping() {
 }
 
 void Compiler::parsePrecedence(Precedence precedence) {
-    if (lookupUnary(currentToken.type))
+    if (lookupUnary(currentType()))
         return;
-    while (precedence <= lookupPrecedence(peekToken.type)) {
+    while (precedence <= lookupPrecedence(peekType())) {
         advance();
-        lookupBinary(currentToken.type);
+        lookupBinary(currentType());
     }
 }
 
 void Compiler::parseDeclareStatement() {
-    std::vector<Token> declareIdentifiers;
+    std::pmr::vector<Symbol> declareIdentifiers{lexer.resource()};
     while (true) {
-        if (currentToken.type != TokenType::Identifier) {
+        if (currentType() != TokenType::Identifier) {
             std::stringstream ss;
-            ss << "Expected identifier instead of '" << currentToken.literal
+            ss << "Expected identifier instead of '" << currentLiteral()
                << "'";
-            Error.report(currentToken, "Compile", ss.str());
+            Error.report(currentToken(), "Compile", ss.str());
         }
-        declareIdentifiers.emplace_back(currentToken);
+        declareIdentifiers.emplace_back(get<Symbol>(currentLiteral()));
         advance();
-        if (currentToken.type == TokenType::Comma)
+        if (currentType() == TokenType::Comma)
             advance();
         else
             break;
     }
-    if (currentToken.type != TokenType::Colon) {
-        Error.report(currentToken, "Compile", "Expected Colon (:)");
+    if (currentType() != TokenType::Colon) {
+        Error.report(currentToken(), "Compile", "Expected Colon (:)");
     }
     advance();
-    switch (currentToken.type) {
+    switch (currentType()) {
     case TokenType::Integer_t:
         declareVariables(declareIdentifiers, TokenType::Integer, true, false);
         break;
@@ -768,60 +3077,85 @@ void Compiler::parseDeclareStatement() {
         break;
     case TokenType::Array: {
         consume(TokenType::Lsqrbracket, "Expected [ after ARRAY");
-        TokenType arrayType = getArrayDeclarationType();
         advance();
-        expression();
+        const auto lb = constantExpression();
         consume(TokenType::Colon, "Expected : after expression");
         advance();
-        expression();
+        const auto ub = constantExpression();
         consume(TokenType::Rsqrbracket, "Expected ] after expression");
+        std::optional<std::pair<i64, i64>> bounds;
+        if (lb && ub && holds_alternative<i64>(*lb) && holds_alternative<i64>(*ub)) {
+            bounds = std::make_pair(get<i64>(*lb), get<i64>(*ub));
+        }
         consume(TokenType::Of, "Expected OF after ]");
         advance();
-        switch (arrayType) {
+        // the element type follows the bounds, so it is only known here
+        switch (currentType()) {
         // single variable declaration for the time being;
         case TokenType::Integer_t:
-            declareVariables(declareIdentifiers, TokenType::Integer, true,
-                             true);
+            declareVariables(declareIdentifiers, TokenType::Integer, true, true, bounds);
             break;
         case TokenType::String_t:
-            declareVariables(declareIdentifiers, TokenType::String, true, true);
+            declareVariables(declareIdentifiers, TokenType::String, true, true, bounds);
             break;
         case TokenType::Boolean_t:
-            declareVariables(declareIdentifiers, TokenType::Boolean, true,
-                             true);
+            declareVariables(declareIdentifiers, TokenType::Boolean, true, true, bounds);
             break;
         case TokenType::Real_t:
-            declareVariables(declareIdentifiers, TokenType::Real, true, true);
+            declareVariables(declareIdentifiers, TokenType::Real, true, true, bounds);
             break;
         case TokenType::Char_t:
-            declareVariables(declareIdentifiers, TokenType::Char, true, true);
+            declareVariables(declareIdentifiers, TokenType::Char, true, true, bounds);
             break;
         default:
-            Error.report(currentToken, "Compile",
+            Error.report(currentToken(), "Compile",
                          "Unexpected type in array declaration");
         }
         break;
     }
     default:
-        Error.report(currentToken, "Compile", "Unexpected Type");
+        Error.report(currentToken(), "Compile", "Unexpected Type");
     }
 }
 
-void Compiler::declareVariables(std::vector<Token> declareIdentifiers,
-                                TokenType type, bool newline, bool isArray) {
-    for (auto declareIdentifier : declareIdentifiers) {
-        string identifierName = get<string>(declareIdentifier.literal);
+void Compiler::declareVariables(const std::pmr::vector<Symbol> &declareIdentifiers,
+                                TokenType type, bool newline, bool isArray,
+                                std::optional<std::pair<i64, i64>> bounds) {
+    for (const Symbol identifierName : declareIdentifiers) {
+        if (scopeDepth == 0 && resolveConstant(identifierName)) {
+            Error.report(currentToken(), "Compile",
+                         nameOf(Value(identifierName)) + " is already declared as a constant");
+        }
         Identifier newidentifier = Identifier(identifierName, scopeDepth);
-        scopeDepth == 0 ? globalsType[identifierName] = type
-                        : localsType[identifierName] = type;
-        identifiers.emplace_back(newidentifier);
-        emitConstant(std::move(declareIdentifier.literal));
+        newidentifier.bounds = bounds;
+        newidentifier.type = type;
+        newidentifier.isArray = isArray;
+        auto &types = scopeDepth == 0 ? globalsType : localsType;
+        if (types.size() <= identifierName.id) {
+            types.resize(identifierName.id + 1, TokenType::Eof);
+        }
+        types[identifierName.id] = type;
+        if (scopeDepth != 0) {
+            newidentifier.slot = localCount++;
+            identifiers.emplace_back(newidentifier);
+            if (!isArray) {
+                emitLocal(OpCode::DefineLocal, newidentifier);
+            } else {
+                // the name is only kept for error messages
+                emitConstant(Value(identifierName));
+                emitLocal(OpCode::DefineLocalArray, newidentifier);
+            }
+            continue;
+        } else if (!checkGlobalExists(identifierName)) {
+            // a REPL session may declare the same global again; one entry is
+            // enough (the VM rejects the redefinition itself)
+            identifiers.emplace_back(newidentifier);
+        }
+        emitConstant(Value(identifierName));
         if (!isArray) {
-            scopeDepth == 0 ? emit(OpCode::DefineGlobal)
-                            : emit(OpCode::DefineLocal);
+            emit(OpCode::DefineGlobal);
         } else {
-            scopeDepth == 0 ? emit(OpCode::DefineGlobalArray)
-                            : emit(OpCode::DefineLocalArray);
+            emit(OpCode::DefineGlobalArray);
         }
     }
     if (newline) {
@@ -833,36 +3167,56 @@ void Compiler::emitLoop(size_t jump) {
     emit(OpCode::Loop);
     size_t offset = chunk->bytecode.size() - jump + 1;
     if (offset > std::numeric_limits<unsigned char>::max()) {
-        Error.report(currentToken, "Stack overflow", "Loop body too large");
+        Error.report(currentToken(), "Stack overflow", "Loop body too large");
     }
-    chunk->writeByte(static_cast<std::byte>(offset));
+    chunk->writeByte(static_cast<std::byte>(offset), position());
 }
 
+// The iterator is set once, then each pass tests it against the bound,
+// runs the body and increments it; the test's result is popped on both
+// the way into the body and the way out of the loop.
 void Compiler::parseForLoopStatement() {
     advance();
-    Value i1 = currentToken.literal;
-    auto i3 = currentToken;
-    auto opGet = scopeDepth == 0 ? OpCode::GetGlobal : OpCode::GetLocal;
-    auto opSet = scopeDepth == 0 ? OpCode::SetGlobal : OpCode::SetLocal;
-    parseForAssignmentStatement(i3);
+    Value i1 = currentLiteral();
+    rejectConstant(get<Symbol>(i1));
+    // the iterator may be a global even inside a procedure
+    const Identifier *local = resolveLocal(get<Symbol>(i1));
+    if (!local && !checkGlobalExists()) {
+        Error.report(currentToken(), "Compile",
+                     "Variable " + nameOf(i1) + " not declared in this scope");
+    }
+    const size_t init = chunk->bytecode.size();
+    parseForAssignmentStatement(i1, local);
     consume(TokenType::To, "Expected To after expression");
     advance();
     size_t loopJump = chunk->bytecode.size();
-    emitPop();
     expression();
     advance();
-    emitConstant(std::move(i1));
-    emit(opGet);
+    if (local) {
+        emitLocal(OpCode::GetLocal, *local);
+    } else {
+        emitConstant(Value(i1));
+        emit(OpCode::GetGlobal);
+    }
     emit(OpCode::GreaterEqual);
     size_t jumpne = emitJump(OpCode::JumpNE);
     emitPop();
+    const size_t body = chunk->bytecode.size();
     block(TokenType::Next);
     consume(TokenType::Identifier, "Expected identifier after i");
-    emitConstant(std::move(currentToken.literal));
-    emit(OpCode::IncrementGlobal);
+    const size_t increment = chunk->bytecode.size();
+    if (local) {
+        emitLocal(OpCode::IncrementLocal, *local);
+    } else {
+        emitConstant(Value(currentLiteral()));
+        emit(OpCode::IncrementGlobal);
+    }
     emitLoop(loopJump); // goto loopJump
     patchJump(jumpne);  // from jumpne to emitPop
     emitPop();
+    loops.emplace_back(loopJump, chunk->bytecode.size());
+    countedLoops.push_back({init, loopJump, body, increment, chunk->bytecode.size(), local != nullptr,
+                            local ? local->slot : get<Symbol>(i1).id});
     advance();
 }
 
@@ -877,6 +3231,7 @@ void Compiler::parseRepeatLoopStatement() {
     emitLoop(loopJump);
     patchJump(jumpne);
     emitPop();
+    loops.emplace_back(loopJump, chunk->bytecode.size());
     advance();
 }
 
@@ -891,6 +3246,7 @@ void Compiler::parseWhileLoopStatement() {
     emitLoop(loop);
     patchJump(jumpne);
     emitPop();
+    loops.emplace_back(loop, chunk->bytecode.size());
     advance();
 }
 
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "../chunk/chunk.h"
+#include "../function/function.h"
 #include "../tokens/tokens.h"
 #include "../lexer/lexer.h"
 #include "../error/error.h"
@@ -22,9 +23,17 @@ enum class Precedence {
 };
 
 typedef struct Identifier {
-    std::string name;
+    Symbol name;
     int depth;
-    Identifier(std::string name, int depth) : name(name), depth(depth) {};
+    // a local's frame slot, and the type SetLocal checks it against
+    uint32_t slot;
+    TokenType type;
+    bool isArray;
+    // lower and upper bound of an array declared with constant bounds
+    std::optional<std::pair<i64, i64>> bounds;
+    Identifier(Symbol name, int depth, uint32_t slot = 0, TokenType type = TokenType::Eof,
+               bool isArray = false)
+        : name(name), depth(depth), slot(slot), type(type), isArray(isArray) {};
 } Identifier;
 
 enum builtintype : char {
@@ -32,6 +41,19 @@ enum builtintype : char {
     StringCast, RealCast, Reverse, System
 };
 
+// code generation switches; every one of them is part of the compile cache key
+struct CompileOptions {
+    // compile procedure bodies where they are defined, not on first CALL
+    bool eager {false};
+    // copy the bodies of small procedures over the CALLs to them
+    bool inlining {true};
+    // copies of a small FOR body run per test of its iterator; 1 keeps
+    // every loop as written
+    size_t unroll {4};
+    // memoize pure FUNCTIONs no MEMOIZE pragma asked for
+    bool memoize {true};
+};
+
 class Compiler {
     private:
         ErrorReporter Error {};
@@ -50,7 +72,7 @@ class Compiler {
         static const std::unordered_map<TokenType, TokenType> blockMap;
         void parseAssignmentStatement();
         void parseArrayIdentifier(bool isArray);
-        void parseForAssignmentStatement(Token iterator);
+        void parseForAssignmentStatement(const Value &iterator, const Identifier *local);
         void grouping();
         void consume(TokenType type, std::string msg);
         void advanceIf(TokenType type, std::string msg);
@@ -59,11 +81,12 @@ class Compiler {
         void synchronize();
         void block(TokenType endBlock);
         void block(TokenType endBlock, TokenType endBlock2);
-        void declareVariables(std::vector<Token> identifiers, TokenType type, bool newline, bool isArray);
+        void declareVariables(const std::pmr::vector<Symbol> &identifiers, TokenType type, bool newline, bool isArray,
+                              std::optional<std::pair<i64, i64>> bounds = std::nullopt);
         static const std::unordered_map<TokenType, Precedence> precedenceMap;
         void emitPendingGet();
         void emitConstant(Value &&value);
-        void emitCall(i64 &&idx);
+        void emitCall(size_t function);
         void emitPop();
         void printStatement();
         template<typename T> bool isType(Value v) { return std::holds_alternative<T>(v);}
@@ -83,40 +106,133 @@ class Compiler {
 
         void parseOutputStatement();
         void parseInputStatement();
-        TokenType getArrayDeclarationType();
         void parseDeclareStatement();
         void parseForLoopStatement();
         void parseWhileLoopStatement();
         void parseRepeatLoopStatement();
         void parseIfStatement();
+        void parseCaseStatement();
+        Value parseCaseLabel();
+        bool startsCaseArm() const;
+        void parseConstantStatement();
+        void rejectConstant(Symbol name);
+        std::optional<Value> constantExpression();
+        std::optional<Value> fold(size_t start);
+        void arrayIndex(Symbol name);
         void parseProcedureStatement();
+        std::vector<Parameter> parseParameters();
+        TokenType parseType();
+        void parseArguments(const Function &function);
+        void parseVariableArgument(const Parameter &parameter);
+        void parseReturnStatement();
+        void compileBody(Function &function);
+        // procedures of at most this many bytes of code, or this many
+        // characters of source while still uncompiled, are inlined
+        static constexpr size_t maxInlineBytes = 64;
+        static constexpr size_t maxInlineSource = 512;
+        // `localCount` is the frame size of `code`, grown by the locals of
+        // every body inlined into it
+        void inlineCalls(Chunk &code, size_t start, uint32_t &localCount);
+        void markTailCalls(Chunk &code);
+        // loops compiled into the current chunk, as [start, end) offsets
+        std::vector<std::pair<size_t, size_t>> loops;
+        // the FOR loops among them: where the iterator is set, tested
+        // against the bound, where the body and the increment start and
+        // where the loop ends; the iterator is a local's slot or a global's
+        // symbol id
+        struct CountedLoop {
+            size_t init, test, body, increment, end;
+            bool local;
+            size_t iterator;
+        };
+        std::vector<CountedLoop> countedLoops;
+        // FOR loops whose body and increment take at most this many bytes
+        // are unrolled, all the way when every pass fits in as many bytes
+        static constexpr size_t maxUnrollBody = 48;
+        static constexpr size_t maxUnrollBytes = 128;
+        void deriveIndices(Chunk &code);
+        void unrollLoops(Chunk &code);
+        void hoistInvariants(Chunk &code);
+        void reuseSubexpressions(Chunk &code, size_t start);
+        // inlining, memoization, tail calls and the stack bound of a freshly
+        // compiled body
+        void optimize(size_t function);
+        bool inlinable(size_t function);
+        bool pure(size_t function);
+        bool recursive(const Chunk &body, size_t function);
+        bool memoizePragma(int line);
+        // slots of the procedures being optimized right now
+        std::vector<size_t> inlining;
+        size_t lineOffset(int line);
         bool checkGlobalExists();
-        bool checkLocalExists();
+        bool checkGlobalExists(Symbol name) const;
+        const Identifier *resolveLocal(Symbol name) const;
+        const Identifier *resolveGlobal(Symbol name) const;
+        const Value *resolveConstant(Symbol name) const;
+        std::optional<size_t> resolveFunction(Symbol name) const;
+        void emitLocal(OpCode opCode, const Identifier &local);
 
 
-        size_t idx {0};
-        Token currentToken = Token(TokenType::Eof, 0, 0, std::monostate{});
-        Token peekToken = Token(TokenType::Eof, 0, 0, std::monostate{});
+        // stream indices of the current and lookahead tokens; the lexer only
+        // keeps a short window behind `peek`, so anything needed past the
+        // next advance() must be copied out
+        size_t current {0};
+        size_t peek {0};
+        const TokenRing &tokens() const { return lexer.window(); }
+        TokenType currentType() const { return tokens().type(current); }
+        TokenType peekType() const { return tokens().type(peek); }
+        const Value &currentLiteral() const { return tokens().literal(current); }
+        Token currentToken() const { return tokens().at(current); }
+        std::pair<int, int> position() const { return {tokens().line(current), tokens().column(current)}; }
         Lexer lexer {};
+        // the text being compiled and the line it starts on; procedure
+        // bodies are cut out of it line by line, scanning forward from
+        // the last line found
+        std::string_view source;
+        int sourceLine {1};
+        int cursorLine {1};
+        size_t cursorOffset {0};
 
         int scopeDepth {0};
-        std::vector<Token *> TokenList;
+        // variables declared so far by the procedure being compiled
+        uint32_t localCount {0};
+        // the body being compiled, for RETURN, and where its locals start in
+        // `identifiers`; locals of an enclosing body live in another frame
+        Function *compiling {nullptr};
+        size_t frameStart {0};
+        // the names the code being compiled may refer to: all of them,
+        // except in a body compiled after its definition
+        Visibility visible;
         void parseIdentifierExpression();
         bool match(TokenType type);
         void advance();
-        void retreat();
         void consume();
     public:
-        unordered_map<string, size_t> functionIdxMap;
+        // procedures in definition order; each is boxed so its chunk stays
+        // put while a nested definition grows the table
+        std::vector<std::unique_ptr<Function>> functions;
+        // procedure name (symbol id) to its slot in `functions`
+        unordered_map<uint32_t, size_t> functionIdxMap;
         std::vector<Identifier> identifiers;
-        std::unordered_map<std::string, TokenType> globalsType;
-        std::unordered_map<std::string, TokenType> localsType;
-        std::unique_ptr<Chunk> chunk;
-        vector<std::pair<int, int>> chunkPosition;
+        // CONSTANT values in declaration order
+        std::vector<Value> constants;
+        // CONSTANT name (symbol id) to its slot in `constants`
+        unordered_map<uint32_t, size_t> constantIdxMap;
+        // frame slots the module's own blocks need
+        uint32_t moduleLocals {0};
+        // declared types indexed by symbol id; Eof marks an untyped name
+        std::vector<TokenType> globalsType;
+        std::vector<TokenType> localsType;
+        // the module being compiled into; owned by the caller
+        Chunk *chunk {nullptr};
         void emit(OpCode opCode, std::optional<std::byte> argument = std::nullopt);
         Compiler() = default;
-        std::unique_ptr<Chunk> compile(std::string &input);
-        void initCompiler(std::string &input);
+        CompileOptions options {};
+        void setLexWorkers(unsigned workers) { lexer.setWorkers(workers); }
+        size_t compile(std::string_view input, Chunk &module);
+        void initCompiler(std::string_view input, int firstLine = 1);
+        // compiles a procedure the VM is about to call for the first time
+        void compileFunction(Function &function);
 };
 
 
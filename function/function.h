@@ -0,0 +1,59 @@
+#pragma once
+#include "../common.h"
+#include "../chunk/chunk.h"
+#include <limits>
+
+struct Parameter {
+    Symbol name;
+    // declared type, as the TokenType of a literal of that type; an
+    // array's element type
+    TokenType type;
+    // BYREF: the argument is the caller's variable itself
+    bool byRef {false};
+    bool isArray {false};
+};
+
+// How many globals, CONSTANTs and procedures had been declared at some
+// point of a program, each counted in declaration order
+struct Visibility {
+    size_t globals {std::numeric_limits<size_t>::max()};
+    size_t constants {std::numeric_limits<size_t>::max()};
+    size_t procedures {std::numeric_limits<size_t>::max()};
+};
+
+// A compiled PROCEDURE or FUNCTION. Each one owns its chunk, so procedure
+// bodies no longer sit in the module's code behind a jump; CALL names a
+// slot in the compiler's function table and the VM switches chunks for the
+// duration. Arguments are pushed on the value stack and the body starts by
+// popping them into its first frame slots; a FUNCTION leaves its result on
+// the value stack.
+struct Function {
+    Symbol name;
+    Chunk chunk;
+    vector<Parameter> parameters;
+    // type of the value a FUNCTION returns; Eof for a PROCEDURE
+    TokenType returns {TokenType::Eof};
+    // parameters taken
+    uint32_t arity {0};
+    // frame slots the body needs: its parameters, then every variable it
+    // declares, nested blocks included
+    uint32_t localCount {0};
+    // deepest the operand stack can get inside the body, see Chunk::maxStackDepth
+    uint32_t maxStack {0};
+    // a FUNCTION whose result depends on nothing but its arguments, see
+    // Compiler::pure
+    bool pure {false};
+    // a FUNCTION whose calls are answered from a cache of earlier results:
+    // one found to be pure that calls itself other than in tail position,
+    // or one marked with a MEMOIZE pragma
+    bool memoize {false};
+    // procedures are compiled on their first CALL unless --eager; until
+    // then only the text of the body is kept, which starts on `firstLine`
+    bool compiled {false};
+    string source;
+    int firstLine {0};
+    // the names declared where it was defined; a body compiled later sees
+    // only these, as it would have compiled there
+    Visibility visible;
+    explicit Function(Symbol name) : name(name) {}
+};
@@ -0,0 +1,504 @@
+#include "image.h"
+#include "../symbols/symbols.h"
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+
+namespace image {
+
+namespace {
+    template <typename T>
+    void put(string &out, const T &value) {
+        out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+
+    void align(string &out) {
+        out.resize((out.size() + 7) & ~size_t(7), '\0');
+    }
+
+    // bounds-checked cursor over a section of the mapping
+    class Reader {
+        public:
+            Reader(std::string_view bytes, uint64_t offset) : bytes(bytes), at(offset) {}
+            template <typename T>
+            T get() {
+                T value;
+                std::memcpy(&value, take(sizeof(T)), sizeof(T));
+                return value;
+            }
+            std::string_view text(size_t n) { return {take(n), n}; }
+            void align() { at = (at + 7) & ~uint64_t(7); }
+        private:
+            const char *take(size_t n) {
+                if (at > bytes.size() || bytes.size() - at < n) {
+                    throw std::runtime_error("Bytecode image is truncated");
+                }
+                const char *p = bytes.data() + at;
+                at += n;
+                return p;
+            }
+            std::string_view bytes;
+            uint64_t at;
+    };
+
+    void putCode(string &out, const Chunk &chunk) {
+        out.append(reinterpret_cast<const char *>(chunk.bytecode.data()), chunk.bytecode.size());
+        align(out);
+    }
+
+    void putLines(string &out, const Chunk &chunk) {
+        for (const auto &[line, column] : chunk.poscode) {
+            put<int32_t>(out, line);
+            put<int32_t>(out, column);
+        }
+    }
+
+    // a tag (the variant index) and then the value
+    void putValue(string &out, const Value &value) {
+        put<uint8_t>(out, static_cast<uint8_t>(value.index()));
+        if (const auto b = std::get_if<bool>(&value)) {
+            put<uint8_t>(out, *b);
+        } else if (const auto d = std::get_if<double>(&value)) {
+            put(out, *d);
+        } else if (const auto i = std::get_if<i64>(&value)) {
+            put(out, *i);
+        } else if (const auto s = std::get_if<string>(&value)) {
+            put<uint64_t>(out, s->size());
+            out += *s;
+        } else if (const auto c = std::get_if<char>(&value)) {
+            put(out, *c);
+        } else if (const auto symbol = std::get_if<Symbol>(&value)) {
+            put(out, symbol->id);
+        }
+    }
+
+    template <typename SymbolAt>
+    Value getValue(Reader &in, SymbolAt symbolAt) {
+        switch (in.get<uint8_t>()) {
+            case 0: return std::monostate{};
+            case 1: return in.get<uint8_t>() != 0;
+            case 2: return in.get<double>();
+            case 3: return in.get<i64>();
+            case 4: {
+                const auto length = in.get<uint64_t>();
+                return string(in.text(length));
+            }
+            case 5: return in.get<char>();
+            case 6: return symbolAt(in.get<uint32_t>());
+            default: throw std::runtime_error("Bytecode image is corrupt");
+        }
+    }
+
+    void putConstants(string &out, const Chunk &chunk) {
+        for (const auto &constant : chunk.constantPool) {
+            putValue(out, constant);
+        }
+        align(out);
+    }
+
+    template <typename SymbolAt>
+    void getConstants(Reader &in, uint64_t count, Chunk &chunk, SymbolAt symbolAt) {
+        chunk.constantPool.clear();
+        chunk.constantPool.reserve(count);
+        for (uint64_t i = 0; i < count; i++) {
+            chunk.constantPool.push_back(getValue(in, symbolAt));
+        }
+        in.align();
+    }
+
+    // each table as its fixed fields, then its jump table, exact labels
+    // and ranges, each preceded by its length
+    void putSwitches(string &out, const Chunk &chunk) {
+        for (const auto &table : chunk.switches) {
+            put<uint32_t>(out, table.type);
+            put<uint32_t>(out, table.otherwise);
+            put<uint32_t>(out, table.end);
+            put<i64>(out, table.low);
+            put<uint64_t>(out, table.targets.size());
+            for (const auto target : table.targets) {
+                put<uint32_t>(out, target);
+            }
+            put<uint64_t>(out, table.labels.size());
+            for (const auto &[label, target] : table.labels) {
+                putValue(out, label);
+                put<uint32_t>(out, target);
+            }
+            put<uint64_t>(out, table.ranges.size());
+            for (const auto &range : table.ranges) {
+                putValue(out, range.low);
+                putValue(out, range.high);
+                put<uint32_t>(out, range.target);
+            }
+        }
+        align(out);
+    }
+
+    template <typename SymbolAt>
+    void getSwitches(Reader &in, uint64_t count, size_t size, Chunk &chunk, SymbolAt symbolAt) {
+        // every entry takes at least a byte, so a count past the image's
+        // size is corrupt rather than worth reserving for
+        const auto length = [&] {
+            const auto n = in.get<uint64_t>();
+            if (n > size) {
+                throw std::runtime_error("Bytecode image is truncated");
+            }
+            return n;
+        };
+        if (count > size) {
+            throw std::runtime_error("Bytecode image is truncated");
+        }
+        chunk.switches.assign(count, SwitchTable{});
+        for (auto &table : chunk.switches) {
+            table.type = in.get<uint32_t>();
+            table.otherwise = in.get<uint32_t>();
+            table.end = in.get<uint32_t>();
+            table.low = in.get<i64>();
+            table.targets.resize(length());
+            for (auto &target : table.targets) {
+                target = in.get<uint32_t>();
+            }
+            for (auto n = length(); n > 0; n--) {
+                Value label = getValue(in, symbolAt);
+                table.labels.emplace(std::move(label), in.get<uint32_t>());
+            }
+            table.ranges.resize(length());
+            for (auto &range : table.ranges) {
+                range.low = getValue(in, symbolAt);
+                range.high = getValue(in, symbolAt);
+                range.target = in.get<uint32_t>();
+            }
+        }
+        in.align();
+    }
+
+    // Walks the code of a loaded chunk and rejects what the VM would read
+    // out of bounds: an unknown instruction or one cut off by the end of
+    // the code, a constant, procedure or CASE table index past its table, a
+    // frame slot past the `locals` the code runs with, and a jump, hoisted
+    // skip or CASE arm that does not land on an instruction
+    void verify(const Chunk &chunk, size_t locals, size_t procedures) {
+        const auto corrupt = [] { throw std::runtime_error("Bytecode image is corrupt"); };
+        vector<bool> starts(chunk.size() + 1, false);
+        vector<size_t> targets;
+        for (size_t at = 0; at < chunk.size();) {
+            const auto byte = static_cast<size_t>(chunk.read(at));
+            if (byte > static_cast<size_t>(OpCode::AdvanceLocal)) {
+                corrupt();
+            }
+            const auto opCode = static_cast<OpCode>(byte);
+            const size_t width = Chunk::width(opCode);
+            if (width > chunk.size() - at) {
+                corrupt();
+            }
+            starts[at] = true;
+            const size_t operand = width > 1 ? static_cast<size_t>(chunk.read(at + 1)) : 0;
+            const size_t second = width > 2 ? static_cast<size_t>(chunk.read(at + 2)) : 0;
+            if (Chunk::takesSlot(opCode) && operand >= locals) {
+                corrupt();
+            }
+            switch (opCode) {
+            case OpCode::Constant:
+                if ((operand << 8 | second) >= chunk.constantPool.size()) {
+                    corrupt();
+                }
+                break;
+            case OpCode::Call:
+            case OpCode::TailCall:
+                if ((operand << 8 | second) >= procedures) {
+                    corrupt();
+                }
+                break;
+            case OpCode::Switch:
+            case OpCode::Leave:
+                if ((operand << 8 | second) >= chunk.switches.size()) {
+                    corrupt();
+                }
+                break;
+            case OpCode::Jump:
+            case OpCode::JumpNE:
+                targets.push_back(at + width + operand);
+                break;
+            case OpCode::Loop:
+                if (operand > at + width) {
+                    corrupt();
+                }
+                targets.push_back(at + width - operand);
+                break;
+            case OpCode::GetHoisted:
+                targets.push_back(at + width + second);
+                break;
+            default:
+                break;
+            }
+            at += width;
+        }
+        starts[chunk.size()] = true;
+        for (const auto &table : chunk.switches) {
+            targets.insert(targets.end(), table.targets.begin(), table.targets.end());
+            for (const auto &[label, target] : table.labels) {
+                targets.push_back(target);
+            }
+            for (const auto &range : table.ranges) {
+                targets.push_back(range.target);
+            }
+            targets.push_back(table.otherwise);
+            targets.push_back(table.end);
+        }
+        for (const size_t target : targets) {
+            if (target > chunk.size() || !starts[target]) {
+                corrupt();
+            }
+        }
+    }
+}
+
+bool isImage(std::string_view bytes) {
+    return bytes.size() >= sizeof(magic) && std::memcmp(bytes.data(), magic, sizeof(magic)) == 0;
+}
+
+bool isValid(std::string_view bytes) {
+    if (!isImage(bytes) || bytes.size() < sizeof(Header)) {
+        return false;
+    }
+    Header header;
+    std::memcpy(&header, bytes.data(), sizeof(Header));
+    return header.version == version && header.byteOrder == byteOrder
+        && header.fileSize == bytes.size()
+        && header.codeOffset % 8 == 0 && header.linesOffset % 8 == 0
+        && header.codeOffset <= bytes.size()
+        && header.codeSize <= bytes.size() - header.codeOffset
+        && header.linesOffset <= bytes.size()
+        && header.codeSize <= (bytes.size() - header.linesOffset) / 8;
+}
+
+string encode(const Chunk &chunk, const Compiler &compiler) {
+    Header header {};
+    std::memcpy(header.magic, magic, sizeof(magic));
+    header.version = version;
+    header.byteOrder = byteOrder;
+    header.moduleLocals = compiler.moduleLocals;
+    string out(sizeof(Header), '\0');
+
+    header.codeOffset = out.size();
+    header.codeSize = chunk.size();
+    putCode(out, chunk);
+    header.linesOffset = out.size();
+    putLines(out, chunk);
+    header.constantsOffset = out.size();
+    header.constantCount = chunk.constantPool.size();
+    putConstants(out, chunk);
+    header.switchesOffset = out.size();
+    header.switchCount = chunk.switches.size();
+    putSwitches(out, chunk);
+
+    const SymbolTable &symbols = SymbolTable::global();
+    header.symbolsOffset = out.size();
+    header.symbolCount = symbols.size();
+    for (uint32_t id = 0; id < symbols.size(); id++) {
+        const auto name = symbols.name(Symbol{id});
+        put<uint32_t>(out, name.size());
+        out += name;
+    }
+    align(out);
+
+    header.proceduresOffset = out.size();
+    header.procedureCount = compiler.functions.size();
+    for (const auto &function : compiler.functions) {
+        Procedure procedure {};
+        procedure.name = function->name.id;
+        procedure.arity = function->arity;
+        procedure.localCount = function->localCount;
+        procedure.maxStack = function->maxStack;
+        procedure.compiled = function->compiled;
+        procedure.returns = static_cast<uint32_t>(function->returns);
+        procedure.memoize = function->memoize;
+        procedure.firstLine = function->firstLine;
+        procedure.codeSize = function->chunk.size();
+        procedure.constantCount = function->chunk.constantPool.size();
+        procedure.switchCount = function->chunk.switches.size();
+        procedure.sourceSize = function->source.size();
+        procedure.visibleGlobals = function->visible.globals;
+        procedure.visibleConstants = function->visible.constants;
+        procedure.visibleProcedures = function->visible.procedures;
+        put(out, procedure);
+        for (const auto &parameter : function->parameters) {
+            put(out, Parameter{parameter.name.id, static_cast<uint16_t>(parameter.type),
+                               parameter.byRef, parameter.isArray});
+        }
+        putCode(out, function->chunk);
+        putLines(out, function->chunk);
+        putConstants(out, function->chunk);
+        putSwitches(out, function->chunk);
+        out += function->source;
+        align(out);
+    }
+
+    header.typesOffset = out.size();
+    header.globalTypeCount = compiler.globalsType.size();
+    header.localTypeCount = compiler.localsType.size();
+    for (const auto type : compiler.globalsType) {
+        put(out, type);
+    }
+    for (const auto type : compiler.localsType) {
+        put(out, type);
+    }
+    align(out);
+
+    header.globalsOffset = out.size();
+    for (const auto &identifier : compiler.identifiers) {
+        if (identifier.depth == 0) {
+            put(out, Global{identifier.name.id, static_cast<uint16_t>(identifier.type),
+                            identifier.isArray, 0});
+            header.globalCount++;
+        }
+    }
+    align(out);
+
+    header.namedConstantsOffset = out.size();
+    header.namedConstantCount = compiler.constants.size();
+    vector<uint32_t> constantNames(compiler.constants.size());
+    for (const auto &[id, slot] : compiler.constantIdxMap) {
+        constantNames[slot] = id;
+    }
+    for (size_t slot = 0; slot < compiler.constants.size(); slot++) {
+        put<uint32_t>(out, constantNames[slot]);
+        putValue(out, compiler.constants[slot]);
+    }
+    align(out);
+
+    header.fileSize = out.size();
+    std::memcpy(out.data(), &header, sizeof(Header));
+    return out;
+}
+
+void write(const string &path, const Chunk &chunk, const Compiler &compiler) {
+    const string bytes = encode(chunk, compiler);
+    // written under a unique name and renamed into place, so a reader (or a
+    // concurrent writer) only ever sees a missing or a complete image
+    const string temp = path + ".tmp" + std::to_string(std::random_device{}());
+    {
+        std::ofstream file(temp, std::ios::binary | std::ios::trunc);
+        if (!file.write(bytes.data(), bytes.size()) || !file.flush()) {
+            file.close();
+            std::remove(temp.c_str());
+            throw std::runtime_error("Could not write " + path);
+        }
+    }
+    if (std::rename(temp.c_str(), path.c_str()) != 0) {
+        std::remove(temp.c_str());
+        throw std::runtime_error("Could not write " + path);
+    }
+}
+
+void load(std::shared_ptr<const MappedFile> file, Chunk &chunk, Compiler &compiler) {
+    const std::string_view bytes = file->view();
+    if (!isImage(bytes)) {
+        throw std::runtime_error("Not a bytecode image");
+    }
+    if (!isValid(bytes)) {
+        throw std::runtime_error("Bytecode image is corrupt or was built by an incompatible compiler");
+    }
+    Header header;
+    std::memcpy(&header, bytes.data(), sizeof(Header));
+
+    // names first: everything else refers to symbols by the writer's ids
+    Reader names(bytes, header.symbolsOffset);
+    vector<Symbol> remap(header.symbolCount);
+    for (auto &symbol : remap) {
+        const auto length = names.get<uint32_t>();
+        symbol = SymbolTable::global().intern(names.text(length));
+    }
+    const auto symbolAt = [&](uint64_t id) {
+        if (id >= remap.size()) {
+            throw std::runtime_error("Bytecode image is corrupt");
+        }
+        return remap[id];
+    };
+
+    Reader constants(bytes, header.constantsOffset);
+    getConstants(constants, header.constantCount, chunk, symbolAt);
+    Reader switches(bytes, header.switchesOffset);
+    getSwitches(switches, header.switchCount, bytes.size(), chunk, symbolAt);
+
+    Reader procedures(bytes, header.proceduresOffset);
+    compiler.functions.clear();
+    compiler.functionIdxMap.clear();
+    compiler.moduleLocals = header.moduleLocals;
+    for (uint64_t i = 0; i < header.procedureCount; i++) {
+        const auto procedure = procedures.get<Procedure>();
+        auto function = std::make_unique<Function>(symbolAt(procedure.name));
+        function->arity = procedure.arity;
+        function->localCount = procedure.localCount;
+        function->maxStack = procedure.maxStack;
+        function->compiled = procedure.compiled != 0;
+        function->returns = static_cast<TokenType>(procedure.returns);
+        function->memoize = procedure.memoize != 0;
+        function->visible = {procedure.visibleGlobals, procedure.visibleConstants,
+                             procedure.visibleProcedures};
+        if (procedure.arity > bytes.size()) {
+            throw std::runtime_error("Bytecode image is truncated");
+        }
+        for (uint32_t p = 0; p < procedure.arity; p++) {
+            const auto parameter = procedures.get<Parameter>();
+            function->parameters.push_back({symbolAt(parameter.name),
+                                            static_cast<TokenType>(parameter.type),
+                                            parameter.byRef != 0, parameter.isArray != 0});
+        }
+        function->firstLine = static_cast<int>(procedure.firstLine);
+        if (procedure.codeSize > bytes.size()) {
+            throw std::runtime_error("Bytecode image is truncated");
+        }
+        const char *code = procedures.text(procedure.codeSize).data();
+        procedures.align();
+        const char *lines = procedures.text(procedure.codeSize * 8).data();
+        getConstants(procedures, procedure.constantCount, function->chunk, symbolAt);
+        getSwitches(procedures, procedure.switchCount, bytes.size(), function->chunk, symbolAt);
+        function->source = string(procedures.text(procedure.sourceSize));
+        procedures.align();
+        function->chunk.map(file, reinterpret_cast<const std::byte *>(code), lines,
+                            procedure.codeSize);
+        verify(function->chunk, procedure.localCount, header.procedureCount);
+        compiler.functionIdxMap.emplace(function->name.id, compiler.functions.size());
+        compiler.functions.push_back(std::move(function));
+    }
+
+    Reader types(bytes, header.typesOffset);
+    const auto restore = [&](vector<TokenType> &table, uint64_t count) {
+        table.assign(SymbolTable::global().size(), TokenType::Eof);
+        for (uint64_t id = 0; id < count; id++) {
+            table[symbolAt(id).id] = types.get<TokenType>();
+        }
+    };
+    restore(compiler.globalsType, header.globalTypeCount);
+    restore(compiler.localsType, header.localTypeCount);
+    // a procedure still to be compiled resolves globals and CONSTANTs by
+    // name, among those declared before it
+    Reader globals(bytes, header.globalsOffset);
+    compiler.identifiers.clear();
+    if (header.globalCount > bytes.size()) {
+        throw std::runtime_error("Bytecode image is truncated");
+    }
+    for (uint64_t i = 0; i < header.globalCount; i++) {
+        const auto global = globals.get<Global>();
+        compiler.identifiers.emplace_back(symbolAt(global.name), 0, 0,
+                                          static_cast<TokenType>(global.type),
+                                          global.isArray != 0);
+    }
+    Reader constantNames(bytes, header.namedConstantsOffset);
+    compiler.constants.clear();
+    compiler.constantIdxMap.clear();
+    for (uint64_t i = 0; i < header.namedConstantCount; i++) {
+        const Symbol name = symbolAt(constantNames.get<uint32_t>());
+        compiler.constantIdxMap.emplace(name.id, compiler.constants.size());
+        compiler.constants.push_back(getValue(constantNames, symbolAt));
+    }
+
+    const char *base = bytes.data();
+    chunk.map(std::move(file), reinterpret_cast<const std::byte *>(base + header.codeOffset),
+              base + header.linesOffset, header.codeSize);
+    verify(chunk, header.moduleLocals, header.procedureCount);
+}
+
+}
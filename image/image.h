@@ -0,0 +1,83 @@
+#pragma once
+#include "../common.h"
+#include "../chunk/chunk.h"
+#include "../compiler/compiler.h"
+#include "../source/source.h"
+#include <memory>
+#include <string_view>
+
+// Compiled programs on disk (.psc). An image holds everything the VM needs
+// from a compilation: the bytecode and its line table, the constant pool and
+// CASE tables, the names behind every symbol id, every procedure (as its own code, line
+// table, constants and CASE tables), the declared variable types and the
+// values of CONSTANTs. Sections are 8-byte aligned so that the code and line
+// table can be executed in place from a read-only mapping; only constants,
+// CASE tables, names and types are decoded on load.
+//
+// The format is native-endian and versioned: bump `version` whenever the
+// layout, OpCode or TokenType changes, and older images are rejected.
+namespace image {
+
+inline constexpr char magic[4] = {'P', 'S', 'C', 'B'};
+inline constexpr uint32_t version = 13;
+inline constexpr uint32_t byteOrder = 0x01020304;
+
+struct Header {
+    char magic[4];
+    uint32_t version;
+    uint32_t byteOrder;
+    // frame slots the module's own blocks need
+    uint32_t moduleLocals;
+    uint64_t fileSize;
+    uint64_t codeOffset, codeSize;
+    uint64_t linesOffset;
+    uint64_t constantsOffset, constantCount;
+    uint64_t switchesOffset, switchCount;
+    uint64_t symbolsOffset, symbolCount;
+    uint64_t proceduresOffset, procedureCount;
+    uint64_t typesOffset, globalTypeCount, localTypeCount;
+    // global variables (Global records) and then CONSTANT declarations, each
+    // a symbol id and then its value, both in declaration order
+    uint64_t globalsOffset, globalCount;
+    uint64_t namedConstantsOffset, namedConstantCount;
+};
+
+// precedes each procedure's parameters (`arity` Parameter records), code,
+// line table, constants, CASE tables and, for one not compiled yet, the source of its
+// body, in that order
+struct Procedure {
+    uint64_t name;
+    uint32_t arity, localCount, maxStack, compiled;
+    // TokenType of a FUNCTION's result, Eof for a PROCEDURE
+    uint32_t returns, memoize;
+    int64_t firstLine;
+    uint64_t codeSize, constantCount, switchCount, sourceSize;
+    // the globals, CONSTANTs and procedures its body may refer to, see Visibility
+    uint64_t visibleGlobals, visibleConstants, visibleProcedures;
+};
+
+struct Parameter {
+    uint32_t name;
+    uint16_t type;
+    uint8_t byRef, isArray;
+};
+
+struct Global {
+    uint32_t name;
+    uint16_t type;
+    uint8_t isArray, pad;
+};
+
+bool isImage(std::string_view bytes);
+// an image this build can load: right version, byte order and section bounds
+bool isValid(std::string_view bytes);
+// serializes `chunk` with the compiler state it was built with
+string encode(const Chunk &chunk, const Compiler &compiler);
+// atomic: `path` is replaced only once the whole image is on disk
+void write(const string &path, const Chunk &chunk, const Compiler &compiler);
+// maps `file` into `chunk` and restores the compiler's tables; symbol ids
+// are re-interned, so an image can be loaded into any session. Code that
+// would send the VM out of bounds is rejected as corrupt
+void load(std::shared_ptr<const MappedFile> file, Chunk &chunk, Compiler &compiler);
+
+}
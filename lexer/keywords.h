@@ -0,0 +1,161 @@
+#pragma once
+#include "../tokens/tokens.h"
+#include <string_view>
+
+// Keyword recognition without a runtime hash map. The keyword set is hashed
+// case-insensitively into a collision-free table whose seed is searched for
+// at compile time, so recognising a word costs one hash (folded into the
+// lexer's scan) and at most one string compare. Upper- and lower-case
+// keyword sets share the table; the spelling check picks the active case.
+namespace keywords {
+
+struct Keyword {
+    std::string_view spelling; // lower-case form
+    TokenType type;
+};
+
+inline constexpr Keyword list[] = {
+    {"system",          TokenType::System},
+    {"random_integer",  TokenType::RandomInt},
+    {"random_real",     TokenType::RandomReal},
+    {"length",          TokenType::Length},
+    {"reverse",         TokenType::Reverse},
+    {"mid",             TokenType::Mid},
+    {"sin",             TokenType::Sin},
+    {"cos",             TokenType::Cos},
+    {"tan",             TokenType::Tan},
+    {"sqrt",            TokenType::Sqrt},
+    {"abs",             TokenType::Abs},
+    {"integer_cast",    TokenType::IntCast},
+    {"string_cast",     TokenType::StringCast},
+    {"real_cast",       TokenType::RealCast},
+    {"declare",         TokenType::Declare},
+    {"constant",        TokenType::Constant},
+    {"case",            TokenType::Case},
+    {"of",              TokenType::Of},
+    {"otherwise",       TokenType::Otherwise},
+    {"endcase",         TokenType::Endcase},
+    {"integer",         TokenType::Integer_t},
+    {"real",            TokenType::Real_t},
+    {"boolean",         TokenType::Boolean_t},
+    {"char",            TokenType::Char_t},
+    {"string",          TokenType::String_t},
+    {"date",            TokenType::Date_t},
+    {"true",            TokenType::True},
+    {"false",           TokenType::False},
+    {"div",             TokenType::Div},
+    {"mod",             TokenType::Mod},
+    {"type",            TokenType::Type},
+    {"endtype",         TokenType::Endtype},
+    {"for",             TokenType::For},
+    {"to",              TokenType::To},
+    {"step",            TokenType::Step},
+    {"next",            TokenType::Next},
+    {"if",              TokenType::If},
+    {"then",            TokenType::Then},
+    {"else",            TokenType::Else},
+    {"endif",           TokenType::Endif},
+    {"while",           TokenType::While},
+    {"do",              TokenType::Do},
+    {"endwhile",        TokenType::Endwhile},
+    {"array",           TokenType::Array},
+    {"repeat",          TokenType::Repeat},
+    {"until",           TokenType::Until},
+    {"break",           TokenType::Break},
+    {"continue",        TokenType::Continue},
+    {"procedure",       TokenType::Procedure},
+    {"byref",           TokenType::Byref},
+    {"byval",           TokenType::Byval},
+    {"endprocedure",    TokenType::Endprocedure},
+    {"call",            TokenType::Call},
+    {"function",        TokenType::Function},
+    {"returns",         TokenType::Returns},
+    {"return",          TokenType::Return},
+    {"endfunction",     TokenType::Endfunction},
+    {"output",          TokenType::Output},
+    {"print",           TokenType::Output},
+    {"input",           TokenType::Input},
+    {"openfile",        TokenType::Openfile},
+    {"readfile",        TokenType::Readfile},
+    {"writefile",       TokenType::Writefile},
+    {"closefile",       TokenType::Closefile},
+    {"read",            TokenType::Read},
+    {"write",           TokenType::Write},
+    {"append",          TokenType::Append},
+    {"random",          TokenType::Random},
+    {"seek",            TokenType::Seek},
+    {"getrecord",       TokenType::Getrecord},
+    {"putrecord",       TokenType::Putrecord},
+    {"and",             TokenType::And},
+    {"or",              TokenType::Or},
+    {"not",             TokenType::Not},
+};
+
+inline constexpr size_t count = sizeof(list) / sizeof(list[0]);
+inline constexpr uint32_t tableBits = 9;
+inline constexpr uint32_t tableSize = 1u << tableBits;
+inline constexpr uint8_t empty = 0xff;
+static_assert(count < empty, "keyword index must fit in a table slot");
+
+// identifiers only contain [A-Za-z0-9_]; or-ing 0x20 lower-cases letters and
+// leaves digits alone, which is all the folding the hash needs
+constexpr uint32_t step(uint32_t hash, char c) {
+    return (hash ^ (static_cast<unsigned char>(c) | 0x20u)) * 16777619u;
+}
+
+constexpr uint32_t slot(uint32_t hash) { return hash >> (32 - tableBits); }
+
+constexpr uint32_t hash(std::string_view word, uint32_t seed) {
+    for (const char c : word) {
+        seed = step(seed, c);
+    }
+    return seed;
+}
+
+struct Table {
+    uint32_t seed;
+    uint8_t slots[tableSize];
+};
+
+constexpr Table build() {
+    for (uint32_t seed = 2166136261u; seed < 2166136261u + 4096; ++seed) {
+        Table table {seed, {}};
+        for (auto &s : table.slots) {
+            s = empty;
+        }
+        bool perfect = true;
+        for (size_t i = 0; i < count && perfect; i++) {
+            auto &s = table.slots[slot(hash(list[i].spelling, seed))];
+            perfect = s == empty;
+            s = static_cast<uint8_t>(i);
+        }
+        if (perfect) {
+            return table;
+        }
+    }
+    return Table {0, {}};
+}
+
+inline constexpr Table table = build();
+static_assert(table.seed != 0, "no collision-free seed for the keyword set");
+
+constexpr char upper(char c) { return (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c; }
+
+// `hash` must be the running hash of `word` started from table.seed.
+// Returns TokenType::Identifier for anything that is not a keyword in the
+// active case.
+constexpr TokenType lookup(std::string_view word, uint32_t hash, bool lowercase) {
+    const uint8_t i = table.slots[slot(hash)];
+    if (i == empty || list[i].spelling.size() != word.size()) {
+        return TokenType::Identifier;
+    }
+    const auto spelling = list[i].spelling;
+    for (size_t j = 0; j < word.size(); j++) {
+        if (word[j] != (lowercase ? spelling[j] : upper(spelling[j]))) {
+            return TokenType::Identifier;
+        }
+    }
+    return list[i].type;
+}
+
+} // namespace keywords
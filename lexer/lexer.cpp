@@ -1,223 +1,64 @@
 #include "lexer.h"
 #include "../common.h"
 #include "../tokens/tokens.h"
+#include "keywords.h"
+#include "scan.h"
+#include "../symbols/symbols.h"
 #include <cctype>
 #include <algorithm>
+#include <thread>
 
-const unordered_map<string, TokenType> Lexer::symbols = {
-    {"(", TokenType::Lparen},
-    {")", TokenType::Rparen},
-    {"+", TokenType::Plus},
-    {"-", TokenType::Minus},
-    {"*", TokenType::Star},
-    {"/", TokenType::Slash},
-    {"//", TokenType::Comment},
-    {"&", TokenType::Ampersand},
-    {"<", TokenType::Lesser},
-    {"<-", TokenType::Assignment},
-    {"<=", TokenType::Lesser_equal},
-    {"=", TokenType::Equals},
-    {"<>", TokenType::Not_equals},
-    {">", TokenType::Greater},
-    {">=", TokenType::Greater_equal},
-    {"'", TokenType::Apostrophe},
-    {"\"", TokenType::Speech},
-    {"[", TokenType::Lsqrbracket},
-    {"]", TokenType::Rsqrbracket},
-    {"^", TokenType::Caret},
-    {":", TokenType::Colon},
-    {",", TokenType::Comma},
-    {".", TokenType::Period},
-    {"\n", TokenType::Newline},
-};
+Lexer::Lexer() : symbols(&SymbolTable::global()) {}
 
-const unordered_map<string, TokenType> Lexer::lowerkeywords = {
-    {"system", TokenType::System},
-    {"random_integer", TokenType::RandomInt},
-    {"random_real", TokenType::RandomReal},
-    {"length", TokenType::Length},
-    {"reverse", TokenType::Reverse},
-    {"mid", TokenType::Mid},
-    {"sin", TokenType::Sin},
-    {"cos", TokenType::Cos},
-    {"tan", TokenType::Tan},
-    {"sqrt", TokenType::Sqrt},
-    {"abs", TokenType::Abs},
-    {"integer_cast", TokenType::IntCast},
-    {"string_cast", TokenType::StringCast},
-    {"real_cast", TokenType::RealCast},
-    {"declare", TokenType::Declare},
-    {"constant", TokenType::Constant},
-    {"case", TokenType::Case},
-    {"of", TokenType::Of},
-    {"otherwise", TokenType::Otherwise},
-    {"endcase", TokenType::Endcase},
-    {"integer", TokenType::Integer_t},
-    {"real", TokenType::Real_t},
-    {"boolean", TokenType::Boolean_t},
-    {"char", TokenType::Char_t},
-    {"string", TokenType::String_t},
-    {"date", TokenType::Date_t},
-    {"true", TokenType::True},
-    {"false", TokenType::False},
-    {"div",    TokenType::Div},
-    {"mod",   TokenType::Mod},
-    {"type", TokenType::Type},
-    {"endtype", TokenType::Endtype},
-    {"for", TokenType::For},
-    {"to", TokenType::To},
-    {"step", TokenType::Step},
-    {"next", TokenType::Next},
-    {"if", TokenType::If},
-    {"then", TokenType::Then},
-    {"else", TokenType::Else},
-    {"endif", TokenType::Endif},
-    {"while", TokenType::While},
-    {"do", TokenType::Do},
-    {"endwhile", TokenType::Endwhile},
-    {"array", TokenType::Array},
-    {"repeat", TokenType::Repeat},
-    {"until", TokenType::Until},
-    {"break", TokenType::Break},
-    {"continue", TokenType::Continue},
-    {"procedure", TokenType::Procedure},
-    {"byref", TokenType::Byref},
-    {"byval", TokenType::Byval},
-    {"endprocedure", TokenType::Endprocedure},
-    {"call", TokenType::Call},
-    {"function", TokenType::Function},
-    {"returns", TokenType::Returns},
-    {"return", TokenType::Return},
-    {"endfunction", TokenType::Endfunction},
-    {"output", TokenType::Output},
-    {"print", TokenType::Output},
-    {"input", TokenType::Input},
-    {"openfile", TokenType::Openfile},
-    {"readfile", TokenType::Readfile},
-    {"writefile", TokenType::Writefile},
-    {"closefile", TokenType::Closefile},
-    {"read", TokenType::Read},
-    {"write", TokenType::Write},
-    {"append", TokenType::Append},
-    {"random", TokenType::Random},
-    {"seek", TokenType::Seek},
-    {"getrecord", TokenType::Getrecord},
-    {"putrecord", TokenType::Putrecord},
-    {"and", TokenType::And},
-    {"or", TokenType::Or},
-    {"not", TokenType::Not},
-};
-
-
-
-const unordered_map<string, TokenType> Lexer::keywords = {
-    {"SYSTEM", TokenType::System},
-    {"RANDOM_INTEGER", TokenType::RandomInt},
-    {"RANDOM_REAL", TokenType::RandomReal},
-    {"LENGTH", TokenType::Length},
-    {"REVERSE", TokenType::Reverse},
-    {"MID", TokenType::Mid},
-    {"SIN", TokenType::Sin},
-    {"COS", TokenType::Cos},
-    {"TAN", TokenType::Tan},
-    {"SQRT", TokenType::Sqrt},
-    {"ABS", TokenType::Abs},
-    {"INTEGER_CAST", TokenType::IntCast},
-    {"STRING_CAST", TokenType::StringCast},
-    {"REAL_CAST", TokenType::RealCast},
-    {"DECLARE", TokenType::Declare},
-    {"CONSTANT", TokenType::Constant},
-    {"CASE", TokenType::Case},
-    {"OF", TokenType::Of},
-    {"OTHERWISE", TokenType::Otherwise},
-    {"ENDCASE", TokenType::Endcase},
-    {"INTEGER", TokenType::Integer_t},
-    {"REAL", TokenType::Real_t},
-    {"BOOLEAN", TokenType::Boolean_t},
-    {"CHAR", TokenType::Char_t},
-    {"STRING", TokenType::String_t},
-    {"Date", TokenType::Date_t},
-    {"TRUE", TokenType::True},
-    {"FALSE", TokenType::False},
-    {"DIV",    TokenType::Div},
-    {"MOD",   TokenType::Mod},
-    {"TYPE", TokenType::Type},
-    {"ENDTYPE", TokenType::Endtype},
-    {"FOR", TokenType::For},
-    {"TO", TokenType::To},
-    {"STEP", TokenType::Step},
-    {"NEXT", TokenType::Next},
-    {"IF", TokenType::If},
-    {"THEN", TokenType::Then},
-    {"ELSE", TokenType::Else},
-    {"ENDIF", TokenType::Endif},
-    {"WHILE", TokenType::While},
-    {"DO", TokenType::Do},
-    {"ENDWHILE", TokenType::Endwhile},
-    {"ARRAY", TokenType::Array},
-    {"REPEAT", TokenType::Repeat},
-    {"UNTIL", TokenType::Until},
-    {"BREAK", TokenType::Break},
-    {"CONTINUE", TokenType::Continue},
-    {"PROCEDURE", TokenType::Procedure},
-    {"BYREF", TokenType::Byref},
-    {"BYVAL", TokenType::Byval},
-    {"ENDPROCEDURE", TokenType::Endprocedure},
-    {"CALL", TokenType::Call},
-    {"FUNCTION", TokenType::Function},
-    {"RETURNS", TokenType::Returns},
-    {"RETURN", TokenType::Return},
-    {"ENDFUNCTION", TokenType::Endfunction},
-    {"OUTPUT", TokenType::Output},
-    {"PRINT", TokenType::Output},
-    {"INPUT", TokenType::Input},
-    {"OPENFILE", TokenType::Openfile},
-    {"READFILE", TokenType::Readfile},
-    {"WRITEFILE", TokenType::Writefile},
-    {"CLOSEFILE", TokenType::Closefile},
-    {"READ", TokenType::Read},
-    {"WRITE", TokenType::Write},
-    {"APPEND", TokenType::Append},
-    {"RANDOM", TokenType::Random},
-    {"SEEK", TokenType::Seek},
-    {"GETRECORD", TokenType::Getrecord},
-    {"PUTRECORD", TokenType::Putrecord},
-    {"AND", TokenType::And},
-    {"OR", TokenType::Or},
-    {"NOT", TokenType::Not},
-};
-
-Lexer::Lexer(string *input) {
+Lexer::Lexer(std::string_view input) : Lexer() {
     initLexer(input);
 }
 
-void Lexer::initLexer(string *_input) {
-  _input->erase(remove(_input->begin(), _input->end(), '\r'), _input->end());
+void Lexer::initLexer(std::string_view _input, int firstLine) {
+  release();
   input = _input;
   idx = SIZE_MAX;
   currentChar = 0;
-  line = 1;
+  line = firstLine;
   column = 0;
+  streaming = false;
+  buffered = false;
+  finished = false;
+  stream.clear();
   advance();
 }
 
+void Lexer::release() {
+    // the vector's buffer lives in the arena, so swap in a fresh (empty) one
+    // before handing every block back at once
+    TokenList = TokenBuffer(&arena);
+    arena.release();
+}
+
 void Lexer::advance() {
-    if (++idx >= input->size()) {
+    if (++idx >= input.size()) {
         return;
     }
     if (currentChar == '\n') {
         ++line;
         column = 0;
     }
-    currentChar = (*input)[idx];
+    currentChar = input[idx];
     column++;
 }
 
+// moves `n` characters along the current line; none of them may be a newline
+void Lexer::skip(size_t n) {
+    idx += n;
+    column += n;
+    currentChar = idx < input.size() ? input[idx] : 0;
+}
+
 char Lexer::nextNChar(size_t n) {
-    if (idx + n >= input->size()) {
+    if (idx + n >= input.size()) {
         return 0;
     }
-    return (*input)[idx + n];
+    return input[idx + n];
 }
 char escFmt(char c) {
     switch (c) {
@@ -242,7 +83,15 @@ void Lexer::makeString() {
     int startColumn = column;
     advance();
     string str;
-    while (currentChar != '"' && idx < input->size()) {
+    const char *end = input.data() + input.size();
+    while (currentChar != '"' && idx < input.size()) {
+        const char *p = input.data() + idx;
+        const char *stop = scan::stringEnd(p, end);
+        if (stop != p) {
+            str.append(p, stop);
+            skip(stop - p);
+            continue;
+        }
         if (currentChar == '\\') {
             advance();
             char c = escFmt(currentChar);
@@ -250,19 +99,21 @@ void Lexer::makeString() {
                 Error.report(line, column, "Syntax", "Invalid escape sequence");
             }
             str += c;
+        } else if (currentChar == '\r') {
+            // CRLF sources keep their strings LF-only
         } else {
             str += currentChar;
         }
         advance();
     }
-    if (idx >= input->size() || currentChar != '"') {
+    if (idx >= input.size() || currentChar != '"') {
         Error.report(line, column, "Syntax", "String literal is invalid. End with '\"\'");
     }
-    TokenList.emplace_back(new Token(TokenType::String, line, startColumn, str));
+    emit(TokenType::String, line, startColumn, std::move(str));
 }
 
 void Lexer::makeChar() {
-    if (idx + 2 >= input->size()) {
+    if (idx + 2 >= input.size()) {
         Error.report(line, column, "Syntax", "CHAR is invalid");
     }
     int startColumn = column;
@@ -279,40 +130,38 @@ void Lexer::makeChar() {
     } else {
         c = currentChar;
     }
-    if (idx + 1 >= input->size() || (*input)[idx + 1] != '\'') {
+    if (idx + 1 >= input.size() || input[idx + 1] != '\'') {
         Error.report(line, column, "Syntax", "CHAR can only contain one character");
     }
     advance();
-    TokenList.emplace_back(new Token(TokenType::Char, line, startColumn, c));
+    emit(TokenType::Char, line, startColumn, c);
 }
 
 void Lexer::makeWord() {
   size_t startIdx = idx;
   int startColumn = column;
-
-  for (; idx < input->size(); Lexer::advance()) {
-      if (!isalpha(currentChar) && !isdigit(currentChar) && currentChar != '_') {
-          break;
-      }
-  }
-  string word = input->substr(startIdx, idx - startIdx);
-  unordered_map<string, TokenType> keyw;
-  if (lowercase) {
-      keyw = Lexer::lowerkeywords;
-  } else {
-      keyw = Lexer::keywords;
+  const char *begin = input.data() + startIdx;
+  const char *end = scan::wordEnd(begin, input.data() + input.size());
+  skip(end - begin);
+  const std::string_view word(begin, end - begin);
+  uint32_t hash = keywords::table.seed;
+  for (char c : word) {
+      hash = keywords::step(hash, c);
   }
-  unordered_map<string, TokenType>::const_iterator it = keyw.find(word);
-  if (it == keyw.end()) {
-      TokenList.emplace_back(new Token(TokenType::Identifier, line, startColumn, word));
-  } else {
-      if (it->second == TokenType::True) {
-          TokenList.emplace_back(new Token(TokenType::Boolean, line, startColumn, true));
-      } else if (it->second == TokenType::False) {
-          TokenList.emplace_back(new Token(TokenType::Boolean, line, startColumn, false));
-      } else {
-          TokenList.emplace_back(new Token(it->second, line, startColumn, std::monostate{}));
-      }
+  const TokenType type = keywords::lookup(word, hash, lowercase);
+  switch (type) {
+      case TokenType::Identifier:
+          emit(TokenType::Identifier, line, startColumn, symbols->intern(word));
+          break;
+      case TokenType::True:
+          emit(TokenType::Boolean, line, startColumn, true);
+          break;
+      case TokenType::False:
+          emit(TokenType::Boolean, line, startColumn, false);
+          break;
+      default:
+          emit(type, line, startColumn);
+          break;
   }
 }
 
@@ -320,90 +169,254 @@ void Lexer::makeNumber() {
     int startIdx = idx;
     int startColumn = column;
     bool real = false;
-    for ( ; idx < input->size(); advance()) {
-        if (currentChar == '.' && !real) {
-            real = true;
-            continue;
+    const char *end = input.data() + input.size();
+    skip(scan::digitsEnd(input.data() + idx, end) - (input.data() + idx));
+    if (currentChar == '.' && idx < input.size()) {
+        real = true;
+        advance();
+        skip(scan::digitsEnd(input.data() + idx, end) - (input.data() + idx));
+    }
+    if (!real && currentChar == '/') {
+        // a date is digits/digits/digits; decide before emitting anything so
+        // a streamed token never has to be taken back
+        int i = 0;
+        char c = nextNChar(i);
+        while (isdigit(c = nextNChar(++i))) {}
+        if (c == '/' && isdigit(c = nextNChar(++i))) {
+            for (int j = 0; j < i; j++){
+              advance();
+            }
+            while (isdigit(currentChar) && idx < input.size()) advance();
+            emit(TokenType::Date, line, startColumn, string(input.substr(startIdx, idx - startIdx)));
+            return;
         }
-        if (!isdigit(currentChar)) {break;}
     }
     if (real == true) {
-        TokenList.emplace_back(new Token(TokenType::Real, line, startIdx, atof(input->substr(startIdx, idx - startIdx).c_str())));
+        emit(TokenType::Real, line, startColumn, atof(string(input.substr(startIdx, idx - startIdx)).c_str()));
     } else {
-        TokenList.emplace_back(new Token(TokenType::Integer, line, startIdx, strtoll(input->substr(startIdx, idx - startIdx).c_str(), NULL, 10)));
-    }
-    if (currentChar != '/' || real) { return; }
-    int i = 0;
-    char c = nextNChar(i);
-    while (isdigit(c = nextNChar(++i))) {}
-    if (c != '/' || !isdigit(c = nextNChar(++i))) return;
-    for (int j = 0; j < i; j++){
-      advance();
+        emit(TokenType::Integer, line, startColumn, strtoll(string(input.substr(startIdx, idx - startIdx)).c_str(), NULL, 10));
     }
-    while (isdigit(currentChar) && idx < input->size()) advance();
-    TokenList.pop_back();
-    TokenList.emplace_back(new Token(TokenType::Date, line, startColumn, input->substr(startIdx, idx - startIdx)));
 }
 
-const vector<Token *> Lexer::makeTokens(bool print) {
-    size_t reserve = input->size() / 10;
-    if (reserve < 1) {
-        reserve = 1;
-    }
-    TokenList.reserve(reserve);
-    size_t currentTokensIdx = TokenList.size();
-    vector<Token *> currentTokens;
-    while (idx < input->size()) {
-        if (isalpha(currentChar)) {
+// Consumes one lexeme: a token, a run of blanks or a comment. Tokens go to
+// the batch buffer or to the stream, see emit().
+void Lexer::scanToken() {
+    const char *end = input.data() + input.size();
+    const char *p = input.data() + idx;
+    switch (scan::kind(currentChar)) {
+        case scan::CharClass::Alpha:
             makeWord();
-            continue;
-        } else if (isdigit(currentChar)) {
+            return;
+        case scan::CharClass::Digit:
             makeNumber();
-            continue;
-        } else {
-            string c1(1, currentChar);
-            string c2;
-            c2.push_back(currentChar);
-            c2.push_back(nextNChar(1));
-            auto t1 = symbols.find(c1);
-            auto t2 = symbols.find(c2);
-            if (t2 != symbols.end()) {
-                if (t2->second == TokenType::Comment){
-                    int commentLine = line;
-                    while (line == commentLine && idx < input->size()) {advance();}
-                } else {
-                    TokenList.emplace_back(new Token(t2->second, line, column));
-                }
-                advance();
+            return;
+        case scan::CharClass::Blank:
+            skip(scan::blanksEnd(p, end) - p);
+            return;
+        case scan::CharClass::Newline:
+            emit(TokenType::Newline, line, column);
+            break;
+        case scan::CharClass::Apostrophe:
+            makeChar();
+            break;
+        case scan::CharClass::Speech:
+            makeString();
+            break;
+        case scan::CharClass::Symbol: {
+            const TokenType pair = scan::symbol(currentChar, nextNChar(1));
+            if (pair == TokenType::Comment) {
+                // the terminating newline is left to become a token
+                skip(scan::lineEnd(p, end) - p);
+                return;
+            }
+            if (pair != TokenType::Eof) {
+                emit(pair, line, column);
                 advance();
-                continue;
-            } else if (t1 != symbols.end()) {
-                switch (t1->second) {
-                    case TokenType::Apostrophe: Lexer::makeChar(); break;
-                    case TokenType::Speech: Lexer::makeString(); break;
-                    default: TokenList.emplace_back(new Token(t1->second, line, column)); break;
-                }
-            } else if (currentChar != ' ' && currentChar != '\t'){
-                Error.report(line, column, "Syntax", "invalid character");
+            } else {
+                emit(scan::symbol(currentChar), line, column);
             }
+            break;
         }
-        advance();
+        case scan::CharClass::Invalid:
+            Error.report(line, column, "Syntax", "invalid character");
+            break;
+    }
+    advance();
+}
+
+void Lexer::emit(TokenType type, int line, int column) {
+    if (streaming) {
+        stream.push(type, line, column);
+    } else {
+        TokenList.push(type, line, column);
+    }
+}
+
+void Lexer::emit(TokenType type, int line, int column, Value &&literal) {
+    if (streaming) {
+        stream.push(type, line, column, std::move(literal));
+    } else {
+        TokenList.push(type, line, column, std::move(literal));
     }
+}
 
-    TokenList.emplace_back(new Token(TokenType::Eof, line, column));
-    currentTokens.reserve(TokenList.size() - currentTokensIdx + 1);
-    for (size_t i = currentTokensIdx; i < TokenList.size() - 1; i++) {
-        currentTokens.push_back(TokenList[i].get());
+// Every statement ends in a newline, so a file whose last line lacks one
+// gets it here, just before Eof.
+void Lexer::finish() {
+    if (!input.empty() && input.back() != '\n') {
+        emit(TokenType::Newline, line, column + 1);
+    }
+    emit(TokenType::Eof, line, column);
+    finished = true;
+}
+
+void Lexer::startStream() {
+    stream.clear();
+    // a parallel lex needs the whole input anyway, so it fills TokenList in
+    // one go and the stream is then fed from there
+    buffered = workers > 1 && lexParallel();
+    streaming = true;
+}
+
+const TokenRing &Lexer::pull(size_t i) {
+    while (stream.size() <= i) {
+        if (buffered) {
+            const size_t j = std::min(stream.size(), TokenList.size() - 1);
+            stream.push(TokenList.type(j), TokenList.line(j), TokenList.column(j),
+                        Value(TokenList.literal(j)));
+        } else if (idx >= input.size()) {
+            if (finished) {
+                stream.push(TokenType::Eof, line, column);
+            } else {
+                finish();
+            }
+        } else {
+            scanToken();
+        }
+    }
+    return stream;
+}
+
+const TokenBuffer &Lexer::makeTokens(bool print) {
+    size_t reserve = input.size() / 4;
+    if (reserve < 1) {
+        reserve = 1;
+    }
+    if (workers < 2 || !lexParallel()) {
+        TokenList.reserve(reserve);
+        while (idx < input.size()) {
+            scanToken();
+        }
+        finish();
     }
-    currentTokens.push_back(new Token(TokenType::Eof, line, column));
     if (print) {
         cout << Modifier(AnsiCode::FG_BLUE);
-        for (auto token : currentTokens) {
-            cout << *token << endl;
+        for (size_t i = 0; i < TokenList.size(); i++) {
+            cout << TokenList.at(i) << endl;
         }
         cout << Modifier(AnsiCode::FG_DEFAULT);
     }
-    return currentTokens;
+    return TokenList;
+}
+
+namespace {
+    struct Segment {
+        std::string_view text;
+        Lexer lexer;
+        SymbolTable symbols;
+        int newlines {0};
+        bool failed {false};
+    };
 }
 
+// Splits the input just after newlines, lexes the pieces concurrently and
+// stitches them into TokenList. No token can span a newline except a string
+// or char literal; one that does leaves its segment unterminated, which
+// fails that segment and sends the whole input back to the sequential path.
+bool Lexer::lexParallel() {
+    const size_t size = input.size();
+    const size_t wanted = std::min<size_t>(workers, size / minSegment);
+    if (wanted < 2) {
+        return false;
+    }
+    std::vector<size_t> cuts {0};
+    for (size_t k = 1; k < wanted; k++) {
+        const size_t from = std::max(size * k / wanted, cuts.back());
+        const char *nl = scan::lineEnd(input.data() + from, input.data() + size);
+        const size_t cut = nl - input.data() + 1;
+        if (cut >= size) {
+            break;
+        }
+        if (cut > cuts.back()) {
+            cuts.push_back(cut);
+        }
+    }
+    cuts.push_back(size);
+    const size_t count = cuts.size() - 1;
+    if (count < 2) {
+        return false;
+    }
 
+    std::vector<Segment> segments(count);
+    auto lexSegment = [&](size_t s) {
+        Segment &seg = segments[s];
+        seg.text = input.substr(cuts[s], cuts[s + 1] - cuts[s]);
+        seg.newlines = std::count(seg.text.begin(), seg.text.end(), '\n');
+        seg.lexer.symbols = &seg.symbols;
+        try {
+            seg.lexer.initLexer(seg.text);
+            seg.lexer.TokenList.reserve(seg.text.size() / 4 + 1);
+            while (seg.lexer.idx < seg.text.size()) {
+                seg.lexer.scanToken();
+            }
+        } catch (const std::runtime_error &) {
+            seg.failed = true;
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t s = 1; s < count; s++) {
+        threads.emplace_back(lexSegment, s);
+    }
+    lexSegment(0);
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    for (const auto &seg : segments) {
+        if (seg.failed) {
+            return false;
+        }
+    }
+
+    size_t total = 1;
+    for (const auto &seg : segments) {
+        total += seg.lexer.TokenList.size();
+    }
+    TokenList.reserve(total);
+    int lineOffset = line - 1;
+    for (auto &seg : segments) {
+        // segments are interned in source order, so symbols get the same
+        // ids a sequential lex would have handed out
+        std::vector<Symbol> remap(seg.symbols.size());
+        for (uint32_t id = 0; id < remap.size(); id++) {
+            remap[id] = symbols->intern(seg.symbols.name(Symbol{id}));
+        }
+        const TokenBuffer &tokens = seg.lexer.TokenList;
+        for (size_t i = 0; i < tokens.size(); i++) {
+            const Value &literal = tokens.literal(i);
+            const int tokenLine = tokens.line(i) + lineOffset;
+            if (std::holds_alternative<std::monostate>(literal)) {
+                TokenList.push(tokens.type(i), tokenLine, tokens.column(i));
+            } else if (const Symbol *name = std::get_if<Symbol>(&literal)) {
+                TokenList.push(tokens.type(i), tokenLine, tokens.column(i), remap[name->id]);
+            } else {
+                TokenList.push(tokens.type(i), tokenLine, tokens.column(i), Value(literal));
+            }
+        }
+        line = seg.lexer.line + lineOffset;
+        column = seg.lexer.column;
+        lineOffset += seg.newlines;
+    }
+    idx = size;
+    finish();
+    return true;
+}
@@ -2,33 +2,63 @@
 #include "../common.h"
 #include "../tokens/tokens.h"
 #include "../error/error.h"
+#include <memory_resource>
+#include <string_view>
 
-
+class SymbolTable;
 
 class Lexer {
 private:
     ErrorReporter Error {};
     const bool lowercase = true;
-    const string *input;
-    vector<std::unique_ptr<struct Token>> TokenList;
+    // the source is never copied: it is usually a read-only file mapping,
+    // and carriage returns are skipped as they are met
+    std::string_view input;
+    // tokens (and the compiler's scratch data) are bump-allocated here and
+    // released together once compilation is done
+    std::pmr::monotonic_buffer_resource arena {};
+    TokenBuffer TokenList {&arena};
+    // streaming mode: the compiler pulls tokens one at a time through a
+    // small ring instead of the whole program being lexed up front
+    TokenRing stream {};
+    bool streaming {false};
+    // the stream is served from TokenList, which was lexed up front
+    bool buffered {false};
+    bool finished {false};
+    // inputs of at least two segments are split at newlines and lexed by
+    // this many threads; each segment interns into its own table
+    static constexpr size_t minSegment = 1 << 18;
+    unsigned workers {1};
+    SymbolTable *symbols;
     char currentChar;
     int line;
     int column;
     size_t idx;
     void advance();
+    void skip(size_t n);
     void makeWord();
     void makeChar();
     void makeNumber();
     void makeString();
+    void scanToken();
+    void finish();
+    void emit(TokenType type, int line, int column);
+    void emit(TokenType type, int line, int column, Value &&literal);
     char nextNChar(size_t n);
-    static const unordered_map<string, TokenType> keywords;
-    static const unordered_map<string, TokenType> lowerkeywords;
-    static const unordered_map<string, TokenType> symbols;
+    bool lexParallel();
 public:
-    Lexer(string *input);
-    Lexer() = default;
-    void initLexer(string *_input);
-    const vector<Token*> makeTokens(bool print);
+    Lexer(std::string_view input);
+    Lexer();
+    // `firstLine` numbers the input's first line, for text cut out of a file
+    void initLexer(std::string_view _input, int firstLine = 1);
+    void release();
+    std::pmr::memory_resource *resource() { return &arena; }
+    void setWorkers(unsigned n) { workers = n > 0 ? n : 1; }
+    const TokenBuffer &makeTokens(bool print);
+    void startStream();
+    // lexes until token `i` of the stream exists; Eof repeats at the end
+    const TokenRing &pull(size_t i);
+    const TokenRing &window() const { return stream; }
 };
 
 
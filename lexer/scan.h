@@ -0,0 +1,202 @@
+#pragma once
+#include "../tokens/tokens.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Bulk character scanning for the lexer. Every token boundary the lexer
+// needs (end of a word, of a number, of a run of blanks, of a string body)
+// is found 32 (AVX2) or 16 (SSE2) bytes at a time, with a scalar loop for
+// the tail and for targets without either instruction set. Everything else
+// is dispatched through 256-entry tables indexed by the raw byte.
+namespace scan {
+
+enum class CharClass : uint8_t {
+    Invalid, Blank, Newline, Alpha, Digit, Speech, Apostrophe, Symbol
+};
+
+struct Tables {
+    CharClass kind[256];
+    TokenType symbol[256];
+};
+
+constexpr Tables build() {
+    Tables t {};
+    for (int c = 0; c < 256; c++) {
+        t.kind[c] = CharClass::Invalid;
+        t.symbol[c] = TokenType::Eof;
+    }
+    for (int c = 'a'; c <= 'z'; c++) {
+        t.kind[c] = t.kind[c - 'a' + 'A'] = CharClass::Alpha;
+    }
+    for (int c = '0'; c <= '9'; c++) {
+        t.kind[c] = CharClass::Digit;
+    }
+    t.kind[int(' ')] = t.kind[int('\t')] = t.kind[int('\r')] = CharClass::Blank;
+    t.kind[int('\n')] = CharClass::Newline;
+    t.kind[int('"')] = CharClass::Speech;
+    t.kind[int('\'')] = CharClass::Apostrophe;
+    const struct { char c; TokenType type; } symbols[] = {
+        {'(', TokenType::Lparen},      {')', TokenType::Rparen},
+        {'+', TokenType::Plus},        {'-', TokenType::Minus},
+        {'*', TokenType::Star},        {'/', TokenType::Slash},
+        {'&', TokenType::Ampersand},   {'<', TokenType::Lesser},
+        {'=', TokenType::Equals},      {'>', TokenType::Greater},
+        {'[', TokenType::Lsqrbracket}, {']', TokenType::Rsqrbracket},
+        {'^', TokenType::Caret},       {':', TokenType::Colon},
+        {',', TokenType::Comma},       {'.', TokenType::Period},
+    };
+    for (const auto &s : symbols) {
+        t.kind[static_cast<unsigned char>(s.c)] = CharClass::Symbol;
+        t.symbol[static_cast<unsigned char>(s.c)] = s.type;
+    }
+    return t;
+}
+
+inline constexpr Tables tables = build();
+
+inline CharClass kind(char c) { return tables.kind[static_cast<unsigned char>(c)]; }
+inline TokenType symbol(char c) { return tables.symbol[static_cast<unsigned char>(c)]; }
+
+// two-character operators; Eof when `c` `next` is not one of them
+constexpr TokenType symbol(char c, char next) {
+    switch (c) {
+    case '<':
+        return next == '-' ? TokenType::Assignment
+             : next == '=' ? TokenType::Lesser_equal
+             : next == '>' ? TokenType::Not_equals
+             : TokenType::Eof;
+    case '>':
+        return next == '=' ? TokenType::Greater_equal : TokenType::Eof;
+    case '/':
+        return next == '/' ? TokenType::Comment : TokenType::Eof;
+    default:
+        return TokenType::Eof;
+    }
+}
+
+inline bool isWordChar(char c) {
+    const auto k = kind(c);
+    return k == CharClass::Alpha || k == CharClass::Digit || c == '_';
+}
+inline bool isDigit(char c) { return kind(c) == CharClass::Digit; }
+inline bool isBlank(char c) { return kind(c) == CharClass::Blank; }
+
+#if defined(__AVX2__)
+namespace simd {
+    using Vec = __m256i;
+    using Mask = uint32_t;
+    constexpr size_t width = 32;
+    inline Vec load(const char *p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p)); }
+    inline Vec splat(char c) { return _mm256_set1_epi8(c); }
+    inline Vec eq(Vec a, Vec b) { return _mm256_cmpeq_epi8(a, b); }
+    inline Vec gt(Vec a, Vec b) { return _mm256_cmpgt_epi8(a, b); }
+    inline Vec any(Vec a, Vec b) { return _mm256_or_si256(a, b); }
+    inline Vec both(Vec a, Vec b) { return _mm256_and_si256(a, b); }
+    inline Mask bits(Vec v) { return static_cast<Mask>(_mm256_movemask_epi8(v)); }
+    constexpr Mask all = 0xffffffffu;
+}
+#elif defined(__SSE2__)
+namespace simd {
+    using Vec = __m128i;
+    using Mask = uint32_t;
+    constexpr size_t width = 16;
+    inline Vec load(const char *p) { return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p)); }
+    inline Vec splat(char c) { return _mm_set1_epi8(c); }
+    inline Vec eq(Vec a, Vec b) { return _mm_cmpeq_epi8(a, b); }
+    inline Vec gt(Vec a, Vec b) { return _mm_cmpgt_epi8(a, b); }
+    inline Vec any(Vec a, Vec b) { return _mm_or_si128(a, b); }
+    inline Vec both(Vec a, Vec b) { return _mm_and_si128(a, b); }
+    inline Mask bits(Vec v) { return static_cast<Mask>(_mm_movemask_epi8(v)); }
+    constexpr Mask all = 0xffffu;
+}
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+namespace simd {
+    // bytes in [lo, hi]; bytes >= 0x80 compare as negative and never match
+    inline Vec range(Vec v, char lo, char hi) {
+        return both(gt(v, splat(lo - 1)), gt(splat(hi + 1), v));
+    }
+
+    // Advances while `matches` holds for every byte of a block; returns the
+    // first position where it fails, or the start of the unscanned tail.
+    template <typename Matches>
+    inline const char *skip(const char *p, const char *end, Matches matches) {
+        while (static_cast<size_t>(end - p) >= width) {
+            const Mask m = bits(matches(load(p)));
+            if (m != all) {
+                return p + __builtin_ctz(~m & all);
+            }
+            p += width;
+        }
+        return p;
+    }
+}
+#endif
+
+// first byte that cannot continue an identifier ([A-Za-z0-9_])
+inline const char *wordEnd(const char *p, const char *end) {
+#if defined(__AVX2__) || defined(__SSE2__)
+    p = simd::skip(p, end, [](simd::Vec v) {
+        using namespace simd;
+        const Vec lower = any(v, splat(0x20));
+        return any(any(range(lower, 'a', 'z'), range(v, '0', '9')), eq(v, splat('_')));
+    });
+#endif
+    while (p < end && isWordChar(*p)) {
+        ++p;
+    }
+    return p;
+}
+
+inline const char *digitsEnd(const char *p, const char *end) {
+#if defined(__AVX2__) || defined(__SSE2__)
+    p = simd::skip(p, end, [](simd::Vec v) { return simd::range(v, '0', '9'); });
+#endif
+    while (p < end && isDigit(*p)) {
+        ++p;
+    }
+    return p;
+}
+
+// first byte that is not a space, tab or carriage return
+inline const char *blanksEnd(const char *p, const char *end) {
+#if defined(__AVX2__) || defined(__SSE2__)
+    p = simd::skip(p, end, [](simd::Vec v) {
+        using namespace simd;
+        return any(any(eq(v, splat(' ')), eq(v, splat('\t'))), eq(v, splat('\r')));
+    });
+#endif
+    while (p < end && isBlank(*p)) {
+        ++p;
+    }
+    return p;
+}
+
+// first '"', '\\', '\n' or '\r' inside a string literal body
+inline const char *stringEnd(const char *p, const char *end) {
+#if defined(__AVX2__) || defined(__SSE2__)
+    p = simd::skip(p, end, [](simd::Vec v) {
+        using namespace simd;
+        const Vec quote = any(eq(v, splat('"')), eq(v, splat('\\')));
+        const Vec stop = any(quote, any(eq(v, splat('\n')), eq(v, splat('\r'))));
+        return eq(stop, splat(0));
+    });
+#endif
+    while (p < end && *p != '"' && *p != '\\' && *p != '\n' && *p != '\r') {
+        ++p;
+    }
+    return p;
+}
+
+// end of a comment: the newline that terminates it, or `end`
+inline const char *lineEnd(const char *p, const char *end) {
+    const void *nl = std::memchr(p, '\n', end - p);
+    return nl ? static_cast<const char *>(nl) : end;
+}
+
+} // namespace scan
@@ -7,13 +7,25 @@ using std::string;
 using std::vector;
 
 void printHelp() {
-    std::cout << "Usage: interpreter [options] [filename]\n"
+    std::cout << "Usage: interpreter [options...] [filename]\n"
               << "\n"
               << "Options:\n"
               << "  -h, --help       Show help message\n"
               << "  -b, --benchmark  Time the interpreter execution in ms\n"
               << "  -l, --lexer      Tokenize REPL prompts\n"
               << "  -t, --test       Run tests defined in tests/tests.cpp\n"
+              << "  --no-cache       Compile the file even if a cached image exists\n"
+              << "  --eager          Compile every procedure up front instead of on\n"
+              << "                   its first CALL\n"
+              << "  --no-inline      Keep every CALL, even to small procedures\n"
+              << "  --unroll <n>     Copy small FOR loop bodies n times per test of\n"
+              << "                   the iterator (default 4); 1 turns it off\n"
+              << "  --no-memoize     Only cache the results of FUNCTIONs marked with\n"
+              << "                   a // MEMOIZE line, not of pure recursive ones\n"
+              << "  --emit-bytecode <out.psc>\n"
+              << "                   Compile the file without running it and save\n"
+              << "                   the bytecode, with the options given alongside;\n"
+              << "                   run the .psc like any source file\n"
               << "\n"
               << "If no options or filename is provided, starts a REPL.\n";
 }
@@ -22,7 +34,13 @@ const vector<pair<string, string>> argpair = {
     {std::make_pair("-h", "--help")},
     {std::make_pair("-l", "--lexer")},
     {std::make_pair("-b", "--benchmark")},
-    {std::make_pair("-t", "--test")}
+    {std::make_pair("-t", "--test")},
+    {std::make_pair("--no-cache", "--no-cache")},
+    {std::make_pair("--eager", "--eager")},
+    {std::make_pair("--no-inline", "--no-inline")},
+    {std::make_pair("--unroll", "--unroll")},
+    {std::make_pair("--no-memoize", "--no-memoize")},
+    {std::make_pair("--emit-bytecode", "--emit-bytecode")}
 };
 
 
@@ -30,6 +48,7 @@ int main(int argc, char *argv[]) {
     bool benchmark = false;
     bool lexer     = false;
     bool testing = false;
+    bool cache = true;
     if (argc == 1) {
         printColor(AnsiCode::FG_BBLACK, "IGCSE/A-Level Pseudocode Compiler", true);
         repl(benchmark);
@@ -39,7 +58,7 @@ int main(int argc, char *argv[]) {
         if (string(argv[1]) == "-h" || string(argv[1]) == "--help") {
             printHelp();
         } else if (string(argv[1]) == "--test" || string(argv[1]) == "-t") {
-            invokeTests(benchmark, lexer);
+            return invokeTests(benchmark, lexer) ? 0 : 1;
         } else if (string(argv[1]) == "--lexer" || string(argv[1]) == "-l") {
             repLexer(true);
         } else if (string(argv[1]) == "--benchmark" || string(argv[1]) == "-b") {
@@ -49,23 +68,45 @@ int main(int argc, char *argv[]) {
             runFile(string(argv[1]), benchmark, lexer);
         }
     }
-    else if (argc == 3) {
-        auto a1 = string(argv[1]);
-        auto a2 = string(argv[2]);
+    else {
+        // any number of options, then the file
+        const auto file = string(argv[argc - 1]);
+        CompileOptions options;
+        string emitTo;
         try {
-            for (const auto arg : argpair) {
-                if (a2 == arg.first || a2 == arg.second) {
-                    throw std::invalid_argument("Expected filename instead of " + a2);
+            for (const auto &arg : argpair) {
+                if (file == arg.first || file == arg.second) {
+                    throw std::invalid_argument("Expected filename instead of " + file);
                 }
             }
-            if (a1 == "-h" || a1 == "--help" || a2 == "-h" || a2 == "--help") {
-                throw std::invalid_argument("[-h, --help] is a standalone argument");
-            } else if (a1 == "-l" || a1 == "--lexer") {
-                lexer = true;
-            } else if (a1 == "-b" || a1 == "--benchmark") {
-                benchmark= true;
-            } else {
-                throw std::invalid_argument("Invalid Option");
+            for (int i = 1; i < argc - 1; i++) {
+                const auto a1 = string(argv[i]);
+                if (a1 == "-h" || a1 == "--help" || file == "-h" || file == "--help") {
+                    throw std::invalid_argument("[-h, --help] is a standalone argument");
+                } else if (a1 == "-l" || a1 == "--lexer") {
+                    lexer = true;
+                } else if (a1 == "-b" || a1 == "--benchmark") {
+                    benchmark= true;
+                } else if (a1 == "--no-cache") {
+                    cache = false;
+                } else if (a1 == "--eager") {
+                    options.eager = true;
+                } else if (a1 == "--no-inline") {
+                    options.inlining = false;
+                } else if (a1 == "--no-memoize") {
+                    options.memoize = false;
+                } else if (a1 == "--unroll" && i + 1 < argc - 1) {
+                    const auto factor = string(argv[++i]);
+                    if (factor.empty() || factor.size() > 4 ||
+                        factor.find_first_not_of("0123456789") != string::npos) {
+                        throw std::invalid_argument("--unroll expects a number, not " + factor);
+                    }
+                    options.unroll = std::stoul(factor);
+                } else if (a1 == "--emit-bytecode" && i + 1 < argc - 1) {
+                    emitTo = string(argv[++i]);
+                } else {
+                    throw std::invalid_argument("Invalid Option");
+                }
             }
         } catch (const std::invalid_argument &ex) {
             printColor(FG_RED, "Argument Error: ", false);
@@ -73,7 +114,11 @@ int main(int argc, char *argv[]) {
             printHelp();
             exit(0);
         }
-        runFile(a2, benchmark, lexer);
+        if (!emitTo.empty()) {
+            emitBytecode(file, emitTo, options);
+        } else {
+            runFile(file, benchmark, lexer, cache, options);
+        }
     }
 
     return 0;
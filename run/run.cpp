@@ -1,7 +1,18 @@
 #include "../common.h"
 #include "run.h"
 
-static bool cmdHandler(std::string cmd);
+static bool cmdHandler(std::string cmd, const VirtualMachine *vm = nullptr);
+
+// options that change the generated code for the same source; part of the
+// compile cache key alongside the source and the build itself
+static std::string cacheFlags(const CompileOptions &options) {
+    std::string flags;
+    flags += options.eager ? "eager;" : "";
+    flags += options.inlining ? "" : "no-inline;";
+    flags += options.memoize ? "" : "no-memoize;";
+    flags += options.unroll == CompileOptions{}.unroll ? "" : "unroll=" + std::to_string(options.unroll) + ";";
+    return flags;
+}
 
 static std::string tolower(std::string str) {
     string newstr = "";
@@ -11,9 +22,12 @@ static std::string tolower(std::string str) {
     return newstr;
 }
 static void handleBlock(std::string &line) {
-    for (const std::string str : {"IF", "FOR", "REPEAT", "WHILE"}) {
+    for (const std::string str : {"IF", "CASE", "FOR", "REPEAT", "WHILE", "PROCEDURE", "FUNCTION"}) {
         const std::unordered_map<std::string, std::string> endMap = {
+            {"PROCEDURE", "ENDPROCEDURE"},
+            {"FUNCTION", "ENDFUNCTION"},
             {"IF", "ENDIF"},
+            {"CASE", "ENDCASE"},
             {"FOR", "NEXT"},
             {"REPEAT", "UNTIL"},
             {"WHILE", "ENDWHILE"},
@@ -54,7 +68,7 @@ void repl(bool bench) {
         std::string line;
         printColor(FG_RED, "  > ", false);
         std::getline(std::cin, line);
-        if (cmdHandler(line)) {
+        if (cmdHandler(line, &vm)) {
             continue;
         }
         handleBlock(line);
@@ -85,58 +99,90 @@ void repLexer(bool bench) {
         std::cout << "Lexer:" << std::endl;
         if (bench) {
             START_TIMER;
-            lexer.initLexer(&line);
-            auto TokenList = lexer.makeTokens(true);
+            lexer.initLexer(line);
+            lexer.makeTokens(true);
             STOP_TIMER;
         } else {
-            lexer.initLexer(&line);
-            auto TokenList = lexer.makeTokens(true);
+            lexer.initLexer(line);
+            lexer.makeTokens(true);
         }
     };
 }
 
-void runFile(std::string fileName, bool bench, bool lexer) {
-    std::ifstream file;
+void runFile(std::string fileName, bool bench, bool lexer, bool cache,
+             const CompileOptions &options) {
+    std::shared_ptr<MappedFile> file;
     try {
-        file.open(fileName);
+        file = std::make_shared<MappedFile>(fileName);
     } catch (const std::exception &ex) {
         std::cout << ex.what() << std::endl;
+        return;
     }
-    std::string input = "";
-    std::string line;
-    while (std::getline(file, line)) {
-       input += line + "\n";
-    }
-    //std::cout << input << std::endl;
+    const std::string_view input = file->view();
     if (lexer) {
         Lexer lexer;
+        lexer.setWorkers(std::thread::hardware_concurrency());
         if (bench) {
             START_TIMER;
-            lexer.initLexer(&input);
-            auto TokenList = lexer.makeTokens(true);
+            lexer.initLexer(input);
+            lexer.makeTokens(true);
             STOP_TIMER;
         } else {
-            lexer.initLexer(&input);
-            auto TokenList = lexer.makeTokens(true);
+            lexer.initLexer(input);
+            lexer.makeTokens(true);
         }
         return;
     }
     VirtualMachine vm;
+    // large files are lexed in parallel segments; small ones stay streamed
+    vm.setLexWorkers(std::thread::hardware_concurrency());
+    vm.setOptions(options);
+    // a compiled image (see --emit-bytecode) skips the front end entirely,
+    // and so does a source whose image is already in the compile cache
+    std::shared_ptr<const MappedFile> compiled = image::isImage(input) ? file : nullptr;
+    string saveImage;
+    std::optional<CompileCache> compileCache;
+    if (!compiled && cache) {
+        compileCache.emplace(cacheFlags(options));
+        compiled = compileCache->lookup(input);
+        if (!compiled) {
+            saveImage = compileCache->entry(input);
+        }
+        compileCache->record(compiled != nullptr);
+    }
     try {
         if (bench) {
             START_TIMER;
-            vm.interpret(input);
+            compiled ? vm.runImage(compiled) : vm.interpret(input, saveImage);
             STOP_TIMER;
+            vm.printMemoization();
+            if (compileCache && compileCache->enabled()) {
+                std::cout << "Compile cache " << (saveImage.empty() ? "hit" : "miss")
+                          << " (" << compileCache->hits << " hits, "
+                          << compileCache->misses << " misses)" << std::endl;
+            }
         } else {
-            vm.interpret(input);
+            compiled ? vm.runImage(compiled) : vm.interpret(input, saveImage);
         }
     } catch (const std::exception &e) {
         std::cout << e.what() << std::endl;
     }
 }
 
+void emitBytecode(std::string fileName, std::string outName, const CompileOptions &options) {
+    try {
+        const MappedFile file(fileName);
+        VirtualMachine vm;
+        vm.setLexWorkers(std::thread::hardware_concurrency());
+        vm.setOptions(options);
+        vm.emitImage(file.view(), outName);
+    } catch (const std::exception &e) {
+        std::cout << e.what() << std::endl;
+    }
+}
+
 
-static bool cmdHandler(std::string line) {
+static bool cmdHandler(std::string line, const VirtualMachine *vm) {
     if (line == "clear") {
 #if defined(__linux__)
         system("clear");
@@ -147,6 +193,10 @@ static bool cmdHandler(std::string line) {
     if (line == "quit") {
         exit(0);
     }
+    if (line == "memory" && vm) {
+        vm->printMemory();
+        return true;
+    }
     return false;
 }
 
@@ -3,9 +3,14 @@
 #include "../lexer/lexer.h"
 #include "../vm/vm.h"
 #include "../error/error.h"
+#include "../source/source.h"
+#include "../image/image.h"
+#include "../cache/cache.h"
+#include <optional>
 //#include <unistd.h>
 #include <fstream>
 #include <chrono>
+#include <thread>
 
 
 #define START_TIMER auto start = std::chrono::steady_clock::now()
@@ -16,5 +21,8 @@
 
 void repl(bool bench);
 void repLexer(bool bench);
-void runFile(std::string fileName, bool bench, bool lexer);
+void runFile(std::string fileName, bool bench, bool lexer, bool cache = true,
+             const CompileOptions &options = {});
+void emitBytecode(std::string fileName, std::string outName,
+                  const CompileOptions &options = {});
 void printColor(AnsiCode color, std::string msg, bool newline);
@@ -0,0 +1,73 @@
+#include "source.h"
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(const std::string &fileName) {
+#if defined(__unix__) || defined(__APPLE__)
+    const int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open " + fileName);
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        throw std::runtime_error("Could not read " + fileName);
+    }
+    // a pipe, FIFO or <(...) reports no size and cannot be mapped, so it
+    // is read to its end instead
+    if (!S_ISREG(info.st_mode)) {
+        char buffer[1 << 16];
+        ssize_t got;
+        while ((got = read(fd, buffer, sizeof(buffer))) != 0) {
+            if (got < 0) {
+                close(fd);
+                throw std::runtime_error("Could not read " + fileName);
+            }
+            fallback.append(buffer, static_cast<size_t>(got));
+        }
+        close(fd);
+        data = fallback.data();
+        size = fallback.size();
+        return;
+    }
+    size = static_cast<size_t>(info.st_size);
+    // an empty file cannot be mapped, and an empty view is all it needs
+    if (size > 0) {
+        void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("Could not map " + fileName);
+        }
+        madvise(map, size, MADV_SEQUENTIAL);
+        data = static_cast<const char *>(map);
+        mapped = true;
+    }
+    // the mapping holds its own reference to the file
+    close(fd);
+#else
+    std::ifstream file(fileName, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error("Could not open " + fileName);
+    }
+    std::stringstream ss;
+    ss << file.rdbuf();
+    fallback = ss.str();
+    data = fallback.data();
+    size = fallback.size();
+#endif
+}
+
+MappedFile::~MappedFile() {
+#if defined(__unix__) || defined(__APPLE__)
+    if (mapped) {
+        munmap(const_cast<char *>(data), size);
+    }
+#endif
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include "../common.h"
+#include <string_view>
+
+// Read-only view of a source file. On POSIX systems the file is mapped
+// straight into memory, so loading a script costs no copy and no
+// allocation; elsewhere, and for pipes, it falls back to reading the
+// file into a string.
+class MappedFile {
+    public:
+        explicit MappedFile(const std::string &fileName);
+        ~MappedFile();
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+        std::string_view view() const { return {data, size}; }
+    private:
+        const char *data {nullptr};
+        size_t size {0};
+        bool mapped {false};
+        string fallback;
+};
@@ -0,0 +1,18 @@
+#include "symbols.h"
+
+Symbol SymbolTable::intern(std::string_view name) {
+    const auto it = ids.find(name);
+    if (it != ids.end()) {
+        return Symbol{it->second};
+    }
+    const auto id = static_cast<uint32_t>(names.size());
+    // deque never moves its elements, so the view used as key stays valid
+    const std::string &stored = names.emplace_back(name);
+    ids.emplace(stored, id);
+    return Symbol{id};
+}
+
+SymbolTable &SymbolTable::global() {
+    static SymbolTable table;
+    return table;
+}
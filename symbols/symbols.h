@@ -0,0 +1,19 @@
+#pragma once
+#include "../common.h"
+#include <deque>
+#include <string_view>
+
+// Identifier interner. The lexer maps every distinct identifier to a dense,
+// stable 32-bit Symbol the first time it sees it; the compiler and the VM
+// then compare, hash and index names as integers and only turn a Symbol back
+// into text for diagnostics.
+class SymbolTable {
+    public:
+        Symbol intern(std::string_view name);
+        std::string_view name(Symbol symbol) const { return names[symbol.id]; }
+        size_t size() const { return names.size(); }
+        static SymbolTable &global();
+    private:
+        std::deque<std::string> names;
+        unordered_map<std::string_view, uint32_t> ids;
+};
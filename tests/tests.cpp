@@ -3,8 +3,739 @@
 #include "../error/error.h"
 #include "../run/run.h"
 #include "tests.h"
+#include <cstring>
+#include <filesystem>
+#include <functional>
 
-void invokeTests(bool benchmark, bool lexer) {
+// what `print` wrote to cout, one line per non-empty line, without
+// colours or the "Output: " before each OUTPUT
+static string printed(const std::function<void()> &print) {
+    std::ostringstream out;
+    std::streambuf *const console = cout.rdbuf(out.rdbuf());
+    print();
+    cout.rdbuf(console);
+    string text = out.str();
+    for (size_t escape; (escape = text.find('\x1b')) != string::npos;) {
+        text.erase(escape, text.find('m', escape) - escape + 1);
+    }
+    string lines;
+    std::istringstream in(text);
+    for (string line; std::getline(in, line);) {
+        if (line.rfind("Output: ", 0) == 0) {
+            line.erase(0, 8);
+        }
+        if (!line.empty()) {
+            lines += line + "\n";
+        }
+    }
+    return lines;
+}
+
+// the value of each OUTPUT of `program` run in `vm`, then the message of
+// the error that stopped it, if one did
+static string outputOf(VirtualMachine &vm, const string &program) {
+    return printed([&] {
+        try {
+            vm.interpret(program);
+        } catch (const std::exception &e) {
+            cout << e.what() << endl;
+        }
+    });
+}
+
+static string outputOf(const string &program, const CompileOptions &options = {}) {
+    VirtualMachine vm;
+    vm.setOptions(options);
+    return outputOf(vm, program);
+}
+
+static bool check(const string &name, const string &actual, const string &expected) {
+    if (actual == expected) {
+        cout << Modifier(AnsiCode::FG_GREEN) << name << " passed!"
+             << Modifier(AnsiCode::FG_DEFAULT) << endl;
+        return true;
+    }
+    cout << Modifier(AnsiCode::FG_RED) << name << " failed!" << Modifier(AnsiCode::FG_DEFAULT)
+         << "\nexpected:\n" << expected << "got:\n" << actual << endl;
+    return false;
+}
+
+static string stackDepth(const VirtualMachine &vm) {
+    return vm.framesReserved() < 64 ? "flat" : std::to_string(vm.framesReserved()) + " frames";
+}
+
+// an image whose code would send the VM out of bounds is refused on load
+static bool imageTests() {
+    const string path = (std::filesystem::temp_directory_path() / "pscompiler-tests.psc").string();
+    VirtualMachine().emitImage("declare x : integer\nx <- 1\nwhile x < 3 do\n    output x\n"
+                               "    x <- x + 1\nendwhile\n", path);
+    string image;
+    {
+        const MappedFile file(path);
+        image = string(file.view());
+    }
+    image::Header header;
+    std::memcpy(&header, image.data(), sizeof(header));
+    const auto run = [&](const string &bytes) {
+        std::ofstream(path, std::ios::binary | std::ios::trunc) << bytes;
+        VirtualMachine vm;
+        return printed([&] {
+            try {
+                vm.runImage(std::make_shared<MappedFile>(path));
+            } catch (const std::exception &e) {
+                cout << e.what() << endl;
+            }
+        });
+    };
+    // `delta` added to byte `operand` of the first instruction of a kind
+    const auto patched = [&](OpCode opCode, size_t operand, int delta) {
+        string bytes = image;
+        for (size_t at = header.codeOffset; at < header.codeOffset + header.codeSize;
+             at += Chunk::width(static_cast<OpCode>(bytes[at]))) {
+            if (static_cast<OpCode>(bytes[at]) == opCode) {
+                bytes[at + operand] = static_cast<char>(bytes[at + operand] + delta);
+                break;
+            }
+        }
+        return bytes;
+    };
+    const string corrupt = "Bytecode image is corrupt\n";
+    // the loop starts at the Constant naming x in its test
+    const bool passed =
+        check("image", run(image), "1\n2\n") &
+        check("image with an unknown instruction", run(patched(OpCode::Constant, 0, 0xff)), corrupt) &
+        check("image with a constant out of range", run(patched(OpCode::Constant, 1, 0xff)), corrupt) &
+        check("image with a jump out of the code", run(patched(OpCode::JumpNE, 1, 200)), corrupt) &
+        check("image with a jump into an instruction", run(patched(OpCode::Loop, 1, -1)), corrupt);
+    std::filesystem::remove(path);
+    return passed;
+}
+
+// a file compiled once runs from the cache after that unless --no-cache,
+// and a miss makes room for the entry it writes by deleting the least
+// recently used ones, whichever build wrote them
+static bool cacheTests() {
+    const auto root = std::filesystem::temp_directory_path() / "pscompiler-tests-cache";
+    const auto dir = root / "pscompiler";
+    std::filesystem::remove_all(root);
+    std::filesystem::create_directories(dir);
+    const char *const saved = std::getenv("XDG_CACHE_HOME");
+    const string previous = saved ? saved : "";
+    setenv("XDG_CACHE_HOME", root.c_str(), 1);
+    const string source = (root / "program.pse").string();
+    std::ofstream(source) << "output 1 + 2\n";
+    // --benchmark's report of the run, but for how long it took
+    const auto run = [&](bool cache) {
+        string lines;
+        std::istringstream in(printed([&] { runFile(source, true, false, cache); }));
+        for (string line; std::getline(in, line);) {
+            if (line.rfind("Finished in ", 0) != 0) {
+                lines += line + "\n";
+            }
+        }
+        return lines;
+    };
+    const string miss = run(true);
+    const string hit = run(true);
+    const string uncached = run(false);
+    bool passed = check("compile cache", miss + hit,
+                        "3\nCompile cache miss (0 hits, 1 misses)\n"
+                        "3\nCompile cache hit (1 hits, 1 misses)\n") &
+                  check("--no-cache", uncached + run(true),
+                        "3\n3\nCompile cache hit (2 hits, 1 misses)\n");
+
+    std::ofstream(source) << "output 4 + 5\n";
+    const auto stale = dir / "0123456789abcdef0123456789abcdef.psc";
+    std::ofstream(stale).put('x');
+    std::filesystem::resize_file(stale, CompileCache::maxBytes + 1);
+    std::filesystem::last_write_time(
+        stale, std::filesystem::file_time_type::clock::now() - std::chrono::hours(1));
+    const string output = printed([&] { runFile(source, false, false); });
+    size_t entries = 0;
+    for (const auto &file : std::filesystem::directory_iterator(dir)) {
+        entries += file.path().extension() == ".psc";
+    }
+    passed &= check("compile cache pruning",
+                    output + std::to_string(std::filesystem::exists(stale)) + " " +
+                        std::to_string(entries),
+                    "9\n0 2");
+
+    saved ? setenv("XDG_CACHE_HOME", previous.c_str(), 1) : unsetenv("XDG_CACHE_HOME");
+    std::filesystem::remove_all(root);
+    return passed;
+}
+
+// a file long enough to be lexed in parallel segments gives the tokens,
+// and the line numbers, it would lexed in one piece
+static bool parallelLexingTests() {
+    string text;
+    for (size_t n = 0; text.size() < (size_t {1} << 20) + 4096; n++) {
+        text += "v" + std::to_string(n) + " <- v" + std::to_string(n % 7) + " + " +
+                std::to_string(n) + " * 3.5 & \"a, b\" & 'c' // note\n";
+        if (n % 5 == 0) {
+            text += "\n    if v <> 1 then\n";
+        }
+    }
+    Lexer whole, parts;
+    parts.setWorkers(4);
+    whole.initLexer(text);
+    parts.initLexer(text);
+    const TokenBuffer &a = whole.makeTokens(false);
+    const TokenBuffer &b = parts.makeTokens(false);
+    string tokens = a.size() == b.size() ? "same" : "token counts differ";
+    for (size_t i = 0; tokens == "same" && i < a.size(); i++) {
+        if (a.type(i) != b.type(i) || a.line(i) != b.line(i) || a.column(i) != b.column(i) ||
+            !(a.literal(i) == b.literal(i))) {
+            tokens = "token " + std::to_string(i) + " differs";
+        }
+    }
+
+    // mostly comments, which still count as lines
+    string program = "declare x : integer\nx <- 0\n";
+    size_t lines = 2, added = 0;
+    for (; program.size() < (size_t {1} << 20) + 4096; lines++) {
+        program += lines % 100 ? "// x <- x + 1 is not lexed here\n" : "x <- x + 1\n";
+        added += lines % 100 == 0;
+    }
+    const auto run = [&](unsigned workers, const string &end) {
+        VirtualMachine vm;
+        vm.setLexWorkers(workers);
+        return outputOf(vm, program + end);
+    };
+    const string counted = std::to_string(added) + "\n";
+    const string undeclared = "Compile error: Variable y not declared in this scope. Line " +
+                              std::to_string(lines + 1) + ", column 8\n";
+    return check("parallel lexing", tokens, "same") &
+           check("parallel lexing runs", run(1, "output x\n") + run(4, "output x\n"),
+                 counted + counted) &
+           check("parallel lexing reports lines", run(1, "output y\n") + run(4, "output y\n"),
+                 undeclared + undeclared);
+}
+
+// each REPL line is compiled onto the module the lines before it built,
+// and one that fails to compile leaves the module as it found it
+static bool replTests() {
+    VirtualMachine vm;
+    const vector<string> lines = {
+        "declare n : integer\n",
+        "procedure greet(times : integer)\n    n <- n + times\n    output n\nendprocedure\n",
+        "n <- 1\n",
+        "call greet(2)\n",
+        "declare m : integer\nprocedure bad()\n    output 1\nendprocedure\noutput zz\n",
+        "call bad()\n",
+        "m <- 1\n",
+        "call greet(3)\n",
+    };
+    string output;
+    for (const string &line : lines) {
+        output += outputOf(vm, line);
+    }
+    return check("REPL", output,
+                 "3\n"
+                 "Compile error: Variable zz not declared in this scope. Line 5, column 8\n"
+                 "Compiler error: Function / Procedure is undefined. Line 1, column 6\n"
+                 "Compile error: Variable m not declared in this scope. Line 1, column 1\n"
+                 "6\n");
+}
+
+// a body compiled on its first CALL only sees the names declared before
+// it, as it would have when compiled where it is defined, and ends where
+// its text does; --eager compiles it the same way
+static bool lazyCompileTests() {
+    const vector<std::pair<string, string>> programs = {
+        {"procedure p()\n    output g\nendprocedure\ndeclare g : integer\ng <- 5\ncall p()\n",
+         "Compile error: Variable g not declared in this scope. Line 2, column 12\n"},
+        {"procedure p()\n    output k\nendprocedure\nconstant k = 5\ncall p()\n",
+         "Compile error: Variable k not declared in this scope. Line 2, column 12\n"},
+        {"procedure p()\n    call q()\nendprocedure\nprocedure q()\n    output 3\nendprocedure\n"
+         "call p()\n",
+         "Compiler error: Function / Procedure is undefined. Line 2, column 10\n"},
+        {"procedure p()\n    call q()\n    procedure q()\n        output 1\n    endprocedure\n"
+         "endprocedure\ncall p()\n",
+         "Compiler error: Function / Procedure is undefined. Line 2, column 10\n"},
+        {"constant k = 7\nprocedure p()\n    procedure q()\n        output k\n    endprocedure\n"
+         "    call q()\nendprocedure\ncall p()\n",
+         "7\n"},
+        {"declare x : integer\nprocedure p()\n    x <-\nendprocedure\ndeclare y : integer\n"
+         "call p()\n",
+         "Compiler error: Unexpected end of scope. Line 4, column 13\n"},
+    };
+    bool passed = true;
+    for (const bool eager : {false, true}) {
+        CompileOptions options;
+        options.eager = eager;
+        for (size_t i = 0; i < programs.size(); i++) {
+            passed &= check("names visible to procedure " + std::to_string(i + 1) +
+                                (eager ? " (eager)" : ""),
+                            outputOf(programs[i].first, options), programs[i].second);
+        }
+    }
+    return passed;
+}
+
+// a small FUNCTION is inlined up to its last RETURN, whose value is what
+// the call would have returned; one that returns anywhere else is called
+static bool inliningTests() {
+    const string program = R"(function sq(n : integer) returns integer
+    return n * n
+endfunction
+function half(n : integer) returns integer
+    declare h : integer
+    h <- n div 2
+    return h + 1
+endfunction
+declare i, t : integer
+t <- 0
+for i <- 1 to 10
+    t <- t + sq(i) + half(i)
+next i
+output t
+output sq(sq(3))
+)";
+    const string returns = R"(function sign(n : integer) returns integer
+    if n < 0 then
+        return -1
+    endif
+    return 1
+endfunction
+function maybe(n : integer) returns integer
+    if n > 0 then
+        return n
+    endif
+endfunction
+output sign(-4) + sign(5)
+output maybe(3)
+)";
+    VirtualMachine vm;
+    const string output = outputOf(vm, program);
+    CompileOptions calls;
+    calls.inlining = false;
+    return check("inlined FUNCTIONs", output + std::to_string(vm.framesReserved()) + " frames",
+                 "420\n81\n0 frames") &
+           check("inlined FUNCTIONs (no inlining)", outputOf(program, calls), "420\n81\n") &
+           check("FUNCTIONs returning early", outputOf(returns), "0\n3\n");
+}
+
+// a CALL in tail position reuses its caller's frame
+static bool tailCallTests() {
+    const string program = R"(declare total : integer
+total <- 0
+procedure countdown(n : integer)
+    if n > 0 then
+        total <- total + n
+        call countdown(n - 1)
+    endif
+endprocedure
+function sumto(n : integer, acc : integer) returns integer
+    if n = 0 then
+        return acc
+    endif
+    return sumto(n - 1, acc + n)
+endfunction
+call countdown(100000)
+output total
+output sumto(100000, 0)
+)";
+    bool passed = true;
+    for (const bool eager : {false, true}) {
+        CompileOptions options;
+        options.eager = eager;
+        VirtualMachine vm;
+        vm.setOptions(options);
+        const string mode = eager ? " (eager)" : "";
+        passed &= check("tail calls" + mode, outputOf(vm, program), "5000050000\n5000050000\n");
+        passed &= check("tail calls keep the call stack flat" + mode, stackDepth(vm), "flat");
+    }
+    return passed;
+}
+
+// each active CALL has locals of its own, kept across the calls it makes
+static bool frameTests() {
+    const string program = R"(function depth(n : integer) returns integer
+    declare here : integer
+    here <- n * 10
+    if n = 0 then
+        return here
+    endif
+    declare below : integer
+    below <- depth(n - 1)
+    return here + below
+endfunction
+procedure twice(x : integer)
+    declare y : integer
+    y <- x * 2
+    output depth(x)
+    output y
+endprocedure
+call twice(3)
+)";
+    CompileOptions calls;
+    calls.inlining = false;
+    return check("frame-slot locals", outputOf(program), "60\n6\n") &
+           check("frame-slot locals (no inlining)", outputOf(program, calls), "60\n6\n");
+}
+
+// BYREF writes reach the caller's variable; a BYVAL array is shared with
+// the caller until the callee writes to it, and the write stays local
+static bool parameterTests() {
+    const string program = R"(declare a : array[1:3] of integer
+declare n : integer
+procedure bump(byref x : integer, byval y : integer)
+    x <- x + 1
+    y <- y + 1
+endprocedure
+procedure clear(byval v : array of integer)
+    output v[1]
+    v[1] <- 0
+    output v[1]
+endprocedure
+procedure fill(byref v : array of integer)
+    v[2] <- 9
+endprocedure
+n <- 1
+call bump(n, n)
+output n
+a[1] <- 5
+call clear(a)
+output a[1]
+call fill(a)
+output a[2]
+)";
+    const string declarations = "declare a : array[1:3] of integer\ndeclare n : integer\n";
+    return check("BYREF and BYVAL parameters", outputOf(program), "2\n5\n0\n5\n9\n") &
+           check("scalar for an ARRAY parameter",
+                 outputOf(declarations + "procedure show(byval v : array of integer)\n"
+                                         "    output v[1]\nendprocedure\ncall show(n)\n"),
+                 "Compiler error: n does not match the type of parameter v. Line 6, column 11\n") &
+           check("array for a BYREF scalar parameter",
+                 outputOf(declarations + "procedure bump(byref x : integer)\n"
+                                         "    x <- x + 1\nendprocedure\ncall bump(a)\n"),
+                 "Compiler error: a does not match the type of parameter x. Line 6, column 11\n");
+}
+
+// pure FUNCTIONs that call themselves other than in tail position answer
+// repeated arguments from a cache; --no-memoize leaves that to a MEMOIZE
+// pragma
+static bool memoizationTests() {
+    const string fib = R"(function fib(n : integer) returns integer
+    if n < 2 then
+        return n
+    endif
+    return fib(n - 1) + fib(n - 2)
+endfunction
+output fib(30)
+)";
+    // past 65536 results the least recently used ones make way, and the
+    // last two arguments are the most recent
+    const string squares = R"(// MEMOIZE
+function sq(n : integer) returns integer
+    return n * n
+endfunction
+declare i, total : integer
+total <- 0
+for i <- 1 to 70000
+    total <- total + sq(i)
+next i
+output sq(70000) + sq(69999) - sq(1)
+)";
+    // sq is pure, but only worth caching for squares, which recurses
+    const string helper = R"(function sq(n : integer) returns integer
+    return n * n
+endfunction
+function squares(n : integer) returns integer
+    if n = 0 then
+        return 0
+    endif
+    return sq(n) + squares(n - 1)
+endfunction
+output squares(3)
+output squares(4)
+)";
+    const string sumto = R"(function sumto(n : integer, acc : integer) returns integer
+    if n = 0 then
+        return acc
+    endif
+    return sumto(n - 1, acc + n)
+endfunction
+output sumto(100000, 0)
+)";
+    // a NaN argument matches no cached result, not even its own
+    const string nan = R"(// MEMOIZE
+function twice(x : real) returns real
+    return x * 2.0
+endfunction
+declare z, r : real
+z <- 0.0
+r <- twice(0.0 / z)
+r <- twice(0.0 / z)
+output twice(2.0)
+)";
+    const auto memoized = [](const string &program, const CompileOptions &options = {}) {
+        VirtualMachine vm;
+        vm.setOptions(options);
+        const string output = outputOf(vm, program);
+        return output + printed([&] { vm.printMemoization(); });
+    };
+    CompileOptions calls;
+    calls.inlining = false;
+    CompileOptions pragmaOnly;
+    pragmaOnly.memoize = false;
+    VirtualMachine tail;
+    const string tailOutput = outputOf(tail, sumto);
+    return check("memoized FUNCTION", memoized(fib),
+                 "832040\nMemoized fib: 28 hits, 31 misses, 31 results cached\n") &
+           check("memoization evicts the least recently used results", memoized(squares),
+                 "9799860000\nMemoized sq: 2 hits, 70001 misses, 65536 results cached\n") &
+           check("non-recursive FUNCTION is not memoized", memoized(helper, calls),
+                 "14\n30\nMemoized squares: 1 hits, 5 misses, 5 results cached\n") &
+           check("tail-recursive FUNCTION is not memoized",
+                 tailOutput + printed([&] { tail.printMemoization(); }) + stackDepth(tail),
+                 "5000050000\nflat") &
+           check("NaN arguments are not memoized", memoized(nan),
+                 "4\nMemoized twice: 0 hits, 1 misses, 1 results cached\n") &
+           check("--no-memoize", memoized(fib, pragmaOnly), "832040\n") &
+           check("--no-memoize with a MEMOIZE pragma", memoized("// MEMOIZE\n" + fib, pragmaOnly),
+                 "832040\nMemoized fib: 28 hits, 31 misses, 31 results cached\n");
+}
+
+// CASE takes the first label that matches: exact values, ranges, TRUE
+// and FALSE, or OTHERWISE when none does
+static bool caseTests() {
+    const string program = R"(declare i : integer
+for i <- 0 to 7
+    case of i
+        1 : output "one"
+        1 : output "again"
+        2 to 4 : output "low"
+        3 : output "three"
+        1000000 : output "far"
+        otherwise : output "other"
+    endcase
+next i
+case of 1000000
+    1 : output "one"
+    1000000 : output "far"
+endcase
+case of 5
+    1 : output "unmatched"
+endcase
+declare b : boolean
+b <- false
+case of b
+    true : output "yes"
+    false : output "no"
+endcase
+case of 'c'
+    'a' to 'b' : output "ab"
+    'c' to 'd' : output "cd"
+endcase
+case of "pear"
+    "apple" : output 1
+    "pear" : output 2
+endcase
+)";
+    return check("CASE", outputOf(program),
+                 "\"other\"\n\"one\"\n\"low\"\n\"low\"\n\"low\"\n\"other\"\n\"other\"\n"
+                 "\"other\"\n\"far\"\n\"no\"\n\"cd\"\n2\n");
+}
+
+// a CONSTANT is computed while compiling, from literals and earlier
+// constants, and nothing may write to it
+static bool constantTests() {
+    return check("CONSTANT",
+                 outputOf("constant k = 2 * 3 + 1\nconstant name = \"n\" & \"ame\"\n"
+                          "constant big = k * k - 1\noutput k\noutput big\noutput name\n"),
+                 "7\n48\n\"name\"\n") &
+           check("CONSTANT from a variable",
+                 outputOf("declare x : integer\nx <- 1\nconstant k = x + 1\n"),
+                 "Compile error: CONSTANT k must be computed from literals and constants of "
+                 "matching types. Line 3, column 18\n") &
+           check("assigning to a CONSTANT", outputOf("constant k = 7\nk <- 3\n"),
+                 "Compile error: Cannot assign to constant k. Line 2, column 1\n") &
+           check("assigning to a CONSTANT in a procedure",
+                 outputOf("constant k = 7\nprocedure p()\n    k <- 1\nendprocedure\ncall p()\n"),
+                 "Compile error: Cannot assign to constant k. Line 3, column 5\n") &
+           check("declaring a CONSTANT's name", outputOf("constant k = 7\ndeclare k : integer\n"),
+                 "Compile error: k is already declared as a constant. Line 2, column 13\n");
+}
+
+// an expression only moves out of a loop when nothing in the loop writes
+// what it reads, through an assignment, a CALL or the FOR iterator
+static bool hoistingTests() {
+    const string program = R"(declare a, b, i, x : integer
+procedure grow()
+    b <- b + 1
+endprocedure
+a <- 2
+b <- 3
+i <- 0
+while i < 3 do
+    x <- a * b + 1
+    output x
+    a <- a + 1
+    i <- i + 1
+endwhile
+while b < 5 do
+    output a * b
+    call grow()
+endwhile
+for i <- 1 to 2
+    output a * b - i
+    b <- b * 2
+next i
+procedure scale(n : integer)
+    declare j, k : integer
+    k <- 1
+    for j <- 1 to 3
+        output n * k
+        k <- k + 1
+    next j
+endprocedure
+call scale(10)
+)";
+    const string expected = "7\n10\n13\n15\n20\n24\n48\n10\n20\n30\n";
+    CompileOptions eager;
+    eager.eager = true;
+    return check("loop-invariant code motion", outputOf(program), expected) &
+           check("loop-invariant code motion (eager)", outputOf(program, eager), expected);
+}
+
+// a value computed before a jump target, or on one path into it, is not
+// reused after it
+static bool subexpressionTests() {
+    const string program = R"(declare a, b, x, y, i : integer
+declare flag : boolean
+a <- 1
+b <- 2
+x <- 0
+flag <- false
+if flag then
+    a <- 10
+    x <- a * b + a
+endif
+y <- a * b + a
+output x
+output y
+i <- 0
+while i < 2 do
+    output a * b + i
+    i <- i + 1
+    a <- a + 1
+endwhile
+procedure p(n : integer)
+    declare m : integer
+    m <- n * n - 1
+    if n > 2 then
+        n <- 1
+        m <- n * n - 1
+    endif
+    output n * n - 1
+endprocedure
+call p(5)
+call p(2)
+)";
+    return check("common subexpressions across jump targets", outputOf(program),
+                 "0\n3\n2\n5\n0\n3\n");
+}
+
+// an unrolled FOR loop runs as many passes as the loop as written, and
+// leaves its iterator where that would, whatever the trip count
+static bool unrollingTests() {
+    const string program = R"(declare i, total : integer
+total <- 0
+for i <- 1 to 7
+    total <- total + i
+next i
+output total
+output i
+total <- 0
+for i <- 5 to 1
+    total <- total + 1
+next i
+output total
+output i
+for i <- 3 to 3
+    output i * 10
+next i
+procedure sum(n : integer)
+    declare j, s : integer
+    s <- 0
+    for j <- 1 to 10
+        s <- s + j * n
+    next j
+    output s
+endprocedure
+call sum(2)
+)";
+    bool passed = true;
+    for (const size_t factor : {1, 3, 4, 8}) {
+        CompileOptions options;
+        options.unroll = factor;
+        passed &= check("FOR loops unrolled " + std::to_string(factor) + " times",
+                        outputOf(program, options), "28\n8\n0\n5\n30\n110\n");
+    }
+    return passed;
+}
+
+// i * c + d in a FOR loop is advanced by c each pass instead of being
+// multiplied out, unless the body writes the iterator itself
+static bool strengthReductionTests() {
+    const string program = R"(declare i : integer
+declare a : array[1:20] of integer
+procedure skip(byref x : integer)
+    x <- x + 2
+endprocedure
+for i <- 1 to 4
+    output i * 3 + 1
+next i
+for i <- 1 to 10
+    output i * 3 + 1
+    i <- i + 1
+next i
+for i <- 1 to 10
+    a[i * 2] <- i
+    call skip(i)
+next i
+output a[2]
+output a[8]
+output a[14]
+output a[20]
+procedure local()
+    declare j : integer
+    for j <- 1 to 9
+        output j * 5
+        j <- j * 2
+    next j
+endprocedure
+call local()
+)";
+    const string expected = "4\n7\n10\n13\n4\n10\n16\n22\n28\n1\n4\n7\n10\n5\n15\n35\n";
+    // both sides of the + are kept, the right one first
+    const string operands = R"(declare c, i, x : integer
+function f(n : integer) returns integer
+    declare j, y : integer
+    for j <- 1 to n
+        y <- j * 2 + (j + 9) * n
+    next j
+    return y
+endfunction
+c <- 3
+for i <- 1 to 6
+    x <- i * 2 + (i + 9) * c
+next i
+output x
+)";
+    CompileOptions calls;
+    calls.inlining = false;
+    CompileOptions eager;
+    eager.eager = true;
+    return check("strength reduction", outputOf(program), expected) &
+           check("strength reduction (no inlining)", outputOf(program, calls), expected) &
+           check("strength reduction of two operands", outputOf(operands), "57\n") &
+           check("strength reduction of two operands (eager)", outputOf(operands, eager), "57\n");
+}
+
+bool invokeTests(bool benchmark, bool lexer) {
     const vector<string> tests = {
         {"OUTPUT 1\n\n\n\n"},
         {"OUTPUT 10 + 5"},
@@ -41,7 +772,8 @@ void invokeTests(bool benchmark, bool lexer) {
         {"OUTPUT ((0) + -1)"},
         {"OUTPUT NOT TRUE"},
         {"OUTPUT TRUE AND NOT FALSE"},
-        {"OUTPUT 123 > 91 AND 139 > 123"}
+        {"OUTPUT 123 > 91 AND 139 > 123"},
+        {"// comment\nOUTPUT 1 // trailing\nOUTPUT 2"}
     };
 
     const vector<string> iotests = {
@@ -69,12 +801,12 @@ void invokeTests(bool benchmark, bool lexer) {
                 cout << "Lexer:" << endl;
                 if (benchmark) {
                     START_TIMER;
-                    lexer.initLexer(&testn);
-                    auto TokenList = lexer.makeTokens(true);
+                    lexer.initLexer(testn);
+                    lexer.makeTokens(true);
                     STOP_TIMER;
                 } else {
-                    lexer.initLexer(&testn);
-                    auto TokenList = lexer.makeTokens(true);
+                    lexer.initLexer(testn);
+                    lexer.makeTokens(true);
                 }
             } else {
                 if (benchmark) {
@@ -93,4 +825,23 @@ void invokeTests(bool benchmark, bool lexer) {
             << ") " << "test(s) Passed!" << Modifier(AnsiCode::FG_DEFAULT) << endl;
         ++idx;
     }
+
+    bool passed = true;
+    passed &= imageTests();
+    passed &= cacheTests();
+    passed &= parallelLexingTests();
+    passed &= replTests();
+    passed &= lazyCompileTests();
+    passed &= inliningTests();
+    passed &= tailCallTests();
+    passed &= frameTests();
+    passed &= parameterTests();
+    passed &= memoizationTests();
+    passed &= caseTests();
+    passed &= constantTests();
+    passed &= hoistingTests();
+    passed &= subexpressionTests();
+    passed &= unrollingTests();
+    passed &= strengthReductionTests();
+    return passed;
 }
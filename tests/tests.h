@@ -1,5 +1,6 @@
 #pragma once
 
-void invokeTests(bool benchmark, bool lexer);
+// false if any test printed something other than what it expects
+bool invokeTests(bool benchmark, bool lexer);
 void invokeArithmeticTests(bool benchmark, bool lexer);
 void invokeIOtests(bool benchmark, bool lexer);
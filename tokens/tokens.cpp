@@ -1,9 +1,62 @@
 #include "tokens.h"
 #include "../common.h"
+#include "../symbols/symbols.h"
+#include <algorithm>
 
 Token::Token(TokenType type, int line, int column, const Value& literal)
     : type(type), line(line), column(column), literal(literal) {}
 
+TokenBuffer::TokenBuffer(std::pmr::memory_resource *resource)
+    : types(resource), positions(resource), literalIdx(resource), literals(resource) {}
+
+uint32_t TokenBuffer::pack(int line, int column) {
+    // columns past the packed width are clamped; they only feed diagnostics
+    const uint32_t l = std::min<uint32_t>(line, lineMax);
+    const uint32_t c = std::min<uint32_t>(column, columnMask);
+    return (l << columnBits) | c;
+}
+
+void TokenBuffer::push(TokenType type, int line, int column) {
+    types.push_back(type);
+    positions.push_back(pack(line, column));
+    literalIdx.push_back(noLiteral);
+}
+
+void TokenBuffer::push(TokenType type, int line, int column, Value &&literal) {
+    types.push_back(type);
+    positions.push_back(pack(line, column));
+    literalIdx.push_back(static_cast<uint32_t>(literals.size()));
+    literals.emplace_back(std::move(literal));
+}
+
+void TokenBuffer::reserve(size_t n) {
+    types.reserve(n);
+    positions.reserve(n);
+    literalIdx.reserve(n);
+}
+
+const Value &TokenBuffer::literal(size_t i) const {
+    static const Value none = std::monostate{};
+    const auto l = literalIdx[i];
+    return l == noLiteral ? none : literals[l];
+}
+
+Token TokenBuffer::at(size_t i) const {
+    return Token(type(i), line(i), column(i), literal(i));
+}
+
+void TokenRing::push(TokenType type, int line, int column, Value &&literal) {
+    const size_t slot = count++ & mask;
+    types[slot] = type;
+    lines[slot] = line;
+    columns[slot] = column;
+    literals[slot] = std::move(literal);
+}
+
+Token TokenRing::at(size_t i) const {
+    return Token(type(i), line(i), column(i), literal(i));
+}
+
 const char *TOKEN_TO_STR[] {
     "INTEGER", "REAL", "CHAR", "STRING", "DATE", "BOOLEAN",
 
@@ -81,6 +134,10 @@ std::ostream &operator<<(std::ostream &os, const Value& l) {
         } else {
             os << "FALSE";
         }
+    } else if (std::holds_alternative<Symbol>(l)) {
+        os << SymbolTable::global().name(std::get<Symbol>(l));
+    } else if (std::holds_alternative<std::shared_ptr<ValueArray>>(l)) {
+        os << "ARRAY";
     } else if (std::holds_alternative<std::monostate>(l)) {
         os << "";
     }
@@ -1,5 +1,7 @@
 #pragma once
 #include "../common.h"
+#include <array>
+#include <memory_resource>
 
 
 typedef enum class TokenType : uint8_t {
@@ -66,6 +68,56 @@ struct Token {
     Token(TokenType type, int line, int column, const Value &literal = std::monostate{});
 };
 
+// Structure-of-arrays token stream: one byte per type, one packed word per
+// position and an index into a side table for the few tokens with literals.
+class TokenBuffer {
+    public:
+        static constexpr uint32_t noLiteral = UINT32_MAX;
+        static constexpr int columnBits = 12;
+        static constexpr uint32_t columnMask = (1u << columnBits) - 1;
+        static constexpr uint32_t lineMax = UINT32_MAX >> columnBits;
+        explicit TokenBuffer(std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+        void push(TokenType type, int line, int column);
+        void push(TokenType type, int line, int column, Value &&literal);
+        void reserve(size_t n);
+        size_t size() const { return types.size(); }
+        TokenType type(size_t i) const { return types[i]; }
+        int line(size_t i) const { return positions[i] >> columnBits; }
+        int column(size_t i) const { return positions[i] & columnMask; }
+        const Value &literal(size_t i) const;
+        Token at(size_t i) const;
+    private:
+        static uint32_t pack(int line, int column);
+        std::pmr::vector<TokenType> types;
+        std::pmr::vector<uint32_t> positions;
+        std::pmr::vector<uint32_t> literalIdx;
+        std::pmr::vector<Value> literals;
+};
+
+// Fixed window over the tail of a token stream, filled on demand by the
+// streaming lexer. Token i lives in slot i & mask, so only the last
+// `capacity` tokens pushed remain addressable.
+class TokenRing {
+    public:
+        static constexpr size_t capacity = 8;
+        static constexpr size_t mask = capacity - 1;
+        static_assert((capacity & mask) == 0, "capacity must be a power of two");
+        void push(TokenType type, int line, int column, Value &&literal = std::monostate{});
+        void clear() { count = 0; }
+        size_t size() const { return count; }
+        TokenType type(size_t i) const { return types[i & mask]; }
+        int line(size_t i) const { return lines[i & mask]; }
+        int column(size_t i) const { return columns[i & mask]; }
+        const Value &literal(size_t i) const { return literals[i & mask]; }
+        Token at(size_t i) const;
+    private:
+        std::array<TokenType, capacity> types {};
+        std::array<int, capacity> lines {};
+        std::array<int, capacity> columns {};
+        std::array<Value, capacity> literals {};
+        size_t count {0};
+};
+
 std::ostream &operator<<(std::ostream &os, const TokenType &t);
 std::ostream &operator<<(std::ostream &os, const Token &t);
 std::ostream &operator<<(std::ostream &os, const Value& l);
@@ -1,17 +1,148 @@
 #include "vm.h"
 #include "../common.h"
+#include "../symbols/symbols.h"
+#include "../image/image.h"
 #include <algorithm>
+#include <cstring>
 #include <random>
 #include <variant>
 
-inline bool VirtualMachine::isNumber(Value v) {
+inline bool VirtualMachine::isNumber(const Value &v) {
     return (holds_alternative<double>(v) || holds_alternative<i64>(v));
 }
 
-template <typename T> inline bool isType(Value v) {
+template <typename T> inline bool isType(const Value &v) {
     return (holds_alternative<T>(v));
 }
 
+inline bool VirtualMachine::isAssignable(const Value &v, TokenType type) {
+    switch (type) {
+    case TokenType::Integer: return holds_alternative<i64>(v);
+    case TokenType::Boolean: return holds_alternative<bool>(v);
+    case TokenType::String: return holds_alternative<string>(v);
+    case TokenType::Real: return holds_alternative<double>(v);
+    case TokenType::Char: return holds_alternative<char>(v);
+    case TokenType::Array: return holds_alternative<std::shared_ptr<ValueArray>>(v);
+    default: return false;
+    }
+}
+
+inline std::optional<Value> &VirtualMachine::variable(vector<std::optional<Value>> &table, Symbol name) {
+    if (table.size() <= name.id) {
+        table.resize(SymbolTable::global().size());
+    }
+    return table[name.id];
+}
+
+static string nameOf(Symbol name) {
+    return string(SymbolTable::global().name(name));
+}
+
+// a frame slot of the running procedure, or the variable it was bound to
+// if it is a BYREF parameter
+inline Value &VirtualMachine::local(size_t slot) {
+    Value &value = slots[base + slot];
+    if (const auto reference = std::get_if<Reference>(&value)) {
+        return target(*reference);
+    }
+    return value;
+}
+
+inline Value &VirtualMachine::target(const Reference &reference) {
+    if (reference.global) {
+        return *variable(globals, Symbol{reference.index});
+    }
+    return slots[reference.index];
+}
+
+inline ValueArray &VirtualMachine::array(const Value &value) {
+    const auto valueArray = std::get_if<std::shared_ptr<ValueArray>>(&value);
+    if (!valueArray) {
+        stringstream ss;
+        ss << "'" << value << "' is not an array";
+        Error.report(position, "Runtime", ss.str());
+    }
+    return **valueArray;
+}
+
+// the array held by `value`, copied first if anyone else still shares it
+inline ValueArray &VirtualMachine::writableArray(Value &value) {
+    array(value);
+    auto &valueArray = get<std::shared_ptr<ValueArray>>(value);
+    if (valueArray.use_count() > 1) {
+        valueArray = std::make_shared<ValueArray>(*valueArray);
+    }
+    return *valueArray;
+}
+
+inline Value &VirtualMachine::element(ValueArray &valueArray, i64 index) {
+    if (index > valueArray.ub || index < valueArray.lb) {
+        Error.report(position, "Out of bounds",
+                     "index '" + std::to_string(index) +
+                         "' is out of bounds for " + nameOf(valueArray.name) + "[" +
+                         std::to_string(valueArray.lb) + ":" +
+                         std::to_string(valueArray.ub) + "]");
+    }
+    return valueArray.array[index - valueArray.lb];
+}
+
+inline void VirtualMachine::setElement(ValueArray &valueArray, i64 index, Value newValue) {
+    Value &slot = element(valueArray, index);
+    if (!isAssignable(newValue, valueArray.type)) {
+        stringstream ss;
+        ss << "type of array '" << valueArray.name << "' is incompatible with " << newValue;
+        Error.report(position, "Runtime", ss.str());
+    }
+    slot = std::move(newValue);
+}
+
+// by its bits, since -Ofast lets std::isnan assume there are no NaNs
+static bool isNaN(double d) {
+    uint64_t bits;
+    std::memcpy(&bits, &d, sizeof(bits));
+    return (bits & ~(uint64_t {1} << 63)) > 0x7ff0000000000000;
+}
+
+// Runs procedure `slot` on top of the current one. A memoized FUNCTION
+// called with arguments it has seen before returns its earlier result
+// instead; otherwise its arguments are kept for EndFunction to file the
+// result under. A NaN argument is equal to nothing, not even itself, so
+// the cache's ordering cannot file it and such a call just runs.
+inline void VirtualMachine::call(size_t slot) {
+    Function &function = *compiler.functions[slot];
+    if (!function.compiled) {
+        compiler.compileFunction(function);
+    }
+    bool memoized = false;
+    if (function.memoize &&
+        std::none_of(valueStack.end() - function.arity, valueStack.end(), [](const Value &v) {
+            return holds_alternative<double>(v) && isNaN(get<double>(v));
+        })) {
+        if (memos.size() <= slot) {
+            memos.resize(compiler.functions.size());
+        }
+        Memo &memo = memos[slot];
+        vector<Value> arguments(valueStack.end() - function.arity, valueStack.end());
+        const auto it = memo.results.find(arguments);
+        if (it != memo.results.end()) {
+            ++memo.hits;
+            memo.recent.splice(memo.recent.begin(), memo.recent, it->second.second);
+            valueStack.resize(valueStack.size() - function.arity);
+            valueStack.push_back(it->second.first);
+            return;
+        }
+        ++memo.misses;
+        memoCalls.emplace_back(slot, std::move(arguments));
+        memoized = true;
+    }
+    frames.push_back({code, offset, base, memoized});
+    base = slots.size();
+    slots.resize(base + function.localCount);
+    valueStack.reserve(valueStack.size() + function.maxStack);
+    code = &function.chunk;
+    offset = 0;
+}
+
 inline Value VirtualMachine::pop() {
     const auto value = valueStack.back();
     valueStack.pop_back();
@@ -318,10 +449,14 @@ inline void VirtualMachine::Concatenate(Value v1, Value v2) {
     return;
 }
 
-void VirtualMachine::run() {
-    for (offset = 0; offset < chunk->bytecode.size();) {
-        position = compiler.chunkPosition[offset];
-        const auto opCode = static_cast<OpCode>(chunk->read(offset++));
+void VirtualMachine::run(size_t start) {
+    code = chunk.get();
+    memoCalls.clear();
+    base = 0;
+    slots.assign(compiler.moduleLocals, std::monostate{});
+    for (offset = start; offset < code->size();) {
+        position = code->position(offset);
+        const auto opCode = static_cast<OpCode>(code->read(offset++));
         printValueStack(opCode);
         switch (opCode) {
         case (OpCode::Builtin): {
@@ -329,103 +464,112 @@ void VirtualMachine::run() {
             break;
         }
         case (OpCode::Constant): {
-            const auto idx = static_cast<uint16_t>(chunk->read(offset++));
-            const auto idx1 = static_cast<uint16_t>(chunk->read(offset++));
+            const auto idx = static_cast<uint16_t>(code->read(offset++));
+            const auto idx1 = static_cast<uint16_t>(code->read(offset++));
             valueStack.push_back(
-                chunk->getConstant(((idx << 8) & 0xff00) | (idx1 & 0xff)));
+                code->getConstant(((idx << 8) & 0xff00) | (idx1 & 0xff)));
             break;
         }
         case (OpCode::Call): {
-            const auto idx = static_cast<uint16_t>(chunk->read(offset++));
-            const auto idx1 = static_cast<uint16_t>(chunk->read(offset++));
-            const auto nidx =
-                chunk->getConstant(((idx << 8) & 0xff00) | (idx1 & 0xff));
-
-            reg.push_back(offset);
-            offset = get<i64>(nidx);
+            const auto idx = static_cast<uint16_t>(code->read(offset++));
+            const auto idx1 = static_cast<uint16_t>(code->read(offset++));
+            call(((idx << 8) & 0xff00) | (idx1 & 0xff));
+            break;
+        }
+        case (OpCode::TailCall): {
+            const auto idx = static_cast<uint16_t>(code->read(offset++));
+            const auto idx1 = static_cast<uint16_t>(code->read(offset++));
+            const size_t slot = ((idx << 8) & 0xff00) | (idx1 & 0xff);
+            Function &function = *compiler.functions[slot];
+            // a memoized callee needs a frame of its own to store its result
+            if (function.memoize) {
+                call(slot);
+                break;
+            }
+            if (!function.compiled) {
+                compiler.compileFunction(function);
+            }
+            // the callee returns straight to our caller, so it reuses our frame
+            slots.resize(base);
+            slots.resize(base + function.localCount);
+            valueStack.reserve(valueStack.size() + function.maxStack);
+            code = &function.chunk;
+            offset = 0;
             break;
         }
         case (OpCode::EndFunction): {
-            offset = reg.back();
-            reg.pop_back();
+            if (frames.back().memoized) {
+                auto &[slot, arguments] = memoCalls.back();
+                Memo &memo = memos[slot];
+                if (!memo.results.count(arguments)) {
+                    if (memo.results.size() >= maxMemoized) {
+                        memo.results.erase(memo.recent.back());
+                        memo.recent.pop_back();
+                    }
+                    memo.recent.push_front(arguments);
+                    memo.results.emplace(std::move(arguments),
+                                         std::make_pair(valueStack.back(), memo.recent.begin()));
+                }
+                memoCalls.pop_back();
+            }
+            slots.resize(base);
+            code = frames.back().chunk;
+            offset = frames.back().offset;
+            base = frames.back().base;
+            frames.pop_back();
             break;
         }
 
         case (OpCode::DefineLocal): {
-            const string name = get<string>(pop());
-            auto it = locals.find(name);
-            if (it != locals.end()) {
-                Error.report(position, "Runtime",
-                             "Local '" + name + "' already defined");
-            }
-            locals.emplace(name, std::monostate{});
+            slots[base + static_cast<size_t>(code->read(offset++))] = std::monostate{};
             break;
         }
         case (OpCode::DefineLocalArray): {
-            auto name = get<string>(pop());
-            auto ub = get<i64>(pop());
-            auto lb = get<i64>(pop());
+            const auto slot = static_cast<size_t>(code->read(offset++));
+            const auto type = static_cast<TokenType>(code->read(offset++));
+            const auto name = get<Symbol>(pop());
+            const auto ub = get<i64>(pop());
+            const auto lb = get<i64>(pop());
             std::vector<Value> arr(ub - lb + 1);
-            auto it = locals.find(name);
-            if (it != locals.end()) {
-                Error.report(position, "Runtime",
-                             "Local '" + name + "' already defined");
-            }
-            locals.emplace(name, std::monostate{});
-            valueArrayMap.emplace(
-                name, std::make_unique<ValueArray>(arr, ub, lb, name));
+            slots[base + slot] = std::make_shared<ValueArray>(arr, ub, lb, name, type);
             break;
         }
 
         case (OpCode::DefineGlobal): {
-            const string name = get<string>(pop());
-            auto it = globals.find(name);
-            if (it != globals.end()) {
+            const Symbol name = get<Symbol>(pop());
+            auto &global = variable(globals, name);
+            if (global) {
                 Error.report(position, "Runtime",
-                             "Global '" + name + "' already defined");
+                             "Global '" + nameOf(name) + "' already defined");
             }
-            globals.emplace(name, std::monostate{});
+            global = std::monostate{};
             break;
         }
         case (OpCode::DefineGlobalArray): {
-            auto name = get<string>(pop());
+            auto name = get<Symbol>(pop());
             auto ub = get<i64>(pop());
             auto lb = get<i64>(pop());
             std::vector<Value> arr(ub - lb + 1);
-            auto it = globals.find(name);
-            if (it != globals.end()) {
+            auto &global = variable(globals, name);
+            if (global) {
                 Error.report(position, "Runtime",
-                             "Global '" + name + "' already defined");
+                             "Global '" + nameOf(name) + "' already defined");
             }
-            globals.emplace(name, std::monostate{});
-            valueArrayMap.emplace(
-                name, std::make_unique<ValueArray>(arr, ub, lb, name));
+            global = std::make_shared<ValueArray>(arr, ub, lb, name,
+                                                  compiler.globalsType[name.id]);
             break;
         }
 
         case (OpCode::SetGlobal): {
             const Value newValue = pop();
-            const string name = get<string>(valueStack.back());
-            const auto it = globals.find(name);
-            if (it == globals.end()) {
+            const Symbol name = get<Symbol>(valueStack.back());
+            auto &global = variable(globals, name);
+            if (!global) {
                 Error.report(position, "Runtime",
-                             "global '" + name + "' is undefined");
-            }
-            if (holds_alternative<i64>(newValue) &&
-                compiler.globalsType[name] == TokenType::Integer) {
-                globals[name] = get<i64>(newValue);
-            } else if (holds_alternative<bool>(newValue) &&
-                       compiler.globalsType[name] == TokenType::Boolean) {
-                globals[name] = get<bool>(newValue);
-            } else if (holds_alternative<string>(newValue) &&
-                       compiler.globalsType[name] == TokenType::String) {
-                globals[name] = get<string>(newValue);
-            } else if (holds_alternative<double>(newValue) &&
-                       compiler.globalsType[name] == TokenType::Real) {
-                globals[name] = get<double>(newValue);
-            } else if (holds_alternative<char>(newValue) &&
-                       compiler.globalsType[name] == TokenType::Char) {
-                globals[name] = get<char>(newValue);
+                             "global '" + nameOf(name) + "' is undefined");
+            }
+            if (isAssignable(newValue, compiler.globalsType[name.id])) {
+                global = newValue;
             } else {
                 stringstream ss;
                 ss << "type of global '" << name << "' is incompatible with "
@@ -436,209 +580,123 @@ void VirtualMachine::run() {
         }
 
         case (OpCode::SetGlobalArray): {
-            const Value newValue = pop();
-            const string name = get<string>(pop());
+            Value newValue = pop();
+            const Symbol name = get<Symbol>(pop());
             const i64 index = get<i64>(pop());
-
-            auto it = valueArrayMap.find(name);
-            if (it == valueArrayMap.end()) {
+            auto &global = variable(globals, name);
+            if (!global) {
                 Error.report(position, "Runtime",
-                             "global array'" + name + "' is undefined");
-            }
-            if (it->second->ub < index || it->second->lb > index) {
-                Error.report(position, "Out of bounds",
-                             "index '" + std::to_string(index) +
-                                 "' is out of bounds for " + name + "[" +
-                                 std::to_string(it->second->lb) + ":" +
-                                 std::to_string(it->second->ub) + "]");
-            }
-            if (holds_alternative<i64>(newValue) &&
-                compiler.globalsType[name] == TokenType::Integer) {
-                it->second->array[index] = get<i64>(newValue);
-            } else if (holds_alternative<bool>(newValue) &&
-                       compiler.globalsType[name] == TokenType::Boolean) {
-                it->second->array[index] = get<bool>(newValue);
-            } else if (holds_alternative<string>(newValue) &&
-                       compiler.globalsType[name] == TokenType::String) {
-                it->second->array[index] = get<string>(newValue);
-            } else if (holds_alternative<double>(newValue) &&
-                       compiler.globalsType[name] == TokenType::Real) {
-                it->second->array[index] = get<double>(newValue);
-            } else if (holds_alternative<char>(newValue) &&
-                       compiler.globalsType[name] == TokenType::Char) {
-                it->second->array[index] = get<char>(newValue);
-            } else {
-                stringstream ss;
-                ss << "type of global '" << name
-                   << "' is incompatible with array " << newValue;
-                Error.report(position, "Runtime", ss.str());
+                             "global array'" + nameOf(name) + "' is undefined");
             }
-            valueStack.emplace_back(newValue);
+            setElement(writableArray(*global), index, newValue);
+            valueStack.emplace_back(std::move(newValue));
             break;
         }
 
         case (OpCode::GetGlobal): {
-            // cout << "Hahahaha in getglobal, offset = " << offset << endl;
-            string name = get<string>(valueStack.back());
-            const auto it = globals.find(name);
-            if (it == globals.end()) {
+            const Symbol name = get<Symbol>(valueStack.back());
+            const auto &global = variable(globals, name);
+            if (!global) {
                 Error.report(position, "Runtime",
-                             "global '" + name + "' is undefined");
+                             "global '" + nameOf(name) + "' is undefined");
             }
-            if (isType<std::monostate>(it->second)) {
+            if (isType<std::monostate>(*global)) {
                 Error.report(position, "Runtime",
-                             "global identifier '" + name + "' is unbound");
+                             "global identifier '" + nameOf(name) + "' is unbound");
             }
-            valueStack.back() = it->second;
+            valueStack.back() = *global;
             break;
         }
 
         case (OpCode::GetGlobalArray): {
-            string name = get<string>(pop());
+            const Symbol name = get<Symbol>(pop());
             i64 index = get<i64>(pop());
-            const auto it2 = globals.find(name);
-            if (it2 == globals.end()) {
-                Error.report(position, "Runtime",
-                             "global array'" + name + "' is undefined");
-            }
-            const auto it = valueArrayMap.find(name);
-            if (it == valueArrayMap.end()) {
+            const auto &global = variable(globals, name);
+            if (!global) {
                 Error.report(position, "Runtime",
-                             "global Array'" + name + "' is unbound");
+                             "global array'" + nameOf(name) + "' is undefined");
             }
-            if (index > it->second->ub || index < it->second->lb) {
-                Error.report(position, "Out of bounds",
-                             "index '" + std::to_string(index) +
-                                 "' is out of bounds for " + name + "[" +
-                                 std::to_string(it->second->lb) + ":" +
-                                 std::to_string(it->second->ub) + "]");
-            }
-            valueStack.emplace_back(it->second->array[index]);
+            valueStack.emplace_back(element(array(*global), index));
             break;
         }
         case (OpCode::GetLocal): {
-            string name = get<string>(valueStack.back());
-            auto it = locals.find(name);
-            if (it == locals.end()) {
-                Error.report(position, "Runtime",
-                             "local '" + name + "' is undefined");
-            }
-            if (isType<std::monostate>(it->second)) {
+            const auto slot = static_cast<size_t>(code->read(offset++));
+            const Value &value = local(slot);
+            if (isType<std::monostate>(value)) {
                 Error.report(position, "Runtime",
-                             "local identifier '" + name + "' is unbound");
+                             "local in slot " + std::to_string(slot) + " is unbound");
             }
-            valueStack.back() = it->second;
+            valueStack.push_back(value);
             break;
         }
         case (OpCode::GetLocalArray): {
-            string name = get<string>(pop());
-            i64 index = get<i64>(pop());
-            const auto it2 = locals.find(name);
-            if (it2 == locals.end()) {
-                Error.report(position, "Runtime",
-                             "local array'" + name + "' is undefined");
-            }
-            const auto it = valueArrayMap.find(name);
-            if (it == valueArrayMap.end()) {
-                Error.report(position, "Runtime",
-                             "local Array'" + name + "' is unbound");
-            }
-            if (index > it->second->ub || index < it->second->lb) {
-                Error.report(position, "Out of bounds",
-                             "index '" + std::to_string(index) +
-                                 "' is out of bounds for " + name + "[" +
-                                 std::to_string(it->second->lb) + ":" +
-                                 std::to_string(it->second->ub) + "]");
-            }
-            valueStack.emplace_back(it->second->array[index]);
+            const auto slot = static_cast<size_t>(code->read(offset++));
+            const i64 index = get<i64>(valueStack.back());
+            valueStack.back() = element(array(local(slot)), index);
             break;
         }
 
         case (OpCode::SetLocal): {
-            const Value newValue = pop();
-            const string name = get<string>(valueStack.back());
-            const auto it = locals.find(name);
-            if (it == locals.end()) {
-                Error.report(position, "Runtime",
-                             "local identifier '" + name + "' is undefined");
-            }
-            if (holds_alternative<i64>(newValue) &&
-                compiler.localsType[name] == TokenType::Integer) {
-                locals[name] = get<i64>(newValue);
-            } else if (holds_alternative<bool>(newValue) &&
-                       compiler.localsType[name] == TokenType::Boolean) {
-                locals[name] = get<bool>(newValue);
-            } else if (holds_alternative<string>(newValue) &&
-                       compiler.localsType[name] == TokenType::String) {
-                locals[name] = get<string>(newValue);
-            } else if (holds_alternative<double>(newValue) &&
-                       compiler.localsType[name] == TokenType::Real) {
-                locals[name] = get<double>(newValue);
-            } else if (holds_alternative<char>(newValue) &&
-                       compiler.localsType[name] == TokenType::Char) {
-                locals[name] = get<char>(newValue);
-            } else {
+            const auto slot = static_cast<size_t>(code->read(offset++));
+            const auto type = static_cast<TokenType>(code->read(offset++));
+            Value newValue = pop();
+            if (!isAssignable(newValue, type)) {
                 stringstream ss;
-                ss << "type of local '" << name << "' is incompatible with "
+                ss << "type of local in slot " << slot << " is incompatible with "
                    << newValue;
                 Error.report(position, "Runtime", ss.str());
             }
+            local(slot) = std::move(newValue);
             break;
         }
 
         case (OpCode::SetLocalArray): {
-            const Value newValue = pop();
-            const string name = get<string>(pop());
+            const auto slot = static_cast<size_t>(code->read(offset++));
+            Value newValue = pop();
             const i64 index = get<i64>(pop());
+            setElement(writableArray(local(slot)), index, newValue);
+            valueStack.emplace_back(std::move(newValue));
+            break;
+        }
 
-            auto it = valueArrayMap.find(name);
-            if (it == valueArrayMap.end()) {
+        case (OpCode::RefGlobal): {
+            const Symbol name = get<Symbol>(valueStack.back());
+            if (!variable(globals, name)) {
                 Error.report(position, "Runtime",
-                             "local array'" + name + "' is undefined");
-            }
-            if (it->second->ub < index || it->second->lb > index) {
-                Error.report(position, "Out of bounds",
-                             "index '" + std::to_string(index) +
-                                 "' is out of bounds for " + name + "[" +
-                                 std::to_string(it->second->lb) + ":" +
-                                 std::to_string(it->second->ub) + "]");
-            }
-            if (holds_alternative<i64>(newValue) &&
-                compiler.localsType[name] == TokenType::Integer) {
-                it->second->array[index] = get<i64>(newValue);
-            } else if (holds_alternative<bool>(newValue) &&
-                       compiler.localsType[name] == TokenType::Boolean) {
-                it->second->array[index] = get<bool>(newValue);
-            } else if (holds_alternative<string>(newValue) &&
-                       compiler.localsType[name] == TokenType::String) {
-                it->second->array[index] = get<string>(newValue);
-            } else if (holds_alternative<double>(newValue) &&
-                       compiler.localsType[name] == TokenType::Real) {
-                it->second->array[index] = get<double>(newValue);
-            } else if (holds_alternative<char>(newValue) &&
-                       compiler.localsType[name] == TokenType::Char) {
-                it->second->array[index] = get<char>(newValue);
+                             "global '" + nameOf(name) + "' is undefined");
+            }
+            valueStack.back() = Reference{name.id, true};
+            break;
+        }
+        case (OpCode::RefLocal): {
+            // a BYREF parameter passed on refers to the same variable
+            const size_t slot = base + static_cast<size_t>(code->read(offset++));
+            if (const auto reference = std::get_if<Reference>(&slots[slot])) {
+                valueStack.push_back(*reference);
             } else {
-                stringstream ss;
-                ss << "type of local '" << name
-                   << "' is incompatible with array " << newValue;
-                Error.report(position, "Runtime", ss.str());
+                valueStack.push_back(Reference{static_cast<uint32_t>(slot), false});
             }
-            valueStack.emplace_back(newValue);
             break;
         }
-        case (OpCode::Pop): {
-            if (valueStack.empty()) {
-                break;
+        case (OpCode::BindLocal): {
+            const auto slot = static_cast<size_t>(code->read(offset++));
+            const auto type = static_cast<TokenType>(code->read(offset++));
+            const Reference reference = get<Reference>(pop());
+            // the compiler checked the declared types; only an array can
+            // stand in for an array
+            if ((type == TokenType::Array) != isType<std::shared_ptr<ValueArray>>(target(reference))) {
+                Error.report(position, "Runtime",
+                             "argument for the BYREF parameter in slot " + std::to_string(slot) +
+                                 (type == TokenType::Array ? " is not an array" : " is an array"));
             }
-            valueStack.pop_back();
+            slots[base + slot] = reference;
             break;
         }
-        case (OpCode::PopLocal): {
+        case (OpCode::Pop): {
             if (valueStack.empty()) {
                 break;
             }
-            locals.erase(get<string>(pop()));
+            valueStack.pop_back();
             break;
         }
         case (OpCode::Equal): {
@@ -849,25 +907,63 @@ void VirtualMachine::run() {
             break;
         }
         case (OpCode::Jump): {
-            const auto distance = static_cast<size_t>(chunk->read(offset++));
+            const auto distance = static_cast<size_t>(code->read(offset++));
             offset += distance;
             break;
         }
         case (OpCode::JumpNE): {
-            const auto distance = static_cast<size_t>(chunk->read(offset++));
+            const auto distance = static_cast<size_t>(code->read(offset++));
             if (get<bool>(valueStack.back()) == false) {
                 offset += distance;
             }
             break;
         }
         case (OpCode::Loop): {
-            const auto distance = static_cast<size_t>(chunk->read(offset++));
+            const auto distance = static_cast<size_t>(code->read(offset++));
             offset -= distance;
             break;
         }
+        case (OpCode::GetHoisted): {
+            const Value &value = slots[base + static_cast<size_t>(code->read(offset++))];
+            const auto distance = static_cast<size_t>(code->read(offset++));
+            if (!isType<std::monostate>(value)) {
+                valueStack.push_back(value);
+                offset += distance;
+            }
+            break;
+        }
+        case (OpCode::KeepLocal): {
+            slots[base + static_cast<size_t>(code->read(offset++))] = valueStack.back();
+            break;
+        }
+        case (OpCode::AdvanceLocal): {
+            Value &value = slots[base + static_cast<size_t>(code->read(offset++))];
+            const auto step = static_cast<signed char>(code->read(offset++));
+            if (!isType<std::monostate>(value)) {
+                value = get<i64>(value) + step;
+            }
+            break;
+        }
+        case (OpCode::Switch): {
+            const auto idx = static_cast<uint16_t>(code->read(offset++));
+            const auto idx1 = static_cast<uint16_t>(code->read(offset++));
+            offset = code->switches[((idx << 8) & 0xff00) | (idx1 & 0xff)].target(pop());
+            break;
+        }
+        case (OpCode::Leave): {
+            const auto idx = static_cast<uint16_t>(code->read(offset++));
+            const auto idx1 = static_cast<uint16_t>(code->read(offset++));
+            offset = code->switches[((idx << 8) & 0xff00) | (idx1 & 0xff)].end;
+            break;
+        }
         case (OpCode::IncrementGlobal): {
-            const string name = get<string>(pop());
-            globals[name] = get<i64>(globals[name]) + 1;
+            auto &global = variable(globals, get<Symbol>(pop()));
+            global = get<i64>(*global) + 1;
+            break;
+        }
+        case (OpCode::IncrementLocal): {
+            Value &value = local(static_cast<size_t>(code->read(offset++)));
+            value = get<i64>(value) + 1;
             break;
         }
         case (OpCode::Return): {
@@ -899,8 +995,27 @@ void VirtualMachine::printValueStack(OpCode opCode) {
     }
 }
 
-void VirtualMachine::interpret(string input) {
-    chunk = compiler.compile(input);
+void VirtualMachine::interpret(std::string_view input, const string &saveImage) {
+    // the module persists across REPL lines so procedures stay callable;
+    // whatever a statement left on the stack is dropped here
+    valueStack.clear();
+    frames.clear();
+    if (!chunk) {
+        chunk = std::make_unique<Chunk>();
+    }
+    // once the new code has run, only the procedures and globals it defined
+    // outlive it, so a REPL line leaves the module as it found it
+    const size_t codeSize = chunk->size();
+    const size_t constantCount = chunk->constantPool.size();
+    const size_t switchCount = chunk->switches.size();
+    const size_t start = compiler.compile(input, *chunk);
+    if (!saveImage.empty()) {
+        // only the compile cache asks for this; failing to fill it is not
+        // worth failing the run over
+        try {
+            image::write(saveImage, *chunk, compiler);
+        } catch (const std::exception &) {}
+    }
     if (Error.logging == true) {
         int step = 1;
         for (auto x : chunk->bytecode) {
@@ -925,6 +1040,77 @@ void VirtualMachine::interpret(string input) {
     }
     if (Error.logging) {
         chunk->disassembleChunk("OPCODE");
+        for (const auto &function : compiler.functions) {
+            function->chunk.disassembleChunk(nameOf(function->name));
+        }
+    }
+    try {
+        run(start);
+    } catch (...) {
+        chunk->truncate(codeSize, constantCount, switchCount);
+        throw;
+    }
+    chunk->truncate(codeSize, constantCount, switchCount);
+}
+
+void VirtualMachine::emitImage(std::string_view input, const string &path) {
+    // an image built ahead of time should cost nothing to compile later
+    compiler.options.eager = true;
+    chunk = std::make_unique<Chunk>();
+    compiler.compile(input, *chunk);
+    image::write(path, *chunk, compiler);
+}
+
+void VirtualMachine::runImage(std::shared_ptr<const MappedFile> file) {
+    valueStack.clear();
+    frames.clear();
+    chunk = std::make_unique<Chunk>();
+    image::load(std::move(file), *chunk, compiler);
+    if (Error.logging) {
+        chunk->disassembleChunk("OPCODE");
+        for (const auto &function : compiler.functions) {
+            function->chunk.disassembleChunk(nameOf(function->name));
+        }
+    }
+    run(0);
+}
+
+void VirtualMachine::printMemoization() const {
+    for (size_t slot = 0; slot < memos.size(); slot++) {
+        const Memo &memo = memos[slot];
+        if (memo.hits + memo.misses == 0) {
+            continue;
+        }
+        cout << "Memoized " << nameOf(compiler.functions[slot]->name) << ": "
+             << memo.hits << " hits, " << memo.misses << " misses, "
+             << memo.results.size() << " results cached" << endl;
+    }
+}
+
+void VirtualMachine::printMemory() const {
+    const size_t definedGlobals = std::count_if(globals.begin(), globals.end(),
+        [](const std::optional<Value> &v) { return v.has_value(); });
+    size_t arrays = 0, elements = 0, procedureBytes = 0, compiled = 0;
+    for (const auto &function : compiler.functions) {
+        procedureBytes += function->chunk.size();
+        compiled += function->compiled;
+    }
+    for (const auto &global : globals) {
+        if (const auto arr = global ? std::get_if<std::shared_ptr<ValueArray>>(&*global) : nullptr) {
+            ++arrays;
+            elements += (*arr)->array.size();
+        }
+    }
+    cout << "symbols:     " << SymbolTable::global().size() << endl
+         << "globals:     " << definedGlobals << " defined, " << globals.capacity() << " slots" << endl
+         << "arrays:      " << arrays << " (" << elements << " elements)" << endl
+         << "identifiers: " << compiler.identifiers.size() << endl
+         << "procedures:  " << compiler.functions.size() << " (" << compiled << " compiled, "
+         << procedureBytes << " bytes)" << endl
+         << "value stack: " << valueStack.size() << endl
+         << "frame slots: " << slots.size() << " (" << compiler.moduleLocals << " module)" << endl;
+    if (chunk) {
+        cout << "module:      " << chunk->size() << " bytes, "
+             << chunk->constantPool.size() << " constants" << endl;
     }
-    run();
 }
@@ -2,7 +2,11 @@
 #include "../chunk/chunk.h"
 #include "../common.h"
 #include "../compiler/compiler.h"
+#include "../source/source.h"
 #include <cmath>
+#include <list>
+#include <map>
+#include <optional>
 #include <sstream>
 
 
@@ -12,34 +16,83 @@ typedef struct ValueArray {
     vector<Value> array;
     i64 ub;
     i64 lb;
-    string name;
+    Symbol name;
+    // of the elements
+    TokenType type;
     ValueArray() = default;
-    ValueArray(vector<Value> &array, i64 ub, i64 lb, string name) :
-        array(array), ub(ub), lb(lb), name(name) {}
+    ValueArray(vector<Value> &array, i64 ub, i64 lb, Symbol name, TokenType type) :
+        array(array), ub(ub), lb(lb), name(name), type(type) {}
 } ValueArray;
 
 class VirtualMachine {
     public:
-        void interpret(string input);
+        // `saveImage`, when given, also receives the compiled image
+        void interpret(std::string_view input, const string &saveImage = "");
+        // --emit-bytecode: compile without running and save the image
+        void emitImage(std::string_view input, const string &path);
+        void runImage(std::shared_ptr<const MappedFile> file);
+        void setLexWorkers(unsigned workers) { compiler.setLexWorkers(workers); }
+        void setOptions(const CompileOptions &options) { compiler.options = options; }
+        void printMemory() const;
+        // hits and misses of every memoized FUNCTION called so far
+        void printMemoization() const;
+        // call frames room has been made for: at least the deepest the CALL
+        // stack has been
+        size_t framesReserved() const { return frames.capacity(); }
         vector<Value> valueStack {};
     private:
         ErrorReporter Error;
-        vector<uint8_t> reg;
+        // where each active CALL returns to, and the caller's frame
+        struct CallFrame {
+            const Chunk *chunk;
+            size_t offset;
+            size_t base;
+            // the callee's result goes into its memo table on return
+            bool memoized;
+        };
+        vector<CallFrame> frames;
+        // results of a memoized FUNCTION by its arguments; past
+        // maxMemoized of them, the least recently used one makes way.
+        // `recent` holds the arguments of each, most recently used first
+        struct Memo {
+            std::list<vector<Value>> recent;
+            std::map<vector<Value>, std::pair<Value, std::list<vector<Value>>::iterator>> results;
+            size_t hits {0};
+            size_t misses {0};
+        };
+        static constexpr size_t maxMemoized = 1 << 16;
+        vector<Memo> memos;
+        // function slot and arguments of each memoized call still running
+        vector<std::pair<size_t, vector<Value>>> memoCalls;
+        inline void call(size_t slot);
         void printValueStack(OpCode opCode);
         int line;
         Compiler compiler {};
-        void run();
+        void run(size_t start);
         inline Value pop();
         inline void Builtin();
-        inline bool isNumber(Value v);
+        inline bool isNumber(const Value &v);
+        inline bool isAssignable(const Value &v, TokenType type);
+        inline std::optional<Value> &variable(vector<std::optional<Value>> &table, Symbol name);
+        inline Value &local(size_t slot);
+        inline Value &target(const Reference &reference);
+        inline ValueArray &array(const Value &value);
+        inline ValueArray &writableArray(Value &value);
+        inline Value &element(ValueArray &valueArray, i64 index);
+        inline void setElement(ValueArray &valueArray, i64 index, Value newValue);
         inline void BinOp(Value v1, Value v2, char op);
         inline void LogicalBinOp(Value v1, Value v2, char op);
         inline void Concatenate(Value v1, Value v2);
         std::pair<int, int> position;
         std::unique_ptr<Chunk> chunk;
-        unordered_map<string, Value> globals {};
-        unordered_map<string, Value> locals  {};
-        unordered_map<string, std::unique_ptr<ValueArray>> valueArrayMap;
+        // the chunk `offset` points into: the module or a procedure's
+        const Chunk *code {nullptr};
+        // variables indexed by symbol id, arrays included; an empty
+        // optional is a name that was never defined
+        vector<std::optional<Value>> globals {};
+        // scalar locals of every active frame; the running one's start at `base`
+        vector<Value> slots {};
+        size_t base {0};
         size_t offset {0};
 };
 